@@ -1,3 +1,8 @@
+newoption({
+	trigger = "with-io-uring",
+	description = "Build the server with the io_uring reactor backend (needs liburing)",
+})
+
 workspace("portal")
 configurations({ "Debug", "Release" })
 
@@ -46,6 +51,10 @@ files({ "src/server/**.h", "src/server/**.c", "src/shared/**.c", "src/shared/**.
 includedirs({ "src/shared" })
 links({ "sqlite3", "argon2" })
 
+filter("options:with-io-uring")
+defines({ "PORTAL_IO_URING" })
+links({ "uring" })
+
 filter("configurations:Debug")
 defines({ "DEBUG" })
 symbols("On")
@@ -15,6 +15,9 @@ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
 IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
+#include "bufpool.h"
+#include "msgstore.h"
+#include "net.h"
 #include "socket_util.h"
 #include "warp/warp.h"
 #include <GL/gl.h>
@@ -34,6 +37,12 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #define WIN_INIT_W 1280
 #define WIN_INIT_H 720
 #define GLOBAL_MARGIN 25.0f
+// every client lands in the lobby until room selection exists
+#define LOBBY_ROOM 0
+// room left below the message list for the input field and send button
+#define MESSAGE_INPUT_AREA 120.0f
+// a message with the label of its sender in front
+#define MESSAGE_LINE_SIZE (MESSAGE_BUF_SIZE + 32)
 
 enum screens { LOGIN_SCREEN, MAIN_SCREEN };
 
@@ -50,11 +59,17 @@ typedef struct {
 	// -- main window --
 	wp_input_field message_input;
 	char message_buffer[MESSAGE_BUF_SIZE];
+	wp_virtual_list message_list;
+	// the store's dropped count when the list was last drawn, row i of the
+	// list is message message_list_dropped + i of everything received
+	uint64_t message_list_dropped;
+	// text of the rows in view, back to back and NUL terminated
+	char *visible_text;
+	size_t visible_cap;
 } state;
 
-// create global singleton of state and socket
+// create global singleton of state
 static state s;
-static int socket_fd;
 
 static void resizecb(GLFWwindow *win, int32_t w, int32_t h) {
 	s.winw = w;
@@ -64,15 +79,22 @@ static void resizecb(GLFWwindow *win, int32_t w, int32_t h) {
 }
 
 static void init_sockets() {
-	socket_fd = createTCPIPv4Socket();
-
 	// default localhost for now will fix to public ip later
-	struct sockaddr_in address = createIPv4Address("0.0.0.0", 8675);
-	int result =
-		connect(socket_fd, (struct sockaddr *)&address, sizeof(address));
+	if (net_start("0.0.0.0", 8675) != PORTAL_OK) {
+		return;
+	}
 
-	if (result == 0) {
-		printf("Connection was sucessful.\n");
+	// queued now, it goes out as soon as the connection is up
+	uint32_t room = htonl(LOBBY_ROOM);
+	net_send(PORTAL_OP_JOIN, &room, sizeof(room));
+}
+
+// runs every frame, everything but chat messages the network thread
+// received since the last. nothing else is handled yet
+static void handle_packets() {
+	packet_t packet;
+	while (net_poll(&packet)) {
+		portal_pool_free(packet.data);
 	}
 }
 
@@ -93,6 +115,7 @@ static void init_ui() {
 	memset(s.psswd_buffer, 0, MESSAGE_BUF_SIZE);
 	memset(s.message_buffer, 0, MESSAGE_BUF_SIZE);
 
+	s.message_list = (wp_virtual_list){.stick_to_end = true};
 	s.message_input = (wp_input_field){.width = 400,
 									   .buf = s.message_buffer,
 									   .buf_size = MESSAGE_BUF_SIZE,
@@ -109,30 +132,33 @@ static void init_ui() {
 
 static void terminate() {
 	wp_terminate();
-	close(socket_fd);
+	net_stop();
+	msgstore_free();
+	wp_virtual_list_free(&s.message_list);
+	free(s.visible_text);
 
 	glfwDestroyWindow(s.win);
 	glfwTerminate();
 }
 
 // TODO: prevent client from sending message if size is over 1024
-// makes max message size 1024-16 (for header and size bytes)
+// makes max message size 1024-20 (for the wire header and room prefix)
 static void send_text_message(char *line) {
 
 	// null terminator char is handled server side
 	size_t char_count = strlen(line);
 	if (char_count > 0) {
-
-		packet_t msg_packet;
-		msg_packet.header.id = 0;
-		strncpy(msg_packet.header.type, "MSG", 4);
-		msg_packet.data_size = char_count;
-		msg_packet.data = malloc(char_count);
-		memcpy(msg_packet.data, line, char_count);
-
-		portal_send_packet(socket_fd, &msg_packet);
-
-		free(msg_packet.data);
+		char payload[sizeof(portal_msg_prefix_t) + MESSAGE_BUF_SIZE];
+		portal_msg_prefix_t prefix = {.room = htonl(LOBBY_ROOM)};
+		memcpy(payload, &prefix, sizeof(prefix));
+		memcpy(payload + sizeof(prefix), line, char_count);
+
+		// only queued here, the network thread does the sending
+		if (net_send(PORTAL_OP_MSG, payload, sizeof(prefix) + char_count) !=
+			PORTAL_OK) {
+			printf("Error: message could not be queued\n");
+			return;
+		}
 	}
 
 	s.message_input.buf[0] = '\0';
@@ -206,7 +232,126 @@ static void render_login_screen() {
 	wp_div_end();
 }
 
+// the protocol has no way to look a user's name up yet, so senders are
+// shown by their user id. returns the length written
+static int format_message(const msgstore_room_t *room, uint32_t i,
+						  char *line, size_t size) {
+	uint32_t sender = room->msgs[i].sender;
+	int n = sender == 0
+				? snprintf(line, size, "guest: %s", msgstore_text(room, i))
+				: snprintf(line, size, "user #%u: %s", sender,
+						   msgstore_text(room, i));
+	if (n < 0) {
+		return 0;
+	}
+	// a long message is cut at the end of the line
+	return (size_t)n < size ? n : (int)size - 1;
+}
+
+// copies list row index out of the store, false if the message was
+// dropped since the frame started
+static bool copy_message(uint32_t index, char *line, size_t size) {
+	uint64_t seq = s.message_list_dropped + index;
+	bool found = false;
+	msgstore_lock();
+	const msgstore_room_t *room = msgstore_room(LOBBY_ROOM);
+	if (room != NULL && seq >= room->dropped &&
+		seq - room->dropped < room->count) {
+		format_message(room, seq - room->dropped, line, size);
+		found = true;
+	}
+	msgstore_unlock();
+	return found;
+}
+
+// asked once per message and width, the store is only locked while the
+// text is copied and not while it is laid out
+static float message_height(uint32_t index, float width, void *user_data) {
+	(void)user_data;
+	char line[MESSAGE_LINE_SIZE];
+	if (!copy_message(index, line, sizeof(line))) {
+		// the row goes away with the next frame's drop, a 0 height leaves
+		// the guess for new rows alone
+		return 0.0f;
+	}
+	wp_element_props props = wp_get_theme().text_props;
+	return wp_text_dimension_ex(line, width).y + props.padding * 2.0f +
+		   props.margin_top + props.margin_bottom;
+}
+
+// copies the text of rows first up to end into visible_text in one go,
+// rows dropped since the frame started come out empty
+static bool copy_visible(uint32_t first, uint32_t end) {
+	size_t size = (size_t)(end - first) * MESSAGE_LINE_SIZE;
+	if (size > s.visible_cap) {
+		char *text = realloc(s.visible_text, size);
+		if (text == NULL) {
+			return false;
+		}
+		s.visible_text = text;
+		s.visible_cap = size;
+	}
+
+	msgstore_lock();
+	const msgstore_room_t *room = msgstore_room(LOBBY_ROOM);
+	char *line = s.visible_text;
+	for (uint32_t i = first; i < end; ++i) {
+		uint64_t seq = s.message_list_dropped + i;
+		int len = 0;
+		if (room != NULL && seq >= room->dropped &&
+			seq - room->dropped < room->count) {
+			len = format_message(room, seq - room->dropped, line,
+								 MESSAGE_LINE_SIZE);
+		}
+		line[len] = '\0';
+		line += len + 1;
+	}
+	msgstore_unlock();
+	return true;
+}
+
 static void render_main_screen() {
+	// messages of the room, only the ones in view are laid out and the
+	// store is only locked while their text is copied out, so the network
+	// thread is not held up by layout
+	{
+		msgstore_lock();
+		const msgstore_room_t *room = msgstore_room(LOBBY_ROOM);
+		uint32_t count = room != NULL ? room->count : 0;
+		uint64_t dropped = room != NULL ? room->dropped : 0;
+		msgstore_unlock();
+
+		// the store dropped old messages, the rows left keep their heights
+		if (dropped != s.message_list_dropped) {
+			uint64_t gone = dropped - s.message_list_dropped;
+			wp_virtual_list_drop_front(&s.message_list, gone > UINT32_MAX
+															? UINT32_MAX
+															: (uint32_t)gone);
+			s.message_list_dropped = dropped;
+		}
+
+		float height = s.winh - GLOBAL_MARGIN * 2.0f - MESSAGE_INPUT_AREA;
+		wp_set_text_wrap(true);
+		wp_virtual_list_begin(
+			&s.message_list, ((vec2s){GLOBAL_MARGIN, GLOBAL_MARGIN}),
+			((vec2s){s.winw - GLOBAL_MARGIN * 2.0f, height}), count,
+			message_height, NULL);
+		if (copy_visible(s.message_list.first, s.message_list.end)) {
+			const char *line = s.visible_text;
+			for (uint32_t i = s.message_list.first; i < s.message_list.end;
+				 ++i) {
+				wp_virtual_list_row(&s.message_list, i);
+				wp_text(line);
+				line += strlen(line) + 1;
+			}
+		}
+		wp_virtual_list_end(&s.message_list);
+		wp_set_text_wrap(false);
+
+		wp_set_ptr_x_absolute(GLOBAL_MARGIN);
+		wp_set_ptr_y_absolute(GLOBAL_MARGIN + height + 10.0f);
+	}
+
 	// message input field
 
 	{
@@ -247,13 +392,41 @@ static void render_main_screen() {
 	}
 }
 
-int main() {
+static void print_usage(const char *name) {
+	printf("Usage: %s [-m message_store_mib]\n", name);
+	printf("  -m  memory received messages may use before the oldest are "
+		   "dropped\n");
+}
+
+int main(int argc, char **argv) {
+	long store_mib = MSGSTORE_DEFAULT_CAP_BYTES / (1024 * 1024);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			store_mib = strtol(optarg, NULL, 10);
+			if (store_mib < 1 || store_mib > 4096) {
+				printf("Error: message store must be between 1 and 4096 "
+					   "MiB\n");
+				return 1;
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	msgstore_init(store_mib * 1024 * 1024);
+
 	init_window();
 	init_ui();
 	init_sockets();
 
 	int screen = LOGIN_SCREEN;
 	while (!glfwWindowShouldClose(s.win)) {
+		handle_packets();
+
 		glClear(GL_COLOR_BUFFER_BIT);
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 
@@ -0,0 +1,181 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+#include "msgstore.h"
+#include "socket_util.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the network thread appends while the ui reads, a client only has a
+// handful of rooms so they are found by a linear scan
+static pthread_mutex_t msgstore_mutex = PTHREAD_MUTEX_INITIALIZER;
+static msgstore_room_t *msgstore_rooms;
+static uint32_t msgstore_room_count, msgstore_room_cap;
+static size_t msgstore_bytes;
+static size_t msgstore_cap;
+
+void msgstore_init(size_t cap_bytes) { msgstore_cap = cap_bytes; }
+
+void msgstore_free() {
+	pthread_mutex_lock(&msgstore_mutex);
+	for (uint32_t i = 0; i < msgstore_room_count; ++i) {
+		free(msgstore_rooms[i].text);
+		free(msgstore_rooms[i].msgs);
+	}
+	free(msgstore_rooms);
+	msgstore_rooms = NULL;
+	msgstore_room_count = msgstore_room_cap = 0;
+	msgstore_bytes = 0;
+	pthread_mutex_unlock(&msgstore_mutex);
+}
+
+// what the room's messages take, the slack in its arrays does not count
+static size_t room_used(const msgstore_room_t *room) {
+	return room->text_len + room->count * sizeof(msgstore_msg_t);
+}
+
+static msgstore_room_t *find_room(uint32_t id) {
+	for (uint32_t i = 0; i < msgstore_room_count; ++i) {
+		if (msgstore_rooms[i].id == id) {
+			return &msgstore_rooms[i];
+		}
+	}
+	return NULL;
+}
+
+static msgstore_room_t *add_room(uint32_t id) {
+	if (msgstore_room_count == msgstore_room_cap) {
+		uint32_t cap = msgstore_room_cap ? msgstore_room_cap * 2 : 4;
+		msgstore_room_t *rooms =
+			realloc(msgstore_rooms, cap * sizeof(msgstore_room_t));
+		if (rooms == NULL) {
+			return NULL;
+		}
+		msgstore_rooms = rooms;
+		msgstore_room_cap = cap;
+	}
+	msgstore_room_t *room = &msgstore_rooms[msgstore_room_count++];
+	memset(room, 0, sizeof(*room));
+	room->id = id;
+	return room;
+}
+
+// drops the older half of a room's messages, one memmove for the text and
+// one for the records keeps trimming amortized constant per message
+static void drop_oldest(msgstore_room_t *room) {
+	uint32_t drop = room->count > 1 ? room->count / 2 : room->count;
+	if (drop == 0) {
+		return;
+	}
+	size_t cut = drop < room->count ? room->msgs[drop].offset : room->text_len;
+	memmove(room->text, room->text + cut, room->text_len - cut);
+	room->text_len -= cut;
+	memmove(room->msgs, room->msgs + drop,
+			(room->count - drop) * sizeof(msgstore_msg_t));
+	room->count -= drop;
+	for (uint32_t i = 0; i < room->count; ++i) {
+		room->msgs[i].offset -= cut;
+	}
+	room->dropped += drop;
+}
+
+// trims whichever room uses the most until the store fits its cap
+// again, the blobs keep their capacity so this frees nothing but room
+static void enforce_cap(size_t incoming) {
+	while (msgstore_bytes + incoming > msgstore_cap) {
+		msgstore_room_t *largest = NULL;
+		for (uint32_t i = 0; i < msgstore_room_count; ++i) {
+			if (msgstore_rooms[i].count > 0 &&
+				(largest == NULL ||
+				 msgstore_rooms[i].text_len > largest->text_len)) {
+				largest = &msgstore_rooms[i];
+			}
+		}
+		if (largest == NULL) {
+			return;
+		}
+		size_t before = room_used(largest);
+		drop_oldest(largest);
+		msgstore_bytes -= before - room_used(largest);
+	}
+}
+
+static int reserve(msgstore_room_t *room, size_t text_len) {
+	if (room->text_len + text_len > room->text_cap) {
+		size_t cap = room->text_cap ? room->text_cap : MSGSTORE_INIT_TEXT;
+		while (cap < room->text_len + text_len) {
+			cap *= 2;
+		}
+		char *text = realloc(room->text, cap);
+		if (text == NULL) {
+			return PORTAL_FAIL;
+		}
+		room->text = text;
+		room->text_cap = cap;
+	}
+	if (room->count == room->msg_cap) {
+		uint32_t cap = room->msg_cap ? room->msg_cap * 2 : MSGSTORE_INIT_MSGS;
+		msgstore_msg_t *msgs = realloc(room->msgs, cap * sizeof(*msgs));
+		if (msgs == NULL) {
+			return PORTAL_FAIL;
+		}
+		room->msgs = msgs;
+		room->msg_cap = cap;
+	}
+	return PORTAL_OK;
+}
+
+int msgstore_append(uint32_t room_id, uint32_t sender, const char *text,
+					size_t len) {
+	size_t size = len + 1;
+	if (size + sizeof(msgstore_msg_t) > msgstore_cap) {
+		return PORTAL_FAIL;
+	}
+
+	pthread_mutex_lock(&msgstore_mutex);
+	msgstore_room_t *room = find_room(room_id);
+	if (room == NULL && (room = add_room(room_id)) == NULL) {
+		pthread_mutex_unlock(&msgstore_mutex);
+		return PORTAL_FAIL;
+	}
+	enforce_cap(size + sizeof(msgstore_msg_t));
+	if (reserve(room, size) != PORTAL_OK) {
+		pthread_mutex_unlock(&msgstore_mutex);
+		perror("Failed to grow message store");
+		return PORTAL_FAIL;
+	}
+
+	msgstore_msg_t *msg = &room->msgs[room->count++];
+	msg->sender = sender;
+	msg->offset = room->text_len;
+	msg->len = len;
+	memcpy(room->text + room->text_len, text, len);
+	room->text[room->text_len + len] = 0;
+	room->text_len += size;
+	msgstore_bytes += size + sizeof(msgstore_msg_t);
+	pthread_mutex_unlock(&msgstore_mutex);
+	return PORTAL_OK;
+}
+
+void msgstore_lock() { pthread_mutex_lock(&msgstore_mutex); }
+
+void msgstore_unlock() { pthread_mutex_unlock(&msgstore_mutex); }
+
+const msgstore_room_t *msgstore_room(uint32_t room) { return find_room(room); }
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+#ifndef MSGSTORE_H
+#define MSGSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MSGSTORE_DEFAULT_CAP_BYTES (32 * 1024 * 1024)
+#define MSGSTORE_INIT_TEXT 4096
+#define MSGSTORE_INIT_MSGS 64
+
+// received messages of every joined room. each room keeps its text back to
+// back in one growable blob with a parallel array of fixed size records,
+// so holding tens of thousands of messages costs two allocations per room.
+// once the store passes its cap the oldest messages are dropped
+
+typedef struct {
+	uint32_t sender;
+	// into the room's text blob, the text is NUL terminated there
+	uint32_t offset;
+	uint32_t len;
+} msgstore_msg_t;
+
+typedef struct {
+	uint32_t id;
+	char *text;
+	size_t text_len, text_cap;
+	msgstore_msg_t *msgs;
+	uint32_t count, msg_cap;
+	// messages dropped from the front, index i is message dropped + i of
+	// everything the room received
+	uint64_t dropped;
+} msgstore_room_t;
+
+void msgstore_init(size_t cap_bytes);
+void msgstore_free();
+
+// thread safe, copies the text in
+int msgstore_append(uint32_t room, uint32_t sender, const char *text,
+					size_t len);
+
+// readers hold the lock for as long as they use a room or its text
+void msgstore_lock();
+void msgstore_unlock();
+// NULL if nothing has arrived for the room yet
+const msgstore_room_t *msgstore_room(uint32_t room);
+
+static inline const char *msgstore_text(const msgstore_room_t *room,
+										uint32_t i) {
+	return room->text + room->msgs[i].offset;
+}
+
+#endif // MSGSTORE_H
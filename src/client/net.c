@@ -0,0 +1,334 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+#include "net.h"
+#include "bufpool.h"
+#include "msgstore.h"
+#include "outq.h"
+#include "spsc.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// ui to network thread, payloads come from the ui thread's buffer pool
+static spsc_queue_t net_outbox;
+// network thread to ui
+static spsc_queue_t net_inbox;
+// wakes the network thread when the outbox gets something or on stop
+static int net_wake_fd = -1;
+static pthread_t net_thread;
+static atomic_bool net_running;
+static atomic_int net_status;
+
+static char net_ip[INET_ADDRSTRLEN];
+static unsigned int net_port;
+
+net_state_t net_state() {
+	return atomic_load_explicit(&net_status, memory_order_acquire);
+}
+
+static void wake() {
+	uint64_t one = 1;
+	if (write(net_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		perror("Failed to wake network thread");
+	}
+}
+
+// empties the wake event so the next poll blocks again
+static void drain_wake() {
+	uint64_t count;
+	if (read(net_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("Failed to read wake event");
+	}
+}
+
+// waits for a non-blocking connect to finish alongside the wake event, so
+// net_stop is never stuck behind an unreachable server
+static int finish_connect(int fd) {
+	while (atomic_load_explicit(&net_running, memory_order_acquire)) {
+		struct pollfd pfds[2] = {
+			{.fd = net_wake_fd, .events = POLLIN},
+			{.fd = fd, .events = POLLOUT},
+		};
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Failed to poll socket");
+			return PORTAL_FAIL;
+		}
+		if (pfds[0].revents & POLLIN) {
+			// sends queued while connecting are picked up once it is done
+			drain_wake();
+		}
+		if (pfds[1].revents != 0) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+				err = errno;
+			}
+			if (err != 0) {
+				errno = err;
+				perror("Failed to connect");
+				return PORTAL_FAIL;
+			}
+			return PORTAL_OK;
+		}
+	}
+	return PORTAL_FAIL;
+}
+
+static int connect_server() {
+	int fd = createTCPIPv4Socket();
+	if (fd < 0) {
+		perror("Failed to create socket");
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	struct sockaddr_in address = createIPv4Address(net_ip, net_port);
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		if (errno != EINPROGRESS) {
+			perror("Failed to connect");
+			close(fd);
+			return -1;
+		}
+		if (finish_connect(fd) != PORTAL_OK) {
+			close(fd);
+			return -1;
+		}
+	}
+	printf("Connection was sucessful.\n");
+	return fd;
+}
+
+static void release_payload(void *data) { portal_pool_free(data); }
+
+// chat messages are stored here on the network thread so the ui never
+// handles them one by one, false for any other packet
+static bool store_message(packet_t *packet) {
+	if (packet->header.opcode != PORTAL_OP_MSG) {
+		return false;
+	}
+	if (packet->data_size >= sizeof(portal_msg_prefix_t)) {
+		portal_msg_prefix_t prefix;
+		memcpy(&prefix, packet->data, sizeof(prefix));
+		msgstore_append(ntohl(prefix.room), ntohl(prefix.sender),
+						(const char *)packet->data + sizeof(prefix),
+						packet->data_size - sizeof(prefix));
+	}
+	portal_pool_free(packet->data);
+	return true;
+}
+
+// moves everything the ui queued onto the socket's output queue
+static int take_outbox(portal_outq_t *out) {
+	packet_t packet;
+	while (spsc_pop(&net_outbox, &packet)) {
+		if (portal_outq_push(out, &packet, 0, release_payload, packet.data) !=
+			PORTAL_OK) {
+			portal_pool_free(packet.data);
+			return PORTAL_FAIL;
+		}
+	}
+	return PORTAL_OK;
+}
+
+// hands out every complete frame already buffered, a packet the inbox has
+// no room for waits in stalled and the rest stay put until the ui catches
+// up
+static int drain_decoder(portal_decoder_t *decoder, packet_t *stalled,
+						 bool *has_stalled) {
+	while (!*has_stalled) {
+		int rc = portal_decoder_next(decoder, stalled);
+		if (rc == PORTAL_AGAIN) {
+			return PORTAL_OK;
+		}
+		if (rc != PORTAL_OK) {
+			return PORTAL_FAIL;
+		}
+		if (!store_message(stalled)) {
+			*has_stalled = !spsc_push(&net_inbox, stalled);
+		}
+	}
+	return PORTAL_OK;
+}
+
+// frames left from before a stall go first, so the ring has room for
+// what the socket has
+static int read_socket(int fd, portal_decoder_t *decoder, packet_t *stalled,
+					   bool *has_stalled) {
+	if (drain_decoder(decoder, stalled, has_stalled) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
+	if (*has_stalled) {
+		return PORTAL_OK;
+	}
+	if (portal_decoder_fill(decoder, fd) == PORTAL_FAIL) {
+		return PORTAL_FAIL;
+	}
+	return drain_decoder(decoder, stalled, has_stalled);
+}
+
+static void *net_main(void *arg) {
+	(void)arg;
+	int fd = connect_server();
+	if (fd < 0) {
+		atomic_store_explicit(&net_status, NET_DISCONNECTED,
+							  memory_order_release);
+		return NULL;
+	}
+	atomic_store_explicit(&net_status, NET_CONNECTED, memory_order_release);
+
+	portal_outq_t out;
+	portal_outq_init(&out);
+	portal_decoder_t decoder;
+	portal_decoder_init(&decoder);
+	packet_t stalled;
+	bool has_stalled = false;
+
+	while (atomic_load_explicit(&net_running, memory_order_acquire)) {
+		if (take_outbox(&out) != PORTAL_OK) {
+			break;
+		}
+		if (out.count > 0 && portal_outq_flush(&out, fd) == PORTAL_FAIL) {
+			break;
+		}
+		if (has_stalled) {
+			has_stalled = !spsc_push(&net_inbox, &stalled);
+			// frames that arrived behind it are already here, the server
+			// may send nothing more to wake the poll for them
+			if (!has_stalled && drain_decoder(&decoder, &stalled,
+											  &has_stalled) != PORTAL_OK) {
+				printf("Disconnected from server\n");
+				break;
+			}
+		}
+
+		struct pollfd pfds[2] = {
+			{.fd = net_wake_fd, .events = POLLIN},
+			{.fd = fd,
+			 .events = (has_stalled ? 0 : POLLIN) |
+					   (out.count > 0 ? POLLOUT : 0)},
+		};
+		// the ui gives no signal when it drains the inbox, so a stalled
+		// packet is retried on a short timer instead
+		if (poll(pfds, 2, has_stalled ? NET_INBOX_RETRY_MS : -1) < 0 &&
+			errno != EINTR) {
+			perror("Failed to poll socket");
+			break;
+		}
+		if (pfds[0].revents & POLLIN) {
+			drain_wake();
+		}
+		if (!has_stalled && pfds[1].revents & (POLLIN | POLLHUP | POLLERR) &&
+			read_socket(fd, &decoder, &stalled, &has_stalled) != PORTAL_OK) {
+			printf("Disconnected from server\n");
+			break;
+		}
+	}
+
+	atomic_store_explicit(&net_status, NET_DISCONNECTED, memory_order_release);
+	if (has_stalled) {
+		portal_pool_free(stalled.data);
+	}
+	portal_outq_clear(&out);
+	portal_decoder_free(&decoder);
+	close(fd);
+	return NULL;
+}
+
+int net_start(const char *ip, unsigned int port) {
+	snprintf(net_ip, sizeof(net_ip), "%s", ip);
+	net_port = port;
+	if (spsc_init(&net_outbox, sizeof(packet_t), NET_OUTBOX_SLOTS) !=
+			PORTAL_OK ||
+		spsc_init(&net_inbox, sizeof(packet_t), NET_INBOX_SLOTS) !=
+			PORTAL_OK) {
+		perror("Failed to allocate network queues");
+		return PORTAL_FAIL;
+	}
+	net_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (net_wake_fd < 0) {
+		perror("Failed to create network wake event");
+		return PORTAL_FAIL;
+	}
+
+	atomic_store(&net_status, NET_CONNECTING);
+	atomic_store(&net_running, true);
+	if (pthread_create(&net_thread, NULL, net_main, NULL) != 0) {
+		perror("Failed to start network thread");
+		return PORTAL_FAIL;
+	}
+	return PORTAL_OK;
+}
+
+void net_stop() {
+	if (net_wake_fd < 0) {
+		return;
+	}
+	atomic_store(&net_running, false);
+	wake();
+	pthread_join(net_thread, NULL);
+
+	// the thread is gone, so this side may drain both queues
+	packet_t packet;
+	while (spsc_pop(&net_outbox, &packet)) {
+		portal_pool_free(packet.data);
+	}
+	while (spsc_pop(&net_inbox, &packet)) {
+		portal_pool_free(packet.data);
+	}
+	spsc_free(&net_outbox);
+	spsc_free(&net_inbox);
+	close(net_wake_fd);
+	net_wake_fd = -1;
+}
+
+int net_send(uint16_t opcode, const void *data, size_t size) {
+	if (net_state() == NET_DISCONNECTED) {
+		return PORTAL_FAIL;
+	}
+	packet_t packet = {0};
+	packet.header.opcode = opcode;
+	packet.data_size = size;
+	if (size > 0) {
+		packet.data = portal_pool_alloc(size);
+		if (packet.data == NULL) {
+			return PORTAL_FAIL;
+		}
+		memcpy(packet.data, data, size);
+	}
+	if (!spsc_push(&net_outbox, &packet)) {
+		portal_pool_free(packet.data);
+		return PORTAL_AGAIN;
+	}
+	wake();
+	return PORTAL_OK;
+}
+
+bool net_poll(packet_t *packet) { return spsc_pop(&net_inbox, packet); }
@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+#ifndef NET_H
+#define NET_H
+
+#include "socket_util.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NET_OUTBOX_SLOTS 256
+#define NET_INBOX_SLOTS 1024
+// how long the network thread waits for the ui to make room in a full inbox
+#define NET_INBOX_RETRY_MS 5
+
+// the socket lives on its own thread so connecting, a slow server or a
+// full send buffer never stall a frame. the render loop only copies
+// packets into and out of two spsc queues
+
+typedef enum {
+	NET_CONNECTING,
+	NET_CONNECTED,
+	NET_DISCONNECTED,
+} net_state_t;
+
+// starts the network thread, which connects in the background
+int net_start(const char *ip, unsigned int port);
+// stops the thread, even mid connect, and drops whatever is still queued
+void net_stop();
+
+net_state_t net_state();
+
+// ui thread only. copies the payload and queues it, frames queued before
+// the connection is up go out once it is. PORTAL_AGAIN when the outbox is
+// full
+int net_send(uint16_t opcode, const void *data, size_t size);
+
+// ui thread only. the next received packet, false once there are none.
+// chat messages skip this and land in the message store instead. the
+// payload comes from the buffer pool, release it with portal_pool_free
+bool net_poll(packet_t *packet);
+
+#endif // NET_H
@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+#include "spsc.h"
+#include "socket_util.h"
+#include <stdlib.h>
+#include <string.h>
+
+int spsc_init(spsc_queue_t *q, size_t elem_size, uint32_t capacity) {
+	uint32_t slots = 1;
+	while (slots < capacity) {
+		slots <<= 1;
+	}
+	q->slots = malloc(slots * elem_size);
+	if (q->slots == NULL) {
+		return PORTAL_FAIL;
+	}
+	q->elem_size = elem_size;
+	q->mask = slots - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return PORTAL_OK;
+}
+
+void spsc_free(spsc_queue_t *q) {
+	free(q->slots);
+	q->slots = NULL;
+}
+
+bool spsc_push(spsc_queue_t *q, const void *elem) {
+	unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (tail - head > q->mask) {
+		return false;
+	}
+	memcpy(q->slots + (tail & q->mask) * q->elem_size, elem, q->elem_size);
+	// the copy has to land before the consumer can see the slot
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool spsc_pop(spsc_queue_t *q, void *elem) {
+	unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	memcpy(elem, q->slots + (head & q->mask) * q->elem_size, q->elem_size);
+	// and the copy out before the producer may reuse it
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
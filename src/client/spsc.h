@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// bounded ring between exactly one producer and one consumer thread.
+// elements are copied in and out, neither side ever locks or allocates
+typedef struct {
+	unsigned char *slots;
+	size_t elem_size;
+	uint32_t mask;
+	// each side owns one index and only reads the other, kept on separate
+	// cache lines so they do not bounce between cores
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+} spsc_queue_t;
+
+// capacity is rounded up to a power of two
+int spsc_init(spsc_queue_t *q, size_t elem_size, uint32_t capacity);
+void spsc_free(spsc_queue_t *q);
+
+// producer side only, false when the queue is full
+bool spsc_push(spsc_queue_t *q, const void *elem);
+// consumer side only, false when the queue is empty
+bool spsc_pop(spsc_queue_t *q, void *elem);
+
+#endif // SPSC_H
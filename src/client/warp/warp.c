@@ -128,6 +128,11 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #define MAX_SCROLL_CALLBACKS 4
 #define MAX_CURSOR_POS_CALLBACKS 4
 
+#define TEXT_CACHE_SETS 512
+#define TEXT_CACHE_WAYS 4
+
+#define VIRTUAL_LIST_MEASURE_BUDGET 64
+
 #define DJB2_INIT 5381
 
 // -- Local Struct Defines ---
@@ -194,6 +199,33 @@ typedef struct {
 	uint32_t tex_index, tex_count, index_count;
 } wp_render_state;
 
+// A laid out string. The glyph quads are relative to where the text starts,
+// so the same layout can be emitted anywhere on screen
+typedef struct {
+	uint64_t hash;
+	void *cdata; // Identifies the font
+	uint32_t font_size;
+	int32_t wrap; // Relative to the start of the text, INT32_MIN for none
+	char *str;
+	size_t len;
+	stbtt_aligned_quad *glyphs; // Owns the block, the string follows it
+	uint32_t glyph_count;
+	int32_t max_descended_char_height;
+	wp_text_props props;
+	uint32_t last_used;
+} wp_text_layout;
+
+// Set associative, the least recently used layout of a set gets replaced
+typedef struct {
+	wp_text_layout entries[TEXT_CACHE_SETS * TEXT_CACHE_WAYS];
+	uint32_t frame;
+
+	// Glyphs are recorded here while a string is laid out
+	stbtt_aligned_quad *record;
+	uint32_t record_count, record_cap;
+	bool recording;
+} wp_text_cache;
+
 typedef struct {
 	wp_element_props *data;
 	uint32_t count, cap;
@@ -207,6 +239,7 @@ typedef struct {
 	void *window_handle;
 
 	wp_render_state render;
+	wp_text_cache text_cache;
 	wp_input_state input;
 	wp_theme theme;
 
@@ -270,6 +303,9 @@ static void renderer_init();
 static void renderer_flush();
 static void renderer_begin();
 
+static void text_cache_drop_font(const void *cdata);
+static void text_cache_free();
+
 static wp_text_props text_render_simple(vec2s pos, const char *text,
 										wp_font font, wp_color font_color,
 										bool no_render);
@@ -2087,7 +2123,10 @@ void wp_init_glfw(uint32_t display_width, uint32_t display_height,
 	state.tex_tick = wp_load_texture_asset("tick", "png");
 }
 
-void wp_terminate() { wp_free_font(&state.theme.font); }
+void wp_terminate() {
+	wp_free_font(&state.theme.font);
+	text_cache_free();
+}
 
 wp_theme wp_default_theme() {
 	// The default theme of warp
@@ -2616,6 +2655,8 @@ void wp_free_texture(wp_texture *tex) {
 }
 
 void wp_free_font(wp_font *font) {
+	// A later font may get the same address, its layouts must not match
+	text_cache_drop_font(font->cdata);
 	free(font->cdata);
 	free(font->font_info);
 }
@@ -2824,6 +2865,289 @@ void wp_div_end() {
 	state.cull_end = (vec2s){-1, -1};
 }
 
+static bool virtual_list_reserve(wp_virtual_list *list, uint32_t count) {
+	if (count + 1 <= list->cap) {
+		return true;
+	}
+	uint32_t cap = list->cap ? list->cap : 64;
+	while (cap < count + 1) {
+		cap *= 2;
+	}
+	// Each array is at least the old capacity even if a later one fails
+	float *prefix = realloc(list->prefix, cap * sizeof(float));
+	if (!prefix) {
+		return false;
+	}
+	list->prefix = prefix;
+	float *heights = realloc(list->heights, cap * sizeof(float));
+	if (!heights) {
+		return false;
+	}
+	list->heights = heights;
+	bool *stale = realloc(list->stale, cap * sizeof(bool));
+	if (!stale) {
+		return false;
+	}
+	list->stale = stale;
+	list->cap = cap;
+	return true;
+}
+
+static void virtual_list_mark_stale(wp_virtual_list *list, uint32_t index) {
+	for (uint32_t i = index; i < list->count; i++) {
+		if (!list->stale[i]) {
+			list->stale[i] = true;
+			list->stale_count++;
+		}
+	}
+}
+
+static void virtual_list_measure(wp_virtual_list *list, uint32_t index,
+								 wp_virtual_list_height_fn height,
+								 void *user_data) {
+	list->heights[index] = height(index, list->width, user_data);
+	// An empty row says nothing about how tall the next ones will be
+	if (list->heights[index] > 0.0f) {
+		list->guess = list->heights[index];
+	}
+	list->stale[index] = false;
+	list->stale_count--;
+}
+
+static void virtual_list_sum(wp_virtual_list *list, uint32_t from) {
+	for (uint32_t i = from; i < list->count; i++) {
+		list->prefix[i + 1] = list->prefix[i] + list->heights[i];
+	}
+}
+
+static float virtual_list_max_scroll(wp_virtual_list *list, float height) {
+	float total = list->count ? list->prefix[list->count] : 0.0f;
+	return total > height ? total - height : 0.0f;
+}
+
+static void virtual_list_clamp(wp_virtual_list *list, float height) {
+	float max_scroll = virtual_list_max_scroll(list, height);
+	if (list->scroll > 0.0f) {
+		list->scroll = 0.0f;
+	} else if (list->scroll < -max_scroll) {
+		list->scroll = -max_scroll;
+	}
+}
+
+// The first row whose bottom is below y, count if there is none
+static uint32_t virtual_list_row_at(wp_virtual_list *list, float y) {
+	uint32_t lo = 0, hi = list->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (list->prefix[mid + 1] <= y) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Measures the stale rows in view and a bounded number of the others,
+// keeping the row at the top of the view where it was
+static void virtual_list_measure_view(wp_virtual_list *list, float view,
+									  bool stick,
+									  wp_virtual_list_height_fn height,
+									  void *user_data) {
+	uint32_t changed = list->count;
+	float top = -list->scroll;
+	uint32_t anchor = virtual_list_row_at(list, top);
+	float offset = anchor < list->count ? top - list->prefix[anchor] : 0.0f;
+
+	// Rows in view first, walking up from the last one when stuck to it
+	uint32_t rows = stick ? list->count : list->count - anchor;
+	float filled = stick ? 0.0f : -offset;
+	for (uint32_t n = 0; n < rows && filled < view; n++) {
+		uint32_t i = stick ? list->count - 1 - n : anchor + n;
+		if (list->stale[i]) {
+			virtual_list_measure(list, i, height, user_data);
+			if (i < changed) {
+				changed = i;
+			}
+		}
+		filled += list->heights[i];
+	}
+
+	// Then a few more each frame until the scrollbar is exact again
+	for (uint32_t n = 0;
+		 n < VIRTUAL_LIST_MEASURE_BUDGET && list->stale_count > 0;) {
+		if (list->stale_cursor >= list->count) {
+			list->stale_cursor = 0;
+		}
+		uint32_t i = list->stale_cursor++;
+		if (list->stale[i]) {
+			virtual_list_measure(list, i, height, user_data);
+			if (i < changed) {
+				changed = i;
+			}
+			n++;
+		}
+	}
+
+	if (changed == list->count) {
+		return;
+	}
+	virtual_list_sum(list, changed);
+	if (!stick) {
+		list->scroll = -(list->prefix[anchor] + offset);
+	}
+}
+
+void _wp_virtual_list_begin_loc(wp_virtual_list *list, vec2s pos, vec2s size,
+								uint32_t item_count,
+								wp_virtual_list_height_fn height,
+								void *user_data, const char *file,
+								int32_t line) {
+	// not scrollable as far as the div goes, the list scrolls itself
+	_wp_div_begin_loc(pos, size, false, &list->scroll, &list->scroll_velocity,
+					  file, line);
+
+	if (!list->_init) {
+		list->at_end = list->stick_to_end;
+		list->_init = true;
+	}
+
+	// A new width keeps the old heights as guesses until rows are measured
+	if (list->width != size.x) {
+		list->width = size.x;
+		virtual_list_mark_stale(list, 0);
+	}
+	for (uint32_t i = item_count; i < list->count; i++) {
+		if (list->stale[i]) {
+			list->stale_count--;
+		}
+	}
+	if (item_count < list->count) {
+		list->count = item_count;
+	}
+	if (!virtual_list_reserve(list, item_count)) {
+		WP_ERROR("Failed to allocate virtual list of %u rows", item_count);
+		item_count = list->count;
+	}
+
+	// Adding new rows at the guessed height, they are measured below
+	if (list->prefix) {
+		uint32_t from = list->count;
+		list->prefix[0] = 0.0f;
+		for (uint32_t i = from; i < item_count; i++) {
+			list->heights[i] = list->guess;
+			list->stale[i] = true;
+			list->stale_count++;
+		}
+		list->count = item_count;
+		virtual_list_sum(list, from);
+	}
+
+	// Scrolling with the mouse wheel while hovered
+	bool scrolled = false;
+	if (state.scr_ev.happened && wp_area_hovered(pos, size)) {
+		list->scroll += state.scr_ev.y_off * state.theme.div_scroll_amount_px;
+		scrolled = true;
+	}
+	bool stick = list->stick_to_end && list->at_end && !scrolled;
+	if (stick) {
+		list->scroll = -virtual_list_max_scroll(list, size.y);
+	}
+	virtual_list_clamp(list, size.y);
+
+	if (list->stale_count > 0) {
+		virtual_list_measure_view(list, size.y, stick, height, user_data);
+		if (stick) {
+			list->scroll = -virtual_list_max_scroll(list, size.y);
+		}
+		virtual_list_clamp(list, size.y);
+	}
+	list->at_end =
+		list->scroll <= -virtual_list_max_scroll(list, size.y) + 0.5f;
+
+	// Finding the first row that reaches into view
+	float top = -list->scroll;
+	list->first = virtual_list_row_at(list, top);
+	list->end = list->first;
+	while (list->end < list->count && list->prefix[list->end] < top + size.y) {
+		list->end++;
+	}
+}
+
+void wp_virtual_list_row(wp_virtual_list *list, uint32_t index) {
+	state.pos_ptr.x =
+		state.current_div.aabb.pos.x + state.div_props.border_width;
+	state.pos_ptr.y =
+		state.current_div.aabb.pos.y + list->scroll + list->prefix[index];
+	state.current_line_height = 0;
+}
+
+void wp_virtual_list_end(wp_virtual_list *list) {
+	wp_aabb aabb = state.current_div.aabb;
+	float total = list->count ? list->prefix[list->count] : 0.0f;
+
+	// Drawing a scrollbar handle sized to the visible part of the list
+	if (total > aabb.size.y) {
+		wp_element_props props = get_props_for(state.theme.scrollbar_props);
+		const float min_scrollbar_height = 20;
+		float max_scroll = total - aabb.size.y;
+		float bar_height =
+			MAX(aabb.size.y * (aabb.size.y / total), min_scrollbar_height);
+		float bar_y =
+			aabb.pos.y + (aabb.size.y - bar_height) * (-list->scroll / max_scroll);
+		wp_rect_render(
+			(vec2s){aabb.pos.x + aabb.size.x - state.theme.scrollbar_width -
+						props.margin_right,
+					bar_y},
+			(vec2s){state.theme.scrollbar_width, bar_height}, props.color,
+			props.border_color, props.border_width, props.corner_radius);
+	}
+	wp_div_end();
+}
+
+void wp_virtual_list_invalidate(wp_virtual_list *list, uint32_t index) {
+	virtual_list_mark_stale(list, index);
+}
+
+void wp_virtual_list_drop_front(wp_virtual_list *list, uint32_t count) {
+	if (count > list->count) {
+		count = list->count;
+	}
+	if (count == 0) {
+		return;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (list->stale[i]) {
+			list->stale_count--;
+		}
+	}
+
+	// Shifting the rows that are left down, their tops move up by as much
+	// as the dropped rows took
+	uint32_t left = list->count - count;
+	float removed = list->prefix[count];
+	memmove(list->heights, list->heights + count, left * sizeof(float));
+	memmove(list->stale, list->stale + count, left * sizeof(bool));
+	for (uint32_t i = 0; i <= left; i++) {
+		list->prefix[i] = list->prefix[i + count] - removed;
+	}
+	list->count = left;
+	list->stale_cursor =
+		list->stale_cursor > count ? list->stale_cursor - count : 0;
+	list->scroll += removed;
+}
+
+void wp_virtual_list_free(wp_virtual_list *list) {
+	free(list->prefix);
+	free(list->heights);
+	free(list->stale);
+	list->prefix = NULL;
+	list->heights = NULL;
+	list->stale = NULL;
+	list->count = list->cap = 0;
+	list->stale_count = list->stale_cursor = 0;
+}
+
 wp_clickable_state _wp_item_loc(vec2s size, const char *file, int32_t line) {
 	wp_element_props props = get_props_for(state.theme.button_props);
 
@@ -3259,6 +3583,7 @@ wp_div wp_get_grabbed_div() { return state.grabbed_div; }
 
 void _wp_begin_loc(const char *file, int32_t line) {
 	state.pos_ptr = (vec2s){0, 0};
+	state.text_cache.frame++;
 	renderer_begin();
 	wp_element_props props = get_props_for(state.theme.div_props);
 	props.color = (wp_color){0, 0, 0, 0};
@@ -3459,23 +3784,56 @@ void wp_push_font(wp_font *font) { state.font_stack = font; }
 
 void wp_pop_font() { state.font_stack = NULL; }
 
-// Decode a UTF-8 character sequence to Unicode code point
+// Decode a UTF-8 character sequence to Unicode code point. A malformed or
+// cut off sequence, an overlong form, a surrogate or anything past U+10FFFF
+// reads as U+FFFD and only its first byte is consumed, so this never reads
+// past the terminator
 uint32_t decode_utf8(const char *s, int *bytes_read) {
 	uint8_t c = s[0];
+	int len;
+	uint32_t cp;
+	// The range the second byte must fall in, which rules out the overlong
+	// forms, surrogates and code points that are too large
+	uint8_t lo = 0x80, hi = 0xBF;
 	if (c < 0x80) {
 		*bytes_read = 1;
 		return c;
-	} else if (c < 0xE0) {
-		*bytes_read = 2;
-		return ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
-	} else if (c < 0xF0) {
-		*bytes_read = 3;
-		return ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+	} else if (c >= 0xC2 && c < 0xE0) {
+		len = 2;
+		cp = c & 0x1F;
+	} else if (c >= 0xE0 && c < 0xF0) {
+		len = 3;
+		cp = c & 0x0F;
+		if (c == 0xE0) {
+			lo = 0xA0;
+		} else if (c == 0xED) {
+			hi = 0x9F;
+		}
+	} else if (c >= 0xF0 && c < 0xF5) {
+		len = 4;
+		cp = c & 0x07;
+		if (c == 0xF0) {
+			lo = 0x90;
+		} else if (c == 0xF4) {
+			hi = 0x8F;
+		}
 	} else {
-		*bytes_read = 4;
-		return ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) |
-			   ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+		*bytes_read = 1;
+		return 0xFFFD;
+	}
+	if ((uint8_t)s[1] < lo || (uint8_t)s[1] > hi) {
+		*bytes_read = 1;
+		return 0xFFFD;
+	}
+	for (int i = 1; i < len; i++) {
+		if (((uint8_t)s[i] & 0xC0) != 0x80) {
+			*bytes_read = 1;
+			return 0xFFFD;
+		}
+		cp = (cp << 6) | (s[i] & 0x3F);
 	}
+	*bytes_read = len;
+	return cp;
 }
 
 static void renderer_add_glyph(stbtt_aligned_quad q,
@@ -3535,21 +3893,249 @@ static void renderer_add_glyph(stbtt_aligned_quad q,
 	state.render.index_count += 6;
 }
 
-static wchar_t *str_to_wstr(const char *str) {
-	size_t len = strlen(str) + 1;
+static void renderer_add_glyphs(const stbtt_aligned_quad *glyphs,
+								uint32_t glyph_count, vec2s offset,
+								int32_t max_descended_char_height,
+								wp_color color, float tex_index) {
+	// Everything but the position and texcoord is the same for every vertex
+	vertex_t proto = {0};
+	vec4s color_zto = wp_color_to_zto(color);
+	const vec4 color_arr = {color_zto.r, color_zto.g, color_zto.b,
+							color_zto.a};
+	memcpy(proto.color, color_arr, sizeof(vec4));
+	proto.tex_index = tex_index;
+	const vec2 cull_start_arr = {state.cull_start.x, state.cull_start.y};
+	const vec2 cull_end_arr = {state.cull_end.x, state.cull_end.y};
+	memcpy(proto.min_coord, cull_start_arr, sizeof(vec2));
+	memcpy(proto.max_coord, cull_end_arr, sizeof(vec2));
+
+	float y_offset = offset.y + max_descended_char_height;
+	for (uint32_t i = 0; i < glyph_count; i++) {
+		// The vertex buffer holds 4 times the batch, a glyph always fits
+		if (state.render.vert_count >= MAX_RENDER_BATCH) {
+			renderer_flush();
+			renderer_begin();
+		}
+		const stbtt_aligned_quad *q = &glyphs[i];
+		vertex_t *verts = &state.render.verts[state.render.vert_count];
+		for (uint32_t j = 0; j < 4; j++) {
+			memcpy(&verts[j], &proto, sizeof(vertex_t));
+		}
+		float x0 = q->x0 + offset.x, x1 = q->x1 + offset.x;
+		float y0 = q->y0 + y_offset, y1 = q->y1 + y_offset;
+		verts[0].pos[0] = x0;
+		verts[0].pos[1] = y0;
+		verts[0].texcoord[0] = q->s0;
+		verts[0].texcoord[1] = q->t0;
+		verts[1].pos[0] = x1;
+		verts[1].pos[1] = y0;
+		verts[1].texcoord[0] = q->s1;
+		verts[1].texcoord[1] = q->t0;
+		verts[2].pos[0] = x1;
+		verts[2].pos[1] = y1;
+		verts[2].texcoord[0] = q->s1;
+		verts[2].texcoord[1] = q->t1;
+		verts[3].pos[0] = x0;
+		verts[3].pos[1] = y1;
+		verts[3].texcoord[0] = q->s0;
+		verts[3].texcoord[1] = q->t1;
+		state.render.vert_count += 4;
+		state.render.index_count += 6;
+	}
+}
+
+static float font_tex_index(wp_font font) {
+	if (state.render.tex_count - 1 >= MAX_TEX_COUNT_BATCH - 1) {
+		renderer_flush();
+		renderer_begin();
+	}
+	for (uint32_t i = 0; i < state.render.tex_count; i++) {
+		if (state.render.textures[i].id == font.texture.id) {
+			return (float)i;
+		}
+	}
+	float tex_index = (float)state.render.tex_index;
+	state.render.textures[state.render.tex_count++] = font.texture;
+	state.render.tex_index++;
+	return tex_index;
+}
+
+static void text_cache_record(stbtt_aligned_quad q) {
+	wp_text_cache *cache = &state.text_cache;
+	if (cache->record_count == cache->record_cap) {
+		uint32_t cap = cache->record_cap ? cache->record_cap * 2 : 256;
+		stbtt_aligned_quad *record =
+			realloc(cache->record, cap * sizeof(stbtt_aligned_quad));
+		if (record == NULL) {
+			cache->recording = false;
+			return;
+		}
+		cache->record = record;
+		cache->record_cap = cap;
+	}
+	cache->record[cache->record_count++] = q;
+}
+
+static void text_layout_free(wp_text_layout *layout) {
+	free(layout->glyphs);
+	memset(layout, 0, sizeof(*layout));
+}
+
+void text_cache_drop_font(const void *cdata) {
+	for (uint32_t i = 0; i < TEXT_CACHE_SETS * TEXT_CACHE_WAYS; i++) {
+		if (state.text_cache.entries[i].cdata == cdata) {
+			text_layout_free(&state.text_cache.entries[i]);
+		}
+	}
+}
 
-	wchar_t *wstr = (wchar_t *)malloc(len * sizeof(wchar_t));
-	if (wstr == NULL) {
-		perror("Memory allocation failed");
+void text_cache_free() {
+	for (uint32_t i = 0; i < TEXT_CACHE_SETS * TEXT_CACHE_WAYS; i++) {
+		text_layout_free(&state.text_cache.entries[i]);
+	}
+	free(state.text_cache.record);
+	state.text_cache.record = NULL;
+	state.text_cache.record_count = state.text_cache.record_cap = 0;
+}
+
+static wp_text_props text_render(vec2s pos, const void *str, bool wide,
+								 wp_font font, wp_color color,
+								 int32_t wrap_point, vec2s stop_point,
+								 bool no_render, bool render_solid,
+								 int32_t start_index, int32_t end_index);
+
+// Lays the string out at the origin and keeps the glyphs in the given slot
+static wp_text_layout *text_cache_fill(wp_text_layout *slot, uint64_t hash,
+									   const char *str, size_t len,
+									   wp_font font, int32_t wrap) {
+	wp_text_cache *cache = &state.text_cache;
+	cache->record_count = 0;
+	cache->recording = true;
+	wp_text_props props = text_render(
+		(vec2s){0.0f, 0.0f}, str, false, font, WP_NO_COLOR,
+		wrap == INT32_MIN ? -1 : wrap, (vec2s){-1, -1}, true, false, -1, -1);
+	if (!cache->recording) {
 		return NULL;
 	}
-	if (mbstowcs(wstr, str, len) == (size_t)-1) {
-		perror("Conversion failed");
-		free(wstr);
+	cache->recording = false;
+
+	size_t glyphs_size = cache->record_count * sizeof(stbtt_aligned_quad);
+	stbtt_aligned_quad *glyphs = malloc(glyphs_size + len + 1);
+	if (glyphs == NULL) {
+		return NULL;
+	}
+	memcpy(glyphs, cache->record, glyphs_size);
+	char *copy = (char *)glyphs + glyphs_size;
+	memcpy(copy, str, len + 1);
+
+	text_layout_free(slot);
+	slot->hash = hash;
+	slot->cdata = font.cdata;
+	slot->font_size = font.font_size;
+	slot->wrap = wrap;
+	slot->str = copy;
+	slot->len = len;
+	slot->glyphs = glyphs;
+	slot->glyph_count = cache->record_count;
+	slot->max_descended_char_height = get_max_char_height_font(font);
+	slot->props = props;
+	slot->last_used = cache->frame;
+	return slot;
+}
+
+// A miss lays the string out into the least recently used way of its set
+// when fill is set and returns NULL otherwise
+static wp_text_layout *text_cache_get(const char *str, wp_font font,
+									  int32_t wrap, bool fill) {
+	// djb2 over the string, measuring it on the way
+	uint64_t hash = DJB2_INIT;
+	size_t len = 0;
+	for (; str[len] != '\0'; len++) {
+		hash = ((hash << 5) + hash) + (uint8_t)str[len];
+	}
+	hash ^= (uint64_t)(uintptr_t)font.cdata + font.font_size;
+	hash *= 0x9e3779b97f4a7c15ull;
+	hash ^= (uint32_t)wrap;
+
+	wp_text_layout *set =
+		&state.text_cache.entries[(hash >> 32) % TEXT_CACHE_SETS *
+								  TEXT_CACHE_WAYS];
+	wp_text_layout *victim = &set[0];
+	for (uint32_t i = 0; i < TEXT_CACHE_WAYS; i++) {
+		wp_text_layout *layout = &set[i];
+		if (layout->str != NULL && layout->hash == hash &&
+			layout->len == len && layout->cdata == font.cdata &&
+			layout->font_size == font.font_size && layout->wrap == wrap &&
+			memcmp(layout->str, str, len) == 0) {
+			layout->last_used = state.text_cache.frame;
+			return layout;
+		}
+		if (victim->str != NULL &&
+			(layout->str == NULL || layout->last_used < victim->last_used)) {
+			victim = layout;
+		}
+	}
+	if (!fill) {
 		return NULL;
 	}
+	return text_cache_fill(victim, hash, str, len, font, wrap);
+}
+
+// Plain text drawn the same way frame after frame is laid out once. Glyph
+// positions are rounded to whole pixels, so a layout made at the origin is
+// exactly the same one moved to any whole pixel position. Measuring only
+// looks the layout up, so sizing text that is never drawn, like every row
+// of a long list, cannot push out the layouts of what is on screen
+static bool text_render_cached(vec2s pos, const char *str, wp_font font,
+							   wp_color color, int32_t wrap_point,
+							   bool no_render, wp_text_props *ret) {
+	bool measure_only = no_render || !state.renderer_render;
+	vec2s origin = (vec2s){roundf(pos.x), roundf(pos.y)};
+	int32_t wrap = INT32_MIN;
+	if (wrap_point != -1) {
+		wrap = wrap_point - (int32_t)origin.x;
+		if (wrap < 0) {
+			return false;
+		}
+	}
+	wp_text_layout *layout = text_cache_get(str, font, wrap, !measure_only);
+	if (layout == NULL) {
+		return false;
+	}
+
+	*ret = layout->props;
+	ret->end_x += (int32_t)origin.x;
+	ret->end_y += (int32_t)origin.y;
+	if (measure_only) {
+		return true;
+	}
+	bool culled = item_should_cull(
+		(wp_aabb){.pos = (vec2s){pos.x, pos.y + get_current_font().font_size},
+				  .size = (vec2s){-1, -1}});
+	if (!culled) {
+		renderer_add_glyphs(layout->glyphs, layout->glyph_count, origin,
+							layout->max_descended_char_height, color,
+							font_tex_index(font));
+	}
+	return true;
+}
 
-	return wstr;
+// Reads the character at the given position of a UTF-8 or wide string and
+// steps past it. ASCII bytes are their own code point and skip the decoder
+static inline uint32_t text_next_char(const void *str, bool wide,
+									  size_t *at) {
+	if (wide) {
+		return (uint32_t)((const wchar_t *)str)[(*at)++];
+	}
+	const char *s = (const char *)str + *at;
+	if ((uint8_t)s[0] < 0x80) {
+		(*at)++;
+		return (uint8_t)s[0];
+	}
+	int bytes_read;
+	uint32_t c = decode_utf8(s, &bytes_read);
+	*at += bytes_read;
+	return c;
 }
 
 wp_text_props wp_text_render(vec2s pos, const char *str, wp_font font,
@@ -3557,12 +4143,16 @@ wp_text_props wp_text_render(vec2s pos, const char *str, wp_font font,
 							 vec2s stop_point, bool no_render,
 							 bool render_solid, int32_t start_index,
 							 int32_t end_index) {
-	wchar_t *wstr = str_to_wstr(str);
-	wp_text_props textprops = wp_text_render_wchar(
-		pos, (const wchar_t *)wstr, font, color, wrap_point, stop_point,
-		no_render, render_solid, start_index, end_index);
-	free(wstr);
-	return textprops;
+	if (stop_point.x == -1 && stop_point.y == -1 && !render_solid &&
+		start_index == -1 && end_index == -1) {
+		wp_text_props textprops;
+		if (text_render_cached(pos, str, font, color, wrap_point, no_render,
+							   &textprops)) {
+			return textprops;
+		}
+	}
+	return text_render(pos, str, false, font, color, wrap_point, stop_point,
+					   no_render, render_solid, start_index, end_index);
 }
 
 wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
@@ -3570,6 +4160,15 @@ wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
 								   vec2s stop_point, bool no_render,
 								   bool render_solid, int32_t start_index,
 								   int32_t end_index) {
+	return text_render(pos, str, true, font, color, wrap_point, stop_point,
+					   no_render, render_solid, start_index, end_index);
+}
+
+// The index arguments count characters, not bytes, in either encoding
+wp_text_props text_render(vec2s pos, const void *str, bool wide, wp_font font,
+						  wp_color color, int32_t wrap_point, vec2s stop_point,
+						  bool no_render, bool render_solid,
+						  int32_t start_index, int32_t end_index) {
 	bool culled = item_should_cull(
 		(wp_aabb){.pos = (vec2s){pos.x, pos.y + get_current_font().font_size},
 				  .size = (vec2s){-1, -1}});
@@ -3577,22 +4176,7 @@ wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
 	// Retrieving the texture index
 	float tex_index = -1.0f;
 	if (!culled && !no_render) {
-		if (state.render.tex_count - 1 >= MAX_TEX_COUNT_BATCH - 1) {
-			renderer_flush();
-			renderer_begin();
-		}
-		for (uint32_t i = 0; i < state.render.tex_count; i++) {
-			if (state.render.textures[i].id == font.texture.id) {
-				tex_index = (float)i;
-				break;
-			}
-		}
-		if (tex_index == -1.0f) {
-			tex_index = (float)state.render.tex_index;
-			wp_texture tex = font.texture;
-			state.render.textures[state.render.tex_count++] = tex;
-			state.render.tex_index++;
-		}
+		tex_index = font_tex_index(font);
 	}
 
 	// Local variables needed for rendering
@@ -3604,20 +4188,29 @@ wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
 
 	float last_x = x;
 
-	float height = get_max_char_height_font(font);
+	float height = max_descended_char_height;
 	float width = 0;
 
-	uint32_t i = 0;
-	while (str[i] != L'\0') {
-		if (str[i] >= font.num_glyphs) {
-			i++;
+	// The width of the word being rendered, measured once at its start, and
+	// how much of it has been advanced over since
+	float word_width = 0, word_advanced = 0;
+	uint32_t word_end = 0;
+
+	// Where the next character starts, in bytes or wide characters
+	size_t at = 0;
+	for (uint32_t i = 0;; i++) {
+		size_t char_at = at;
+		uint32_t c = text_next_char(str, wide, &at);
+		if (c == 0) {
+			break;
+		}
+		if (c >= font.num_glyphs) {
 			continue;
 		}
 		if (stbtt_FindGlyphIndex((const stbtt_fontinfo *)font.font_info,
-								 str[i] - 32) == 0 &&
-			str[i] != L' ' && str[i] != L'\n' && str[i] != L'\t' &&
-			!iswdigit(str[i]) && !iswpunct(str[i])) {
-			i++;
+								 c - 32) == 0 &&
+			c != L' ' && c != L'\n' && c != L'\t' && !iswdigit(c) &&
+			!iswpunct(c)) {
 			continue;
 		}
 		if (i >= end_index && end_index != -1) {
@@ -3625,18 +4218,30 @@ wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
 		}
 
 		// Calculate the width of the next word
-		float word_width = 0;
-		uint32_t j = i;
-		while (str[j] != L' ' && str[j] != L'\n' && str[j] != L'\0') {
-			stbtt_aligned_quad q;
-			stbtt_GetBakedQuad((stbtt_bakedchar *)font.cdata, font.tex_width,
-							   font.tex_height, str[j] - 32, &word_width, &y,
-							   &q, 0);
-			j++;
+		if (i >= word_end) {
+			word_width = 0;
+			word_advanced = 0;
+			uint32_t j = i;
+			size_t next_at = char_at;
+			for (;;) {
+				uint32_t cj = text_next_char(str, wide, &next_at);
+				if (cj == L' ' || cj == L'\n' || cj == 0) {
+					break;
+				}
+				if (cj < font.num_glyphs) {
+					stbtt_aligned_quad q;
+					stbtt_GetBakedQuad((stbtt_bakedchar *)font.cdata,
+									   font.tex_width, font.tex_height,
+									   cj - 32, &word_width, &y, &q, 0);
+				}
+				j++;
+			}
+			word_end = j > i ? j : i + 1;
 		}
 
-		// If the next word exceeds the wrap point, move to the next line
-		if (x + word_width > wrap_point && wrap_point != -1) {
+		// If the rest of the word exceeds the wrap point, move to the next
+		// line
+		if (x + word_width - word_advanced > wrap_point && wrap_point != -1) {
 			y += font.font_size;
 			height += font.font_size;
 			if (x - pos.x > width) {
@@ -3647,7 +4252,7 @@ wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
 		}
 
 		// If the current character is a new line, advance to the next line
-		if (str[i] == L'\n') {
+		if (c == L'\n') {
 			y += font.font_size;
 			height += font.font_size;
 			if (x - pos.x > width) {
@@ -3655,38 +4260,41 @@ wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
 			}
 			x = pos.x;
 			last_x = x;
-			i++;
 			continue;
 		}
 
 		// Retrieving the vertex data of the current character & submitting it
 		// to the batch
 		stbtt_aligned_quad q;
+		float x_before = x;
 		stbtt_GetBakedQuad((stbtt_bakedchar *)font.cdata, font.tex_width,
-						   font.tex_height, str[i] - 32, &x, &y, &q, 1);
+						   font.tex_height, c - 32, &x, &y, &q, 1);
+		word_advanced += x - x_before;
 		if (i < start_index && start_index != -1) {
 			last_x = x;
 			ret.rendered_count++;
-			i++;
 			continue;
 		}
 		if (stop_point.x != -1 && stop_point.y != -1) {
 			if (x >= stop_point.x && stop_point.x != -1 &&
-				y + get_max_char_height_font(font) >= stop_point.y &&
+				y + max_descended_char_height >= stop_point.y &&
 				stop_point.y != -1) {
 				break;
 			}
 		} else {
-			if (y + get_max_char_height_font(font) >= stop_point.y &&
+			if (y + max_descended_char_height >= stop_point.y &&
 				stop_point.y != -1) {
 				break;
 			}
 		}
+		if (state.text_cache.recording) {
+			text_cache_record(q);
+		}
 		if (!culled && !no_render && state.renderer_render) {
 			if (render_solid) {
 				wp_rect_render(
 					(vec2s){x, y},
-					(vec2s){last_x - x, get_max_char_height_font(font)}, color,
+					(vec2s){last_x - x, max_descended_char_height}, color,
 					WP_NO_COLOR, 0.0f, 0.0f);
 			} else {
 				renderer_add_glyph(q, max_descended_char_height, color,
@@ -3695,7 +4303,6 @@ wp_text_props wp_text_render_wchar(vec2s pos, const wchar_t *str, wp_font font,
 			last_x = x;
 		}
 		ret.rendered_count++;
-		i++;
 	}
 
 	// Populating the return value
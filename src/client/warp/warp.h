@@ -181,6 +181,39 @@ typedef struct {
 
 typedef void (*wp_menu_item_callback)(uint32_t *);
 
+// height in pixels of row index when laid out width pixels wide
+typedef float (*wp_virtual_list_height_fn)(uint32_t index, float width,
+										   void *user_data);
+
+// a scrolling list that only lays out the rows in view. row heights are
+// asked for once and kept as running sums, so finding the visible rows is
+// a binary search however long the list gets. rows that still need a
+// height at the current width keep a guess until they get one, the rows
+// in view are measured first and a few more each frame after that
+typedef struct {
+	// prefix[i] is the top of row i, prefix[count] the height of them all
+	float *prefix;
+	// each row's height, a guess while stale is set for it
+	float *heights;
+	bool *stale;
+	uint32_t count, cap;
+	// rows waiting for a height and where the pass over them has got to
+	uint32_t stale_count, stale_cursor;
+	// the latest height measured above 0, what new rows are guessed at
+	float guess;
+	// the width the heights were measured at, a new one measures again
+	float width;
+	// like a div's scroll, 0 at the top and negative further down
+	float scroll;
+	float scroll_velocity;
+	// keep the last row in view as rows are added while scrolled to it
+	bool stick_to_end;
+	bool at_end;
+	// rows first up to but not including end are visible this frame
+	uint32_t first, end;
+	bool _init;
+} wp_virtual_list;
+
 void wp_init_glfw(uint32_t display_width, uint32_t display_height,
 				  void *glfw_window);
 
@@ -335,6 +368,31 @@ wp_div *_wp_div_begin_loc(vec2s pos, vec2s size, bool scrollable, float *scroll,
 
 void wp_div_end();
 
+// opens a div showing the list and sets list->first and list->end. draw
+// each visible row after moving to it with wp_virtual_list_row
+#define wp_virtual_list_begin(list, pos, size, item_count, height, user_data) \
+	_wp_virtual_list_begin_loc(list, pos, size, item_count, height,           \
+							   user_data, __FILE__, __LINE__)
+void _wp_virtual_list_begin_loc(wp_virtual_list *list, vec2s pos, vec2s size,
+								uint32_t item_count,
+								wp_virtual_list_height_fn height,
+								void *user_data, const char *file,
+								int32_t line);
+
+void wp_virtual_list_row(wp_virtual_list *list, uint32_t index);
+
+void wp_virtual_list_end(wp_virtual_list *list);
+
+// rows from index on changed height or were replaced, they are measured
+// again starting with the ones in view
+void wp_virtual_list_invalidate(wp_virtual_list *list, uint32_t index);
+
+// the first count rows went away and every other row moved up by as many,
+// the rest keep their heights and the view stays on the same rows
+void wp_virtual_list_drop_front(wp_virtual_list *list, uint32_t count);
+
+void wp_virtual_list_free(wp_virtual_list *list);
+
 wp_clickable_state _wp_item_loc(vec2s size, const char *file, int32_t line);
 #define wp_item(size) _wp_item_loc(size, __FILE__, __LINE__)
 
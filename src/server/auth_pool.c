@@ -0,0 +1,197 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "auth_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// slots sharing a lock, so attempts from different addresses rarely wait
+#define AUTH_RATE_STRIPES 64
+
+// jobs take tens of milliseconds each, so a plain locked ring is cheap
+// next to them and lets any idle worker pick up the next one
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	auth_job_t **jobs;
+	uint32_t depth, head, count;
+} auth_queue_t;
+
+// allowance of one address, tokens are in thousandths of an attempt
+typedef struct {
+	uint32_t addr;
+	uint32_t tokens;
+	uint64_t refill_ms;
+} auth_rate_slot_t;
+
+static auth_queue_t auth_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+};
+// queued plus running, read without the lock for the early check
+static atomic_uint auth_busy;
+static uint32_t auth_worker_count;
+
+static pthread_mutex_t auth_rate_locks[AUTH_RATE_STRIPES];
+static auth_rate_slot_t *auth_rate_slots;
+static uint32_t auth_rate_burst;
+static uint32_t auth_rate_per_min;
+
+static void complete_job(reactor_t *r, reactor_task_t *task) {
+	auth_job_t *job = (auth_job_t *)((char *)task - offsetof(auth_job_t, task));
+	job->done(r, job);
+}
+
+static void *auth_worker_main(void *arg) {
+	(void)arg;
+	while (true) {
+		pthread_mutex_lock(&auth_queue.lock);
+		while (auth_queue.count == 0) {
+			pthread_cond_wait(&auth_queue.ready, &auth_queue.lock);
+		}
+		auth_job_t *job = auth_queue.jobs[auth_queue.head];
+		auth_queue.head = (auth_queue.head + 1) % auth_queue.depth;
+		auth_queue.count--;
+		pthread_mutex_unlock(&auth_queue.lock);
+
+		job->result = job->exec(job);
+		atomic_fetch_sub(&auth_busy, 1);
+		job->task.run = complete_job;
+		reactor_post(job->reactor, &job->task);
+	}
+	return NULL;
+}
+
+int auth_pool_start(uint32_t workers, uint32_t queue_depth,
+					uint32_t rate_burst, uint32_t rate_per_min) {
+	if (workers == 0) {
+		workers = 1;
+	}
+	if (queue_depth == 0) {
+		queue_depth = 1;
+	}
+	auth_queue.jobs = calloc(queue_depth, sizeof(auth_job_t *));
+	auth_rate_slots = calloc(AUTH_RATE_SLOTS, sizeof(auth_rate_slot_t));
+	if (auth_queue.jobs == NULL || auth_rate_slots == NULL) {
+		perror("Failed to allocate auth pool");
+		return PORTAL_FAIL;
+	}
+	auth_queue.depth = queue_depth;
+	auth_worker_count = workers;
+	auth_rate_burst = rate_burst;
+	auth_rate_per_min = rate_per_min;
+	for (uint32_t i = 0; i < AUTH_RATE_STRIPES; ++i) {
+		pthread_mutex_init(&auth_rate_locks[i], NULL);
+	}
+
+	for (uint32_t i = 0; i < workers; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, auth_worker_main, NULL) != 0) {
+			perror("Failed to start auth worker");
+			return PORTAL_FAIL;
+		}
+		pthread_detach(thread);
+	}
+	printf("Auth pool started with %u workers and %u queue slots.\n", workers,
+		   queue_depth);
+	return PORTAL_OK;
+}
+
+int auth_pool_submit(reactor_t *r, auth_job_t *job, auth_exec_fn exec,
+					 auth_done_fn done) {
+	job->reactor = r;
+	job->exec = exec;
+	job->done = done;
+
+	pthread_mutex_lock(&auth_queue.lock);
+	if (auth_queue.count == auth_queue.depth) {
+		pthread_mutex_unlock(&auth_queue.lock);
+		return PORTAL_AGAIN;
+	}
+	auth_queue.jobs[(auth_queue.head + auth_queue.count) % auth_queue.depth] =
+		job;
+	auth_queue.count++;
+	atomic_fetch_add(&auth_busy, 1);
+	pthread_cond_signal(&auth_queue.ready);
+	pthread_mutex_unlock(&auth_queue.lock);
+	return PORTAL_OK;
+}
+
+bool auth_pool_saturated() {
+	return atomic_load_explicit(&auth_busy, memory_order_relaxed) >=
+		   auth_queue.depth + auth_worker_count;
+}
+
+static uint64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool auth_rate_allow(uint32_t addr) {
+	if (auth_rate_burst == 0) {
+		return true;
+	}
+	// two candidate slots per address, so one busy neighbour cannot keep
+	// resetting another address' allowance
+	uint32_t hash = addr * 2654435769u;
+	uint32_t a = hash % AUTH_RATE_SLOTS;
+	uint32_t b = (hash >> 16) % AUTH_RATE_SLOTS;
+	// both candidates sit under the lock of the first
+	b = b - b % AUTH_RATE_STRIPES + a % AUTH_RATE_STRIPES;
+	pthread_mutex_t *lock = &auth_rate_locks[a % AUTH_RATE_STRIPES];
+	uint32_t full = auth_rate_burst * 1000;
+	uint64_t now = now_ms();
+
+	pthread_mutex_lock(lock);
+	auth_rate_slot_t *slot = &auth_rate_slots[a];
+	if (slot->addr != addr) {
+		auth_rate_slot_t *other = &auth_rate_slots[b];
+		if (other->addr == addr) {
+			slot = other;
+		} else {
+			// take over whichever candidate was refilled longest ago
+			if (other->refill_ms < slot->refill_ms) {
+				slot = other;
+			}
+			slot->addr = addr;
+			slot->tokens = full;
+			slot->refill_ms = now;
+		}
+	}
+
+	uint64_t refill = (now - slot->refill_ms) * auth_rate_per_min / 60;
+	if (slot->tokens + refill >= full) {
+		slot->tokens = full;
+		slot->refill_ms = now;
+	} else if (refill > 0) {
+		// only the time that turned into whole tokens is used up, so
+		// frequent attempts still see their allowance refill
+		slot->tokens += refill;
+		slot->refill_ms += refill * 60 / auth_rate_per_min;
+	}
+	bool allowed = slot->tokens >= 1000;
+	if (allowed) {
+		slot->tokens -= 1000;
+	}
+	pthread_mutex_unlock(lock);
+	return allowed;
+}
@@ -0,0 +1,68 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef AUTH_POOL_H
+#define AUTH_POOL_H
+
+#include "reactor.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// every worker may be holding a whole argon2 memory block, so the worker
+// count is what bounds the memory and cores password hashing can take
+#define AUTH_POOL_DEFAULT_WORKERS 2
+// hashes waiting for a worker, past this new ones are turned away
+#define AUTH_POOL_DEFAULT_QUEUE 64
+// each address gets a burst of attempts, then a steady trickle per minute
+#define AUTH_RATE_DEFAULT_BURST 10
+#define AUTH_RATE_DEFAULT_PER_MIN 30
+// addresses tracked at once, a new one takes the slot of a stale one
+#define AUTH_RATE_SLOTS 4096
+
+typedef struct auth_job auth_job_t;
+
+// runs on an auth worker, the slow part such as hashing a password
+typedef int (*auth_exec_fn)(auth_job_t *job);
+// runs on the reactor that submitted the job, which owns it again
+typedef void (*auth_done_fn)(reactor_t *r, auth_job_t *job);
+
+// embed it in the request, like a db_job_t
+struct auth_job {
+	reactor_task_t task;
+	reactor_t *reactor;
+	auth_exec_fn exec;
+	auth_done_fn done;
+	// whatever exec returned
+	int result;
+};
+
+int auth_pool_start(uint32_t workers, uint32_t queue_depth,
+					uint32_t rate_burst, uint32_t rate_per_min);
+
+// thread safe and never waits for a worker. PORTAL_AGAIN when the queue is
+// full, the caller keeps the job and should tell the client to back off
+int auth_pool_submit(reactor_t *r, auth_job_t *job, auth_exec_fn exec,
+					 auth_done_fn done);
+
+// a cheap early check so a request can be refused before doing any work
+bool auth_pool_saturated();
+
+// thread safe, takes one attempt from the address' allowance and returns
+// false when it has none left. a burst of 0 turns the limit off
+bool auth_rate_allow(uint32_t addr);
+
+#endif // AUTH_POOL_H
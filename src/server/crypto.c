@@ -18,33 +18,47 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #include "crypto.h"
 #include "socket_util.h"
 #include <argon2.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <time.h>
 
-static void crypto_generate_salt(unsigned char *salt, size_t len) {
-	for (size_t i = 0; i < len; ++i) {
-		salt[i] = rand() % 256;
+static crypto_profile_t profile = {
+	.t_cost = CRYPTO_DEFAULT_T_COST,
+	.m_cost_kib = CRYPTO_DEFAULT_M_COST_KIB,
+	.parallelism = CRYPTO_DEFAULT_PARALLELISM,
+};
+
+void crypto_set_profile(const crypto_profile_t *next) { profile = *next; }
+
+const crypto_profile_t *crypto_profile() { return &profile; }
+
+static int crypto_generate_salt(unsigned char *salt, size_t len) {
+	// a salt only has to be unique, but rand() seeded with the time hands
+	// every registration within the same second the same one
+	if (getrandom(salt, len, 0) != (ssize_t)len) {
+		perror("Failed to generate salt");
+		return PORTAL_FAIL;
 	}
+	return PORTAL_OK;
 }
 
 int crypto_generate_hash_with_salt(user_t *usr, const char *psswd) {
-	srand(time(NULL));
-
 	unsigned char salt[16];
-	crypto_generate_salt(salt, sizeof(salt));
+	if (crypto_generate_salt(salt, sizeof(salt)) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
 
-	// Argon2 Params
+	// the encoded form carries the salt and parameters, so the stored
+	// string is all a later login needs to check a password against
 	char encoded_hash[128];
-	uint32_t t_cost = 2;
-	uint32_t m_cost = 1 << 17; // 128 MB
-	uint32_t parallelism = 12;
-
-	int rc = argon2i_hash_raw(t_cost, m_cost, parallelism, psswd, strlen(psswd),
-							  salt, strlen(salt), encoded_hash,
-							  sizeof(encoded_hash));
+	int rc = argon2i_hash_encoded(profile.t_cost, profile.m_cost_kib,
+								  profile.parallelism, psswd, strlen(psswd),
+								  salt, sizeof(salt), CRYPTO_HASH_LEN,
+								  encoded_hash, sizeof(encoded_hash));
 
 	if (rc != ARGON2_OK) {
 		printf("Error: %s\n", argon2_error_message(rc));
@@ -57,3 +71,98 @@ int crypto_generate_hash_with_salt(user_t *usr, const char *psswd) {
 
 	return PORTAL_OK;
 }
+
+int crypto_verify_password(const user_t *usr, const char *psswd) {
+	int rc = argon2i_verify((const char *)usr->psswd_hash, psswd,
+							strlen(psswd));
+	if (rc != ARGON2_OK && rc != ARGON2_VERIFY_MISMATCH) {
+		printf("Error: %s\n", argon2_error_message(rc));
+	}
+	return rc == ARGON2_OK ? PORTAL_OK : PORTAL_FAIL;
+}
+
+// made with the current profile the first time it is needed
+static pthread_once_t dummy_once = PTHREAD_ONCE_INIT;
+static user_t dummy_user;
+static bool dummy_ready;
+
+static void make_dummy() {
+	int rc = crypto_generate_hash_with_salt(&dummy_user, "portal unknown");
+	dummy_ready = rc == PORTAL_OK;
+}
+
+int crypto_verify_dummy(const char *psswd) {
+	pthread_once(&dummy_once, make_dummy);
+	if (dummy_ready) {
+		crypto_verify_password(&dummy_user, psswd);
+	}
+	return PORTAL_FAIL;
+}
+
+bool crypto_needs_rehash(const user_t *usr) {
+	uint32_t m_cost, t_cost, parallelism;
+	if (sscanf((const char *)usr->psswd_hash, "$argon2i$v=%*u$m=%u,t=%u,p=%u",
+			   &m_cost, &t_cost, &parallelism) != 3) {
+		return true;
+	}
+	return m_cost != profile.m_cost_kib || t_cost != profile.t_cost ||
+		   parallelism != profile.parallelism;
+}
+
+// milliseconds one hash takes with the given profile, -1 if it failed
+static double time_hash(const crypto_profile_t *p) {
+	static const char psswd[] = "portal calibration";
+	unsigned char salt[16] = {0};
+	unsigned char hash[CRYPTO_HASH_LEN];
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int rc = argon2i_hash_raw(p->t_cost, p->m_cost_kib, p->parallelism, psswd,
+							  sizeof(psswd) - 1, salt, sizeof(salt), hash,
+							  sizeof(hash));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (rc != ARGON2_OK) {
+		printf("Error: %s\n", argon2_error_message(rc));
+		return -1;
+	}
+	return (end.tv_sec - start.tv_sec) * 1000.0 +
+		   (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int crypto_calibrate(uint32_t target_ms, crypto_profile_t *p) {
+	crypto_profile_t trial = *p;
+	trial.t_cost = 1;
+
+	// memory is what makes argon2 expensive to attack, so it only shrinks
+	// when even a single pass over it misses the target
+	double ms = time_hash(&trial);
+	while (ms > target_ms && trial.m_cost_kib / 2 >= CRYPTO_MIN_M_COST_KIB) {
+		trial.m_cost_kib /= 2;
+		ms = time_hash(&trial);
+	}
+	if (ms < 0) {
+		return PORTAL_FAIL;
+	}
+	printf("Calibration: t=%u m=%u KiB p=%u takes %.1f ms\n", trial.t_cost,
+		   trial.m_cost_kib, trial.parallelism, ms);
+
+	// passes cost roughly the same each, so add them while the next one
+	// still fits
+	double per_pass = ms;
+	while (trial.t_cost < CRYPTO_MAX_T_COST &&
+		   ms + per_pass <= target_ms) {
+		trial.t_cost++;
+		ms = time_hash(&trial);
+		if (ms < 0) {
+			return PORTAL_FAIL;
+		}
+		per_pass = ms / trial.t_cost;
+		printf("Calibration: t=%u m=%u KiB p=%u takes %.1f ms\n",
+			   trial.t_cost, trial.m_cost_kib, trial.parallelism, ms);
+	}
+	if (ms > target_ms && trial.t_cost > 1) {
+		trial.t_cost--;
+	}
+	*p = trial;
+	return PORTAL_OK;
+}
@@ -19,7 +19,44 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #define CRYPTO_H
 
 #include "users_db.h"
+#include <stdbool.h>
+#include <stdint.h>
 
+// bytes of argon2 output inside the encoded hash
+#define CRYPTO_HASH_LEN 32
+
+#define CRYPTO_DEFAULT_T_COST 2
+#define CRYPTO_DEFAULT_M_COST_KIB (1 << 17) // 128 MB
+#define CRYPTO_DEFAULT_PARALLELISM 12
+// calibration never goes below this much memory to make a hash faster
+#define CRYPTO_MIN_M_COST_KIB (1 << 13)
+#define CRYPTO_MAX_T_COST 64
+
+// argon2 cost parameters, the encoded hash records the ones it was made
+// with so changing them never locks anyone out
+typedef struct {
+	uint32_t t_cost;
+	uint32_t m_cost_kib;
+	uint32_t parallelism;
+} crypto_profile_t;
+
+// the profile new hashes are made with, set before the auth pool starts
+void crypto_set_profile(const crypto_profile_t *profile);
+const crypto_profile_t *crypto_profile();
+
+// times hashes on this host and fills in the costliest profile that still
+// hashes within target_ms, starting from profile's memory and parallelism
+// and giving up memory only when a single pass is already too slow
+int crypto_calibrate(uint32_t target_ms, crypto_profile_t *profile);
+
+// both take long enough that they belong on an auth worker
 int crypto_generate_hash_with_salt(user_t *usr, const char *psswd);
+// PORTAL_OK when psswd matches the encoded hash stored in usr
+int crypto_verify_password(const user_t *usr, const char *psswd);
+// true when usr's hash was made with another profile than the current one
+bool crypto_needs_rehash(const user_t *usr);
+// costs the same as checking a real password and always fails, so a
+// login for an unknown username takes as long as one with a wrong password
+int crypto_verify_dummy(const char *psswd);
 
 #endif // CRYPTO_H
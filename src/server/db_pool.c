@@ -0,0 +1,323 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#define _GNU_SOURCE
+#include "db_pool.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// a busy connection waits this long for the writer's lock, in wal mode
+// only checkpoints and recovery ever make a reader wait
+#define DB_BUSY_TIMEOUT_MS 5000
+
+// normal only syncs at checkpoints, a crash can lose the last commits but
+// never corrupts the database. reads come out of the mapping and a 8 MiB
+// page cache per connection instead of read() calls
+#define DB_TUNING_PRAGMAS                                                     \
+	"PRAGMA synchronous = NORMAL;"                                            \
+	"PRAGMA mmap_size = 268435456;"                                           \
+	"PRAGMA cache_size = -8192;"                                              \
+	"PRAGMA temp_store = MEMORY;"
+
+// each worker has its own queue since an mpsc queue has a single consumer
+typedef struct {
+	pthread_t thread;
+	db_conn_t conn;
+	mpsc_queue_t queue;
+	int event_fd;
+	atomic_bool signaled;
+	// writer only, jobs run in the open transaction waiting for its commit
+	db_job_t **batch;
+} db_worker_t;
+
+// wal allows a single writer, readers never block it or each other
+static db_worker_t db_writer;
+static db_worker_t *db_readers;
+static uint32_t db_reader_count;
+static uint32_t db_batch_max = DB_POOL_DEFAULT_BATCH_MAX;
+static uint32_t db_batch_window_us = DB_POOL_DEFAULT_BATCH_WINDOW_US;
+
+static void complete_job(reactor_t *r, reactor_task_t *task) {
+	db_job_t *job = (db_job_t *)((char *)task - offsetof(db_job_t, task));
+	job->done(r, job);
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// true once a submit has signaled, false if timeout_us ran out first. a
+// negative timeout waits for as long as it takes
+static bool wait_for_jobs(db_worker_t *worker, int64_t timeout_us) {
+	if (timeout_us >= 0) {
+		struct pollfd pfd = {.fd = worker->event_fd, .events = POLLIN};
+		struct timespec ts = {.tv_sec = timeout_us / 1000000,
+							  .tv_nsec = (timeout_us % 1000000) * 1000};
+		if (ppoll(&pfd, 1, &ts, NULL) <= 0) {
+			return false;
+		}
+	}
+
+	uint64_t count;
+	ssize_t rc = read(worker->event_fd, &count, sizeof(count));
+	(void)rc;
+	// clear the flag before draining so a racing submit re-signals
+	atomic_store(&worker->signaled, false);
+	return true;
+}
+
+static void finish_job(db_job_t *job) {
+	job->task.run = complete_job;
+	reactor_post(job->reactor, &job->task);
+}
+
+static void run_each(db_worker_t *worker) {
+	mpsc_node_t *node;
+	while ((node = mpsc_pop(&worker->queue)) != NULL) {
+		db_job_t *job = (db_job_t *)node;
+		job->result = job->exec(&worker->conn, job);
+		finish_job(job);
+	}
+}
+
+// hands back the jobs of a transaction that is over. a failed one takes
+// every job that had succeeded in it down as well
+static void finish_batch(db_worker_t *worker, uint32_t count, int rc) {
+	for (uint32_t i = 0; i < count; ++i) {
+		db_job_t *job = worker->batch[i];
+		if (rc != SQLITE_OK && job->result == SQLITE_OK) {
+			job->result = rc;
+		}
+		finish_job(job);
+	}
+}
+
+// group commit, jobs arriving within the window share one transaction so
+// a burst of writes pays for a single commit instead of one each. nobody
+// hears back before the commit, so a job never sees a result that could
+// still be rolled back
+static void run_batch(db_worker_t *worker) {
+	sqlite3 *db = worker->conn.db;
+	uint32_t count = 0;
+	uint64_t deadline_us = 0;
+
+	while (true) {
+		mpsc_node_t *node;
+		while (count < db_batch_max &&
+			   (node = mpsc_pop(&worker->queue)) != NULL) {
+			db_job_t *job = (db_job_t *)node;
+			if (count == 0) {
+				if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) !=
+					SQLITE_OK) {
+					// no transaction to share, run it on its own
+					job->result = job->exec(&worker->conn, job);
+					finish_job(job);
+					continue;
+				}
+				deadline_us = now_us() + db_batch_window_us;
+			}
+
+			worker->batch[count++] = job;
+			job->result = job->exec(&worker->conn, job);
+
+			// a failed constraint only undoes its own statement, but i/o
+			// errors and the like roll back the whole transaction
+			if (sqlite3_get_autocommit(db)) {
+				int rc = job->result != SQLITE_OK ? job->result : SQLITE_ABORT;
+				finish_batch(worker, count, rc);
+				count = 0;
+			}
+		}
+
+		if (count == 0) {
+			return;
+		}
+		if (count >= db_batch_max) {
+			break;
+		}
+		int64_t left_us = (int64_t)(deadline_us - now_us());
+		if (left_us <= 0 || !wait_for_jobs(worker, left_us)) {
+			break;
+		}
+	}
+
+	int rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		printf("Error committing write batch: %s\n", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+	}
+	finish_batch(worker, count, rc);
+}
+
+static void *db_worker_main(void *arg) {
+	db_worker_t *worker = arg;
+
+	while (true) {
+		// blocks until a submit signals there is work
+		wait_for_jobs(worker, -1);
+
+		if (worker->batch == NULL) {
+			run_each(worker);
+			continue;
+		}
+		// a full batch leaves the rest queued without another signal
+		do {
+			run_batch(worker);
+		} while (!mpsc_empty(&worker->queue));
+	}
+	return NULL;
+}
+
+static int run_pragmas(sqlite3 *db, const char *sql) {
+	char *err_msg = NULL;
+	int rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+	if (rc != SQLITE_OK) {
+		printf("Error tuning DB connection: %s\n", err_msg);
+		sqlite3_free(err_msg);
+	}
+	return rc;
+}
+
+static int open_connection(const char *path, sqlite3 **db, bool writer) {
+	// every connection is only ever used by its own worker
+	int flags = SQLITE_OPEN_NOMUTEX |
+				(writer ? SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+						: SQLITE_OPEN_READONLY);
+	int rc = sqlite3_open_v2(path, db, flags, NULL);
+	if (rc != SQLITE_OK) {
+		printf("Error opening DB: %s\n", sqlite3_errmsg(*db));
+		sqlite3_close(*db);
+		return rc;
+	}
+	sqlite3_busy_timeout(*db, DB_BUSY_TIMEOUT_MS);
+
+	// the journal mode sticks to the file, so the writer sets it before
+	// any reader opens
+	if (writer && (rc = run_pragmas(*db, "PRAGMA journal_mode = WAL;")) !=
+					  SQLITE_OK) {
+		return rc;
+	}
+	return run_pragmas(*db, DB_TUNING_PRAGMAS);
+}
+
+static int start_worker(db_worker_t *worker) {
+	mpsc_init(&worker->queue);
+	atomic_init(&worker->signaled, false);
+	worker->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker->event_fd < 0) {
+		perror("Failed to create database worker eventfd");
+		return SQLITE_ERROR;
+	}
+	pthread_create(&worker->thread, NULL, db_worker_main, worker);
+	return SQLITE_OK;
+}
+
+int db_pool_start(const char *path, uint32_t reader_count, db_setup_fn setup) {
+	if (reader_count == 0) {
+		reader_count = 1;
+	}
+	db_readers = calloc(reader_count, sizeof(db_worker_t));
+	if (db_readers == NULL) {
+		perror("Failed to allocate database workers");
+		return SQLITE_NOMEM;
+	}
+	db_reader_count = reader_count;
+
+	// the schema has to exist before a read only connection can see it
+	int rc = open_connection(path, &db_writer.conn.db, true);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+	if (setup != NULL && (rc = setup(db_writer.conn.db)) != SQLITE_OK) {
+		return rc;
+	}
+	if (db_batch_max > 1) {
+		db_writer.batch = calloc(db_batch_max, sizeof(db_job_t *));
+		if (db_writer.batch == NULL) {
+			perror("Failed to allocate the write batch");
+			return SQLITE_NOMEM;
+		}
+	}
+	if ((rc = start_worker(&db_writer)) != SQLITE_OK) {
+		return rc;
+	}
+
+	for (uint32_t i = 0; i < reader_count; ++i) {
+		db_worker_t *worker = &db_readers[i];
+		if ((rc = open_connection(path, &worker->conn.db, false)) !=
+				SQLITE_OK ||
+			(rc = start_worker(worker)) != SQLITE_OK) {
+			return rc;
+		}
+	}
+
+	printf("DB opened successfully with %u readers, writes batched up to %u "
+		   "rows.\n",
+		   reader_count, db_batch_max);
+	return SQLITE_OK;
+}
+
+void db_pool_set_batching(uint32_t max_jobs, uint32_t window_us) {
+	db_batch_max = max_jobs > 0 ? max_jobs : 1;
+	db_batch_window_us = window_us;
+}
+
+void db_pool_submit(db_job_t *job) {
+	db_worker_t *worker = job->read_only
+							  ? &db_readers[job->key % db_reader_count]
+							  : &db_writer;
+	mpsc_push(&worker->queue, &job->node);
+
+	// only the first submit after the worker drained pays for the wakeup
+	if (!atomic_exchange(&worker->signaled, true)) {
+		uint64_t one = 1;
+		ssize_t rc = write(worker->event_fd, &one, sizeof(one));
+		(void)rc;
+	}
+}
+
+sqlite3_stmt *db_statement(db_conn_t *conn, uint32_t slot, const char *sql) {
+	if (slot >= DB_MAX_STATEMENTS) {
+		return NULL;
+	}
+	if (conn->stmts[slot] == NULL) {
+		// persistent tells sqlite the statement is kept for a long time
+		int rc = sqlite3_prepare_v3(conn->db, sql, -1,
+									SQLITE_PREPARE_PERSISTENT,
+									&conn->stmts[slot], NULL);
+		if (rc != SQLITE_OK) {
+			printf("Error preparing statement: %s\n",
+				   sqlite3_errmsg(conn->db));
+			return NULL;
+		}
+	}
+	return conn->stmts[slot];
+}
+
+void db_release(sqlite3_stmt *stmt) {
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
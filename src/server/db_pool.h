@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef DB_POOL_H
+#define DB_POOL_H
+
+#include "mpsc.h"
+#include "reactor.h"
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DB_POOL_DEFAULT_READERS 2
+#define DB_POOL_MAX_READERS 64
+// the writer commits once this many jobs are in its transaction, or once
+// the first of them has waited out the window
+#define DB_POOL_DEFAULT_BATCH_MAX 256
+#define DB_POOL_DEFAULT_BATCH_WINDOW_US 1000
+// statement slots every connection keeps prepared
+#define DB_MAX_STATEMENTS 16
+
+// a connection and the statements prepared on it, owned by one worker
+typedef struct {
+	sqlite3 *db;
+	sqlite3_stmt *stmts[DB_MAX_STATEMENTS];
+} db_conn_t;
+
+typedef struct db_job db_job_t;
+
+// runs on a database worker with that worker's own connection
+typedef int (*db_exec_fn)(db_conn_t *conn, db_job_t *job);
+// runs on the reactor that submitted the job, which owns it again from then
+// on. connections may have closed in between so look them up by id
+typedef void (*db_done_fn)(reactor_t *r, db_job_t *job);
+
+// embed it at the start of the request so a job is a single allocation
+struct db_job {
+	mpsc_node_t node;
+	reactor_task_t task;
+	reactor_t *reactor;
+	db_exec_fn exec;
+	db_done_fn done;
+	// read only jobs go to a reader picked by key, the rest to the writer.
+	// jobs with the same key run in submission order
+	bool read_only;
+	uint32_t key;
+	// whatever exec returned, or the error that rolled its batch back
+	int result;
+};
+
+typedef int (*db_setup_fn)(sqlite3 *db);
+
+// call before db_pool_start. a max of 1 commits every write on its own, a
+// window of 0 only batches the jobs already queued when the first one runs
+void db_pool_set_batching(uint32_t max_jobs, uint32_t window_us);
+
+// opens the database in wal mode with one writer and reader_count read only
+// connections, each on its own worker. setup runs on the writer before any
+// job so it can create the schema
+int db_pool_start(const char *path, uint32_t reader_count, db_setup_fn setup);
+
+// thread safe and never blocks, the job must stay alive until done runs.
+// a read only job sees every write that completed before it started, not
+// writes still queued on the writer. write jobs run inside the writer's
+// batch transaction, so exec must not begin or commit one itself
+void db_pool_submit(db_job_t *job);
+
+// the statement in slot, prepared from sql the first time the connection
+// asks for it. NULL if it does not compile. call db_release once its rows
+// have been read so it does not hold the read snapshot open
+sqlite3_stmt *db_statement(db_conn_t *conn, uint32_t slot, const char *sql);
+void db_release(sqlite3_stmt *stmt);
+
+#endif // DB_POOL_H
@@ -0,0 +1,904 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#define _GNU_SOURCE
+#include "history.h"
+#include "bufpool.h"
+#include "recent.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define HISTORY_INIT_BUCKETS 256
+// frames a room collects before they go out in one writev
+#define HISTORY_WRITE_BATCH 64
+// the longest name under the history directory, "/<room>/<seq>.log"
+#define HISTORY_PATH_SUFFIX_MAX (1 + 10 + 1 + 20 + 4)
+
+// the byte offset of one record, records count from the segment start
+typedef struct {
+	uint32_t record;
+	uint32_t offset;
+} history_index_entry_t;
+
+typedef struct {
+	uint64_t base_seq;
+	uint32_t count;
+	uint32_t size;
+	// sealed segments from an earlier run load theirs on the first fetch
+	history_index_entry_t *index;
+	uint32_t index_count, index_cap;
+	bool index_loaded;
+} history_segment_t;
+
+typedef struct history_room {
+	uint32_t id;
+	// oldest first, the last one is the tail being appended to
+	history_segment_t *segments;
+	uint32_t segment_count, segment_cap;
+	int tail_fd;
+	int index_fd;
+	// covers the whole segment size, frames become readable through it as
+	// soon as their write returns
+	history_map_t *tail_map;
+	// tail index entries already in its .idx file
+	uint32_t index_written;
+	// frames counted into the tail but not written yet
+	msgbuf_t *pending[HISTORY_WRITE_BATCH];
+	uint32_t pending_count;
+	bool dirty;
+	struct history_room *next;
+	struct history_room *next_dirty;
+	// open rooms, most recently used first
+	struct history_room *lru_prev, *lru_next;
+} history_room_t;
+
+typedef struct {
+	history_op_t op;
+	uint32_t room;
+	msgbuf_t *buf;
+} history_append_t;
+
+static char history_dir[PATH_MAX];
+static pthread_t history_thread;
+static mpsc_queue_t history_queue;
+static int history_event_fd;
+static atomic_bool history_signaled;
+
+// only the history thread touches these
+static history_room_t **history_buckets;
+static uint32_t history_bucket_count;
+static uint32_t history_room_count;
+static history_room_t *history_dirty;
+// every open room holds two fds and a tail mapping, past this many the
+// least recently used one is closed and read back from disk when named
+static uint32_t history_max_open;
+static history_room_t *history_lru_head, *history_lru_tail;
+
+static uint32_t bucket_of(uint32_t room_id) {
+	// fibonacci hashing spreads sequential ids across buckets
+	return (room_id * 2654435769u) & (history_bucket_count - 1);
+}
+
+// history_start keeps the directory short enough for every path below, a
+// failure here means that check and these formats went out of step
+static int room_path(char *path, uint32_t room_id) {
+	int n = snprintf(path, PATH_MAX, "%s/%u", history_dir, room_id);
+	return n >= 0 && n < PATH_MAX ? PORTAL_OK : PORTAL_FAIL;
+}
+
+static int segment_path(char *path, uint32_t room_id, uint64_t base_seq,
+						const char *ext) {
+	int n = snprintf(path, PATH_MAX, "%s/%u/%020" PRIu64 ".%s", history_dir,
+					 room_id, base_seq, ext);
+	return n >= 0 && n < PATH_MAX ? PORTAL_OK : PORTAL_FAIL;
+}
+
+// size of the frame at data, 0 unless a whole valid one is there
+static size_t frame_at(const unsigned char *data, size_t avail) {
+	if (avail < PORTAL_HEADER_SIZE) {
+		return 0;
+	}
+	portal_wire_header_t wire;
+	memcpy(&wire, data, PORTAL_HEADER_SIZE);
+	uint32_t length = ntohl(wire.length);
+	if (ntohs(wire.magic) != PORTAL_MAGIC ||
+		length > PORTAL_MAX_PACKET_SIZE ||
+		avail - PORTAL_HEADER_SIZE < length) {
+		return 0;
+	}
+	return PORTAL_HEADER_SIZE + length;
+}
+
+// a missing entry only makes reads scan further, so failing to grow is fine
+static void index_push(history_segment_t *seg, uint32_t record,
+					   uint32_t offset) {
+	if (seg->index_count == seg->index_cap) {
+		uint32_t cap = seg->index_cap ? seg->index_cap * 2 : 64;
+		history_index_entry_t *index =
+			realloc(seg->index, sizeof(history_index_entry_t) * cap);
+		if (index == NULL) {
+			return;
+		}
+		seg->index = index;
+		seg->index_cap = cap;
+	}
+	seg->index[seg->index_count++] =
+		(history_index_entry_t){.record = record, .offset = offset};
+}
+
+// the last entry at or before record, the segment start if there is none
+static history_index_entry_t index_lookup(const history_segment_t *seg,
+										  uint32_t record) {
+	history_index_entry_t found = {0, 0};
+	uint32_t lo = 0, hi = seg->index_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (seg->index[mid].record <= record) {
+			found = seg->index[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return found;
+}
+
+// rebuilds count, size and index from the frames in the file. anything
+// after the last whole frame is a torn write and is left out
+static int scan_segment(int fd, history_segment_t *seg) {
+	seg->count = 0;
+	seg->size = 0;
+	seg->index_count = 0;
+	seg->index_loaded = true;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return PORTAL_FAIL;
+	}
+	if (st.st_size == 0) {
+		return PORTAL_OK;
+	}
+	unsigned char *data =
+		mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		return PORTAL_FAIL;
+	}
+
+	size_t offset = 0, frame;
+	while ((frame = frame_at(data + offset, st.st_size - offset)) > 0) {
+		if (seg->count % HISTORY_INDEX_INTERVAL == 0) {
+			index_push(seg, seg->count, offset);
+		}
+		seg->count++;
+		offset += frame;
+	}
+	munmap(data, st.st_size);
+	seg->size = offset;
+	return PORTAL_OK;
+}
+
+static void write_index(history_room_t *room, history_segment_t *tail) {
+	uint32_t count = tail->index_count - room->index_written;
+	if (count == 0) {
+		return;
+	}
+	ssize_t rc = write(room->index_fd, &tail->index[room->index_written],
+					   sizeof(history_index_entry_t) * count);
+	(void)rc;
+	room->index_written = tail->index_count;
+}
+
+// brings the tail back in line with what really is on disk, used when it
+// is first opened and after a failed write
+static int recover_tail(history_room_t *room) {
+	history_segment_t *tail = &room->segments[room->segment_count - 1];
+	if (scan_segment(room->tail_fd, tail) != PORTAL_OK ||
+		ftruncate(room->tail_fd, tail->size) != 0 ||
+		ftruncate(room->index_fd, 0) != 0) {
+		perror("Failed to recover history segment");
+		return PORTAL_FAIL;
+	}
+	room->index_written = 0;
+	write_index(room, tail);
+	return PORTAL_OK;
+}
+
+static history_map_t *map_file(int fd, size_t size) {
+	history_map_t *map = malloc(sizeof(history_map_t));
+	if (map == NULL) {
+		return NULL;
+	}
+	map->data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map->data == MAP_FAILED) {
+		perror("Failed to map history segment");
+		free(map);
+		return NULL;
+	}
+	atomic_init(&map->refs, 1);
+	map->size = size;
+	return map;
+}
+
+static void map_ref(history_map_t *map) {
+	atomic_fetch_add_explicit(&map->refs, 1, memory_order_relaxed);
+}
+
+void history_map_unref(void *ptr) {
+	history_map_t *map = ptr;
+	if (atomic_fetch_sub_explicit(&map->refs, 1, memory_order_acq_rel) == 1) {
+		munmap(map->data, map->size);
+		free(map);
+	}
+}
+
+static int open_tail(history_room_t *room) {
+	history_segment_t *tail = &room->segments[room->segment_count - 1];
+	char path[PATH_MAX];
+	if (segment_path(path, room->id, tail->base_seq, "log") != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
+	room->tail_fd =
+		open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (segment_path(path, room->id, tail->base_seq, "idx") != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
+	room->index_fd =
+		open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (room->tail_fd < 0 || room->index_fd < 0) {
+		perror("Failed to open history segment");
+		return PORTAL_FAIL;
+	}
+	if (recover_tail(room) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
+	// a tail never grows past the segment size, so mapping that much up
+	// front means it never has to be remapped
+	room->tail_map = map_file(room->tail_fd, HISTORY_SEGMENT_SIZE);
+	return room->tail_map != NULL ? PORTAL_OK : PORTAL_FAIL;
+}
+
+static history_segment_t *push_segment(history_room_t *room,
+									   uint64_t base_seq) {
+	if (room->segment_count == room->segment_cap) {
+		uint32_t cap = room->segment_cap ? room->segment_cap * 2 : 4;
+		history_segment_t *segments =
+			realloc(room->segments, sizeof(history_segment_t) * cap);
+		if (segments == NULL) {
+			return NULL;
+		}
+		room->segments = segments;
+		room->segment_cap = cap;
+	}
+	history_segment_t *seg = &room->segments[room->segment_count++];
+	memset(seg, 0, sizeof(*seg));
+	seg->base_seq = base_seq;
+	return seg;
+}
+
+static int compare_seq(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// finds the segments a room already has on disk, oldest first
+static int list_segments(history_room_t *room) {
+	char path[PATH_MAX];
+	if (room_path(path, room->id) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		perror("Failed to create history directory");
+		return PORTAL_FAIL;
+	}
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		perror("Failed to open history directory");
+		return PORTAL_FAIL;
+	}
+
+	uint64_t *bases = NULL;
+	uint32_t count = 0, cap = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		char *end;
+		uint64_t base = strtoull(entry->d_name, &end, 10);
+		if (end == entry->d_name || strcmp(end, ".log") != 0) {
+			continue;
+		}
+		if (count == cap) {
+			cap = cap ? cap * 2 : 16;
+			uint64_t *grown = realloc(bases, sizeof(uint64_t) * cap);
+			if (grown == NULL) {
+				free(bases);
+				closedir(dir);
+				return PORTAL_FAIL;
+			}
+			bases = grown;
+		}
+		bases[count++] = base;
+	}
+	closedir(dir);
+
+	qsort(bases, count, sizeof(uint64_t), compare_seq);
+	int rc = PORTAL_OK;
+	for (uint32_t i = 0; i < count && rc == PORTAL_OK; ++i) {
+		history_segment_t *seg = push_segment(room, bases[i]);
+		if (seg == NULL) {
+			rc = PORTAL_FAIL;
+		} else if (i + 1 < count) {
+			// sealed, the next segment starts right after its last record
+			struct stat st;
+			seg->count = bases[i + 1] - bases[i];
+			if (segment_path(path, room->id, bases[i], "log") == PORTAL_OK &&
+				stat(path, &st) == 0) {
+				seg->size = st.st_size;
+			}
+		}
+	}
+	free(bases);
+	if (rc == PORTAL_OK && room->segment_count == 0 &&
+		push_segment(room, 0) == NULL) {
+		rc = PORTAL_FAIL;
+	}
+	return rc;
+}
+
+static void free_room(history_room_t *room) {
+	for (uint32_t i = 0; i < room->segment_count; ++i) {
+		free(room->segments[i].index);
+	}
+	free(room->segments);
+	if (room->tail_fd >= 0) {
+		close(room->tail_fd);
+	}
+	if (room->index_fd >= 0) {
+		close(room->index_fd);
+	}
+	if (room->tail_map != NULL) {
+		history_map_unref(room->tail_map);
+	}
+	free(room);
+}
+
+static void grow_buckets() {
+	uint32_t bucket_count = history_bucket_count * 2;
+	history_room_t **buckets = calloc(bucket_count, sizeof(history_room_t *));
+	if (buckets == NULL) {
+		// a longer chain is still correct, just slower
+		return;
+	}
+
+	history_room_t **old = history_buckets;
+	uint32_t old_count = history_bucket_count;
+	history_buckets = buckets;
+	history_bucket_count = bucket_count;
+	for (uint32_t i = 0; i < old_count; ++i) {
+		history_room_t *room = old[i];
+		while (room != NULL) {
+			history_room_t *next = room->next;
+			uint32_t b = bucket_of(room->id);
+			room->next = history_buckets[b];
+			history_buckets[b] = room;
+			room = next;
+		}
+	}
+	free(old);
+}
+
+static void lru_unlink(history_room_t *room) {
+	if (room->lru_prev != NULL) {
+		room->lru_prev->lru_next = room->lru_next;
+	} else {
+		history_lru_head = room->lru_next;
+	}
+	if (room->lru_next != NULL) {
+		room->lru_next->lru_prev = room->lru_prev;
+	} else {
+		history_lru_tail = room->lru_prev;
+	}
+	room->lru_prev = room->lru_next = NULL;
+}
+
+static void lru_push(history_room_t *room) {
+	room->lru_next = history_lru_head;
+	if (history_lru_head != NULL) {
+		history_lru_head->lru_prev = room;
+	} else {
+		history_lru_tail = room;
+	}
+	history_lru_head = room;
+}
+
+static void flush_dirty();
+
+// closes the least recently used room, everything it knew is on disk and
+// list_segments rebuilds it the next time the room is named. sends still
+// reading its tail keep their own reference on the mapping
+static void evict_room() {
+	history_room_t *room = history_lru_tail;
+	if (room->dirty) {
+		flush_dirty();
+	}
+	lru_unlink(room);
+
+	history_room_t **link = &history_buckets[bucket_of(room->id)];
+	while (*link != room) {
+		link = &(*link)->next;
+	}
+	*link = room->next;
+	history_room_count--;
+	free_room(room);
+}
+
+// rooms are opened the first time a message or fetch names them
+static history_room_t *get_room(uint32_t room_id) {
+	history_room_t *room = history_buckets[bucket_of(room_id)];
+	while (room != NULL && room->id != room_id) {
+		room = room->next;
+	}
+	if (room != NULL) {
+		if (room != history_lru_head) {
+			lru_unlink(room);
+			lru_push(room);
+		}
+		return room;
+	}
+
+	// room ids come from clients, so the count open at once is bounded
+	while (history_room_count >= history_max_open) {
+		evict_room();
+	}
+
+	room = calloc(1, sizeof(history_room_t));
+	if (room == NULL) {
+		perror("Failed to allocate history room");
+		return NULL;
+	}
+	room->id = room_id;
+	room->tail_fd = -1;
+	room->index_fd = -1;
+	if (list_segments(room) != PORTAL_OK || open_tail(room) != PORTAL_OK) {
+		free_room(room);
+		return NULL;
+	}
+
+	if (history_room_count >= history_bucket_count) {
+		grow_buckets();
+	}
+	uint32_t b = bucket_of(room_id);
+	room->next = history_buckets[b];
+	history_buckets[b] = room;
+	history_room_count++;
+	lru_push(room);
+	return room;
+}
+
+static int write_frames(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t n = writev(fd, iov, count);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return PORTAL_FAIL;
+		}
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return PORTAL_OK;
+}
+
+// the frames collected since the last flush go out in a single writev
+static void flush_room(history_room_t *room) {
+	if (room->pending_count == 0) {
+		return;
+	}
+	history_segment_t *tail = &room->segments[room->segment_count - 1];
+	// pending frames are always the last ones counted into the tail
+	uint64_t first_seq = tail->base_seq + tail->count - room->pending_count;
+
+	struct iovec iov[HISTORY_WRITE_BATCH];
+	for (uint32_t i = 0; i < room->pending_count; ++i) {
+		iov[i].iov_base = room->pending[i]->frame;
+		iov[i].iov_len = room->pending[i]->size;
+	}
+	if (write_frames(room->tail_fd, iov, room->pending_count) != PORTAL_OK) {
+		perror("Failed to write history");
+		// forget whatever did not make it so sequence numbers stay true
+		recover_tail(room);
+	} else {
+		write_index(room, tail);
+	}
+
+	// only frames that are really on disk may be served from the recent
+	// cache, a lost one's sequence number is handed out again
+	uint64_t end = tail->base_seq + tail->count;
+	for (uint32_t i = 0; i < room->pending_count; ++i) {
+		if (first_seq + i < end) {
+			recent_push(room->id, first_seq + i, room->pending[i]);
+		}
+		msgbuf_unref(room->pending[i]);
+	}
+	room->pending_count = 0;
+}
+
+static void flush_dirty() {
+	while (history_dirty != NULL) {
+		history_room_t *room = history_dirty;
+		history_dirty = room->next_dirty;
+		room->dirty = false;
+		flush_room(room);
+	}
+}
+
+// seals the tail and starts the next segment where it left off
+static int roll_segment(history_room_t *room) {
+	flush_room(room);
+	history_segment_t *tail = &room->segments[room->segment_count - 1];
+	uint64_t base_seq = tail->base_seq + tail->count;
+	if (push_segment(room, base_seq) == NULL) {
+		return PORTAL_FAIL;
+	}
+	close(room->tail_fd);
+	close(room->index_fd);
+	// sends still reading the sealed segment keep its mapping alive
+	history_map_unref(room->tail_map);
+	room->tail_map = NULL;
+	room->index_written = 0;
+	return open_tail(room);
+}
+
+static void append_frame(uint32_t room_id, msgbuf_t *buf) {
+	history_room_t *room = get_room(room_id);
+	if (room == NULL) {
+		msgbuf_unref(buf);
+		return;
+	}
+
+	history_segment_t *tail = &room->segments[room->segment_count - 1];
+	if (tail->size > 0 && tail->size + buf->size > HISTORY_SEGMENT_SIZE) {
+		if (roll_segment(room) != PORTAL_OK) {
+			msgbuf_unref(buf);
+			return;
+		}
+		tail = &room->segments[room->segment_count - 1];
+	}
+	if (room->pending_count == HISTORY_WRITE_BATCH) {
+		flush_room(room);
+	}
+
+	if (tail->count % HISTORY_INDEX_INTERVAL == 0) {
+		index_push(tail, tail->count, tail->size);
+	}
+	tail->count++;
+	tail->size += buf->size;
+	room->pending[room->pending_count++] = buf;
+	if (!room->dirty) {
+		room->dirty = true;
+		room->next_dirty = history_dirty;
+		history_dirty = room;
+	}
+}
+
+// a sealed segment's .idx is read back the first time it is needed, and
+// rebuilt from the frames if it is missing
+static void load_index(history_room_t *room, history_segment_t *seg) {
+	seg->index_loaded = true;
+	char path[PATH_MAX];
+	if (segment_path(path, room->id, seg->base_seq, "idx") != PORTAL_OK) {
+		return;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0 &&
+		st.st_size >= (off_t)sizeof(history_index_entry_t)) {
+		uint32_t count = st.st_size / sizeof(history_index_entry_t);
+		seg->index = malloc(sizeof(history_index_entry_t) * count);
+		if (seg->index != NULL &&
+			pread(fd, seg->index, sizeof(history_index_entry_t) * count, 0) ==
+				(ssize_t)(sizeof(history_index_entry_t) * count)) {
+			seg->index_cap = count;
+			// a crash can leave the end torn, keep the sane prefix
+			while (seg->index_count < count) {
+				history_index_entry_t *e = &seg->index[seg->index_count];
+				if (e->record >= seg->count || e->offset >= seg->size ||
+					(seg->index_count > 0 && e->record <= e[-1].record)) {
+					break;
+				}
+				seg->index_count++;
+			}
+		}
+		close(fd);
+		return;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (segment_path(path, room->id, seg->base_seq, "log") != PORTAL_OK) {
+		return;
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		uint32_t count = seg->count;
+		scan_segment(fd, seg);
+		seg->count = count;
+		close(fd);
+	}
+}
+
+// sealed segments are mapped for the fetches that read them and unmapped
+// once the last send is done, so cold history costs no address space
+static history_map_t *map_segment(history_room_t *room,
+								  history_segment_t *seg) {
+	if (seg->size == 0) {
+		return NULL;
+	}
+	char path[PATH_MAX];
+	if (segment_path(path, room->id, seg->base_seq, "log") != PORTAL_OK) {
+		return NULL;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	history_map_t *map = map_file(fd, seg->size);
+	close(fd);
+	return map;
+}
+
+// adds up to max records starting at record first of the segment to the
+// fetch as a single piece and returns how many it covers
+static uint32_t map_records(history_room_t *room, uint32_t seg_index,
+							uint32_t first, uint32_t max, size_t max_bytes,
+							history_fetch_t *fetch) {
+	if (fetch->piece_count == HISTORY_MAX_PIECES) {
+		return 0;
+	}
+	history_segment_t *seg = &room->segments[seg_index];
+	if (!seg->index_loaded) {
+		load_index(room, seg);
+	}
+
+	history_map_t *map;
+	if (seg_index == room->segment_count - 1) {
+		map = room->tail_map;
+		map_ref(map);
+	} else if ((map = map_segment(room, seg)) == NULL) {
+		return 0;
+	}
+
+	uint32_t end = seg->count - first < max ? seg->count : first + max;
+	history_index_entry_t start = index_lookup(seg, first);
+	uint32_t record = start.record;
+	size_t offset = start.offset, frame;
+	while (record < first &&
+		   (frame = frame_at(map->data + offset, seg->size - offset)) > 0) {
+		offset += frame;
+		record++;
+	}
+
+	size_t begin = offset;
+	uint32_t covered = 0;
+	while (record < end &&
+		   (frame = frame_at(map->data + offset, seg->size - offset)) > 0) {
+		// the first frame always fits so a fetch makes progress
+		if (fetch->size > 0 && fetch->size + frame > max_bytes) {
+			break;
+		}
+		fetch->size += frame;
+		offset += frame;
+		record++;
+		covered++;
+	}
+
+	if (covered == 0) {
+		history_map_unref(map);
+		return 0;
+	}
+	fetch->pieces[fetch->piece_count++] = (history_piece_t){
+		.map = map, .data = map->data + begin, .size = offset - begin};
+	return covered;
+}
+
+static uint32_t find_segment(history_room_t *room, uint64_t seq) {
+	uint32_t lo = 0, hi = room->segment_count;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (room->segments[mid].base_seq <= seq) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void complete_fetch(reactor_t *r, reactor_task_t *task) {
+	history_fetch_t *fetch =
+		(history_fetch_t *)((char *)task - offsetof(history_fetch_t, task));
+	fetch->done(r, fetch);
+}
+
+static void run_fetch(history_fetch_t *fetch) {
+	fetch->result = PORTAL_FAIL;
+	fetch->found = 0;
+	fetch->piece_count = 0;
+	fetch->size = 0;
+	size_t max_bytes =
+		fetch->max_bytes > 0 && fetch->max_bytes < HISTORY_MAX_FETCH_BYTES
+			? fetch->max_bytes
+			: HISTORY_MAX_FETCH_BYTES;
+
+	history_room_t *room = get_room(fetch->room);
+	if (room != NULL) {
+		// the fetch has to see appends queued ahead of it
+		flush_room(room);
+
+		history_segment_t *tail = &room->segments[room->segment_count - 1];
+		uint64_t oldest = room->segments[0].base_seq;
+		uint64_t end = tail->base_seq + tail->count;
+		uint32_t want =
+			fetch->count < HISTORY_MAX_FETCH ? fetch->count : HISTORY_MAX_FETCH;
+
+		uint64_t seq = fetch->first_seq;
+		if (seq == HISTORY_LATEST) {
+			seq = end - oldest > want ? end - want : oldest;
+		} else if (seq < oldest) {
+			seq = oldest;
+		}
+		fetch->found_seq = seq;
+
+		while (fetch->found < want && seq < end) {
+			uint32_t seg_index = find_segment(room, seq);
+			history_segment_t *seg = &room->segments[seg_index];
+			uint32_t first = seq - seg->base_seq;
+			uint32_t asked = want - fetch->found;
+			if (asked > seg->count - first) {
+				asked = seg->count - first;
+			}
+			uint32_t got =
+				map_records(room, seg_index, first, asked, max_bytes, fetch);
+			fetch->found += got;
+			seq += got;
+			if (got < asked) {
+				break;
+			}
+		}
+		fetch->result = PORTAL_OK;
+	}
+
+	fetch->task.run = complete_fetch;
+	reactor_post(fetch->reactor, &fetch->task);
+}
+
+static void *history_main(void *arg) {
+	(void)arg;
+	while (true) {
+		// blocks until a submit signals there is work
+		uint64_t count;
+		ssize_t rc = read(history_event_fd, &count, sizeof(count));
+		(void)rc;
+		// clear the flag before draining so a racing submit re-signals
+		atomic_store(&history_signaled, false);
+
+		mpsc_node_t *node;
+		while ((node = mpsc_pop(&history_queue)) != NULL) {
+			history_op_t *op = (history_op_t *)node;
+			if (op->kind == HISTORY_OP_APPEND) {
+				history_append_t *append = (history_append_t *)op;
+				append_frame(append->room, append->buf);
+				portal_pool_free(append);
+			} else {
+				run_fetch((history_fetch_t *)op);
+			}
+		}
+		// everything that arrived together is written together
+		flush_dirty();
+	}
+	return NULL;
+}
+
+int history_start(const char *dir, uint32_t max_open) {
+	if (strlen(dir) + HISTORY_PATH_SUFFIX_MAX >= sizeof(history_dir)) {
+		printf("Error: history directory %s is too long\n", dir);
+		return PORTAL_FAIL;
+	}
+	snprintf(history_dir, sizeof(history_dir), "%s", dir);
+	if (mkdir(history_dir, 0755) != 0 && errno != EEXIST) {
+		perror("Failed to create history directory");
+		return PORTAL_FAIL;
+	}
+
+	history_buckets = calloc(HISTORY_INIT_BUCKETS, sizeof(history_room_t *));
+	if (history_buckets == NULL) {
+		perror("Failed to allocate history store");
+		return PORTAL_FAIL;
+	}
+	history_bucket_count = HISTORY_INIT_BUCKETS;
+	history_max_open = max_open > 0 ? max_open : 1;
+
+	mpsc_init(&history_queue);
+	atomic_init(&history_signaled, false);
+	history_event_fd = eventfd(0, EFD_CLOEXEC);
+	if (history_event_fd < 0) {
+		perror("Failed to create history eventfd");
+		return PORTAL_FAIL;
+	}
+	pthread_create(&history_thread, NULL, history_main, NULL);
+	return PORTAL_OK;
+}
+
+static void submit(history_op_t *op) {
+	mpsc_push(&history_queue, &op->node);
+
+	// only the first submit after the thread drained pays for the wakeup
+	if (!atomic_exchange(&history_signaled, true)) {
+		uint64_t one = 1;
+		ssize_t rc = write(history_event_fd, &one, sizeof(one));
+		(void)rc;
+	}
+}
+
+void history_append(uint32_t room, msgbuf_t *buf) {
+	history_append_t *append = portal_pool_alloc(sizeof(history_append_t));
+	if (append == NULL) {
+		return;
+	}
+	append->op.kind = HISTORY_OP_APPEND;
+	append->room = room;
+	append->buf = buf;
+	msgbuf_ref(buf);
+	submit(&append->op);
+}
+
+void history_fetch(reactor_t *r, history_fetch_t *fetch,
+				   history_done_fn done) {
+	fetch->op.kind = HISTORY_OP_FETCH;
+	fetch->reactor = r;
+	fetch->done = done;
+	submit(&fetch->op);
+}
+
+void history_fetch_release(history_fetch_t *fetch) {
+	for (uint32_t i = 0; i < fetch->piece_count; ++i) {
+		history_map_unref(fetch->pieces[i].map);
+	}
+	fetch->piece_count = 0;
+}
@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "mpsc.h"
+#include "msgbuf.h"
+#include "reactor.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define HISTORY_DEFAULT_DIR "history"
+// rooms with their tail segment open at once, each costs two fds and a
+// HISTORY_SEGMENT_SIZE mapping
+#define HISTORY_DEFAULT_OPEN_ROOMS 256
+// a room's tail segment is sealed and a new one started past this size
+#define HISTORY_SEGMENT_SIZE (8 * 1024 * 1024)
+// the sparse index remembers the offset of every this many records
+#define HISTORY_INDEX_INTERVAL 64
+// a single fetch never returns more than this
+#define HISTORY_MAX_FETCH 1000
+#define HISTORY_MAX_FETCH_BYTES (1024 * 1024)
+// a range can run over the end of one segment into the next
+#define HISTORY_MAX_PIECES 4
+// first_seq asking for the newest messages of the room
+#define HISTORY_LATEST UINT64_MAX
+
+// every room is a directory of append only segment files named after the
+// sequence number of their first record. a record is the message frame
+// exactly as it was broadcast, so frames read back can go straight onto a
+// socket. a .idx file next to each segment holds its sparse index
+
+typedef enum {
+	HISTORY_OP_APPEND,
+	HISTORY_OP_FETCH,
+} history_op_kind_t;
+
+// common head of everything queued to the history thread
+typedef struct {
+	mpsc_node_t node;
+	history_op_kind_t kind;
+} history_op_t;
+
+// a read only mapping of a segment file, shared by every send that is
+// still reading from it and unmapped once the last one lets go
+typedef struct {
+	atomic_uint refs;
+	unsigned char *data;
+	size_t size;
+} history_map_t;
+
+// frames lying back to back inside a mapping
+typedef struct {
+	history_map_t *map;
+	const unsigned char *data;
+	size_t size;
+} history_piece_t;
+
+typedef struct history_fetch history_fetch_t;
+
+// runs on the reactor that submitted the fetch, which owns it again
+typedef void (*history_done_fn)(reactor_t *r, history_fetch_t *fetch);
+
+// embed it at the start of the request so a fetch is a single allocation
+struct history_fetch {
+	history_op_t op;
+	reactor_task_t task;
+	reactor_t *reactor;
+	history_done_fn done;
+	uint32_t room;
+	// HISTORY_LATEST asks for the last count messages
+	uint64_t first_seq;
+	uint32_t count;
+	// 0 for HISTORY_MAX_FETCH_BYTES
+	size_t max_bytes;
+
+	// filled in on the history thread. the pieces hold found frames
+	// starting at found_seq, read straight out of the segment mappings.
+	// each piece owns a reference on its map
+	int result;
+	uint64_t found_seq;
+	uint32_t found;
+	history_piece_t pieces[HISTORY_MAX_PIECES];
+	uint32_t piece_count;
+	size_t size;
+};
+
+// starts the history thread writing under dir, which is created if needed.
+// at most max_open rooms are kept open, the least recently used is closed
+// to make room for another
+int history_start(const char *dir, uint32_t max_open);
+
+// thread safe and never blocks. takes its own reference on buf, the frame
+// gets the room's next sequence number on the history thread
+void history_append(uint32_t room, msgbuf_t *buf);
+
+// thread safe and never blocks, the fetch must stay alive until done runs.
+// sees every append made before it from the same thread
+void history_fetch(reactor_t *r, history_fetch_t *fetch, history_done_fn done);
+
+// takes void so a piece can be handed straight to the output queue as the
+// release of the bytes it covers
+void history_map_unref(void *map);
+// drops the pieces of a fetch that were not sent
+void history_fetch_release(history_fetch_t *fetch);
+
+#endif // HISTORY_H
@@ -0,0 +1,300 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#define _GNU_SOURCE
+#include "login.h"
+#include "auth_pool.h"
+#include "crypto.h"
+#include "msgbuf.h"
+#include "session.h"
+#include "users_db.h"
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a register or login on its way through the database and auth pools
+typedef struct {
+	user_job_t db;
+	auth_job_t auth;
+	uint16_t opcode;
+	// the client may be gone, or replaced by another, once it is done
+	uint32_t conn_id, conn_generation;
+	// a login whose hash was redone with the current profile
+	bool rehashed;
+	char password[LOGIN_PASSWORD_MAX];
+} login_request_t;
+
+static login_request_t *request_of(auth_job_t *job) {
+	return (login_request_t *)((char *)job - offsetof(login_request_t, auth));
+}
+
+static void send_reply(reactor_t *r, connection_t *conn, uint16_t opcode,
+					   portal_auth_status_t status, uint32_t user_id,
+					   const portal_session_token_t *token) {
+	msgbuf_t *reply = msgbuf_create(opcode, 0, sizeof(portal_auth_reply_t));
+	if (reply == NULL) {
+		return;
+	}
+	portal_auth_reply_t body = {.status = status, .user_id = htonl(user_id)};
+	if (token != NULL) {
+		body.token = *token;
+	}
+	memcpy(msgbuf_payload(reply), &body, sizeof(body));
+	reactor_send_raw(r, conn, reply->frame, reply->size, msgbuf_unref, reply);
+}
+
+static void refuse(reactor_t *r, connection_t *conn, uint16_t opcode,
+				   portal_auth_status_t status) {
+	send_reply(r, conn, opcode, status, 0, NULL);
+}
+
+// marks the connection as the user and hands it a token, so the next time
+// it connects it can resume without the password
+static void accept_user(reactor_t *r, connection_t *conn, uint16_t opcode,
+						uint32_t user_id,
+						const portal_session_token_t *token) {
+	portal_session_token_t fresh;
+	if (token == NULL) {
+		if (session_issue(user_id, &fresh) != PORTAL_OK) {
+			refuse(r, conn, opcode, PORTAL_AUTH_ERROR);
+			return;
+		}
+		token = &fresh;
+	}
+	conn->user_id = user_id;
+	send_reply(r, conn, opcode, PORTAL_AUTH_OK, user_id, token);
+}
+
+// answers the client if it is still around and lets go of the request
+static void finish(reactor_t *r, login_request_t *req,
+				   portal_auth_status_t status) {
+	connection_t *conn =
+		reactor_find_connection(r, req->conn_id, req->conn_generation);
+	if (conn != NULL) {
+		if (status == PORTAL_AUTH_OK) {
+			accept_user(r, conn, req->opcode, req->db.user.id, NULL);
+		} else {
+			refuse(r, conn, req->opcode, status);
+		}
+	}
+	explicit_bzero(req->password, sizeof(req->password));
+	free(req);
+}
+
+// the next NUL terminated field of at most max bytes, NULL if there is none
+static const char *next_field(const char **cursor, const char *end,
+							  size_t max) {
+	const char *field = *cursor;
+	size_t left = end - field;
+	if (left == 0) {
+		return NULL;
+	}
+	const char *nul = memchr(field, 0, left < max ? left : max);
+	if (nul == NULL || nul == field) {
+		return NULL;
+	}
+	*cursor = nul + 1;
+	return field;
+}
+
+// cheap checks that turn a request away before it costs anything
+static login_request_t *admit(reactor_t *r, connection_t *conn,
+							  uint16_t opcode) {
+	if (!auth_rate_allow(conn->addr.sin_addr.s_addr)) {
+		refuse(r, conn, opcode, PORTAL_AUTH_LIMITED);
+		return NULL;
+	}
+	if (auth_pool_saturated()) {
+		refuse(r, conn, opcode, PORTAL_AUTH_BUSY);
+		return NULL;
+	}
+	login_request_t *req = calloc(1, sizeof(login_request_t));
+	if (req == NULL) {
+		refuse(r, conn, opcode, PORTAL_AUTH_ERROR);
+		return NULL;
+	}
+	req->opcode = opcode;
+	req->conn_id = conn->id;
+	req->conn_generation = conn->generation;
+	return req;
+}
+
+static void submit_auth(reactor_t *r, login_request_t *req, auth_exec_fn exec,
+						auth_done_fn done) {
+	if (auth_pool_submit(r, &req->auth, exec, done) != PORTAL_OK) {
+		finish(r, req, PORTAL_AUTH_BUSY);
+	}
+}
+
+static void user_created(reactor_t *r, db_job_t *job) {
+	login_request_t *req = (login_request_t *)job;
+	if (job->result == SQLITE_OK) {
+		finish(r, req, PORTAL_AUTH_OK);
+	} else {
+		// most likely the username or email is taken
+		finish(r, req,
+			   job->result == SQLITE_CONSTRAINT ? PORTAL_AUTH_DENIED
+												: PORTAL_AUTH_ERROR);
+	}
+}
+
+static int hash_password(auth_job_t *job) {
+	login_request_t *req = request_of(job);
+	return crypto_generate_hash_with_salt(&req->db.user, req->password);
+}
+
+static void password_hashed(reactor_t *r, auth_job_t *job) {
+	login_request_t *req = request_of(job);
+	if (job->result != PORTAL_OK) {
+		finish(r, req, PORTAL_AUTH_ERROR);
+		return;
+	}
+	users_db_submit(r, &req->db, USER_OP_CREATE, user_created);
+}
+
+void login_handle_register(reactor_t *r, connection_t *conn,
+						   packet_t *packet) {
+	const char *cursor = packet->data;
+	const char *end = cursor + packet->data_size;
+	const char *email = next_field(&cursor, end, USER_EMAIL_MAX);
+	const char *username =
+		email != NULL ? next_field(&cursor, end, USER_NAME_MAX) : NULL;
+	const char *password =
+		username != NULL ? next_field(&cursor, end, LOGIN_PASSWORD_MAX)
+						 : NULL;
+	if (password == NULL) {
+		refuse(r, conn, PORTAL_OP_REGISTER, PORTAL_AUTH_INVALID);
+		return;
+	}
+
+	login_request_t *req = admit(r, conn, PORTAL_OP_REGISTER);
+	if (req == NULL) {
+		return;
+	}
+	strcpy((char *)req->db.user.email, email);
+	strcpy((char *)req->db.user.username, username);
+	strcpy(req->password, password);
+	submit_auth(r, req, hash_password, password_hashed);
+}
+
+static int verify_password(auth_job_t *job) {
+	login_request_t *req = request_of(job);
+	if (crypto_verify_password(&req->db.user, req->password) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
+	// the plain password is only ever in hand here, so this is when a hash
+	// made with an older profile gets moved to the current one
+	if (crypto_needs_rehash(&req->db.user) &&
+		crypto_generate_hash_with_salt(&req->db.user, req->password) ==
+			PORTAL_OK) {
+		req->rehashed = true;
+	}
+	return PORTAL_OK;
+}
+
+static void rehash_saved(reactor_t *r, db_job_t *job) {
+	// the old hash still works, so the login goes through either way
+	if (job->result != SQLITE_OK) {
+		printf("Error: failed to store rehashed password\n");
+	}
+	finish(r, (login_request_t *)job, PORTAL_AUTH_OK);
+}
+
+static void password_checked(reactor_t *r, auth_job_t *job) {
+	login_request_t *req = request_of(job);
+	if (job->result != PORTAL_OK) {
+		finish(r, req, PORTAL_AUTH_DENIED);
+		return;
+	}
+	if (req->rehashed) {
+		users_db_submit(r, &req->db, USER_OP_UPDATE, rehash_saved);
+		return;
+	}
+	finish(r, req, PORTAL_AUTH_OK);
+}
+
+// an unknown username still pays for a hash, otherwise the reply time
+// tells which usernames exist
+static int verify_unknown(auth_job_t *job) {
+	return crypto_verify_dummy(request_of(job)->password);
+}
+
+static void user_found(reactor_t *r, db_job_t *job) {
+	login_request_t *req = (login_request_t *)job;
+	if (job->result == SQLITE_NOTFOUND) {
+		submit_auth(r, req, verify_unknown, password_checked);
+		return;
+	}
+	if (job->result != SQLITE_OK) {
+		finish(r, req, PORTAL_AUTH_ERROR);
+		return;
+	}
+	submit_auth(r, req, verify_password, password_checked);
+}
+
+void login_handle_login(reactor_t *r, connection_t *conn, packet_t *packet) {
+	const char *cursor = packet->data;
+	const char *end = cursor + packet->data_size;
+	const char *username = next_field(&cursor, end, USER_NAME_MAX);
+	const char *password =
+		username != NULL ? next_field(&cursor, end, LOGIN_PASSWORD_MAX)
+						 : NULL;
+	if (password == NULL) {
+		refuse(r, conn, PORTAL_OP_LOGIN, PORTAL_AUTH_INVALID);
+		return;
+	}
+
+	login_request_t *req = admit(r, conn, PORTAL_OP_LOGIN);
+	if (req == NULL) {
+		return;
+	}
+	strcpy((char *)req->db.user.username, username);
+	strcpy(req->password, password);
+	users_db_submit(r, &req->db, USER_OP_FIND, user_found);
+}
+
+// a reconnect with a token costs one hmac on the reactor instead of a trip
+// through the auth pool, so a reconnect storm never queues behind hashing
+void login_handle_resume(reactor_t *r, connection_t *conn, packet_t *packet) {
+	portal_session_token_t token;
+	if (packet->data_size != sizeof(token)) {
+		refuse(r, conn, PORTAL_OP_RESUME, PORTAL_AUTH_INVALID);
+		return;
+	}
+	memcpy(&token, packet->data, sizeof(token));
+
+	uint32_t user_id;
+	if (session_verify(&token, &user_id) != PORTAL_OK) {
+		refuse(r, conn, PORTAL_OP_RESUME, PORTAL_AUTH_DENIED);
+		return;
+	}
+	accept_user(r, conn, PORTAL_OP_RESUME, user_id, &token);
+}
+
+void login_handle_logout(reactor_t *r, connection_t *conn, packet_t *packet) {
+	(void)r;
+	portal_session_token_t token;
+	if (packet->data_size != sizeof(token)) {
+		return;
+	}
+	memcpy(&token, packet->data, sizeof(token));
+	session_revoke(&token);
+	conn->user_id = 0;
+}
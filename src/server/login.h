@@ -0,0 +1,36 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef LOGIN_H
+#define LOGIN_H
+
+#include "reactor.h"
+
+#define LOGIN_PASSWORD_MAX 256
+
+// packet handlers for PORTAL_OP_REGISTER and PORTAL_OP_LOGIN. the password
+// work runs on the auth pool and the user rows on the database pool, the
+// reactor only ever parses the request and sends the reply
+void login_handle_register(reactor_t *r, connection_t *conn,
+						   packet_t *packet);
+void login_handle_login(reactor_t *r, connection_t *conn, packet_t *packet);
+// PORTAL_OP_RESUME and PORTAL_OP_LOGOUT only check the token's signature,
+// so both are answered on the reactor
+void login_handle_resume(reactor_t *r, connection_t *conn, packet_t *packet);
+void login_handle_logout(reactor_t *r, connection_t *conn, packet_t *packet);
+
+#endif // LOGIN_H
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "mpsc.h"
+#include <sched.h>
+#include <stddef.h>
+
+void mpsc_init(mpsc_queue_t *q) {
+	atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+	q->tail = &q->stub;
+}
+
+void mpsc_push(mpsc_queue_t *q, mpsc_node_t *node) {
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	mpsc_node_t *prev =
+		atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+	// between the exchange and this store the queue looks cut short,
+	// mpsc_pop waits that window out instead of reporting empty
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+mpsc_node_t *mpsc_pop(mpsc_queue_t *q) {
+	while (true) {
+		mpsc_node_t *tail = q->tail;
+		mpsc_node_t *next =
+			atomic_load_explicit(&tail->next, memory_order_acquire);
+
+		if (tail == &q->stub) {
+			if (next == NULL) {
+				if (atomic_load_explicit(&q->head, memory_order_acquire) ==
+					tail) {
+					return NULL;
+				}
+				sched_yield();
+				continue;
+			}
+			q->tail = next;
+			tail = next;
+			next = atomic_load_explicit(&tail->next, memory_order_acquire);
+		}
+
+		if (next != NULL) {
+			q->tail = next;
+			return tail;
+		}
+
+		if (atomic_load_explicit(&q->head, memory_order_acquire) != tail) {
+			// a producer is mid push behind this node
+			sched_yield();
+			continue;
+		}
+
+		// tail is the last real node, park the stub behind it to detach it
+		mpsc_push(q, &q->stub);
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+		if (next != NULL) {
+			q->tail = next;
+			return tail;
+		}
+		sched_yield();
+	}
+}
+
+bool mpsc_empty(mpsc_queue_t *q) {
+	return q->tail == &q->stub &&
+		   atomic_load_explicit(&q->stub.next, memory_order_acquire) == NULL &&
+		   atomic_load_explicit(&q->head, memory_order_acquire) == &q->stub;
+}
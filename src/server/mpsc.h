@@ -0,0 +1,43 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// intrusive node, embed it in whatever is being queued
+typedef struct mpsc_node {
+	_Atomic(struct mpsc_node *) next;
+} mpsc_node_t;
+
+// lock-free queue with any number of producers and a single consumer,
+// pushes are one atomic exchange and never block or allocate
+typedef struct {
+	_Atomic(mpsc_node_t *) head;
+	mpsc_node_t *tail;
+	mpsc_node_t stub;
+} mpsc_queue_t;
+
+void mpsc_init(mpsc_queue_t *q);
+void mpsc_push(mpsc_queue_t *q, mpsc_node_t *node);
+// consumer side only, NULL once the queue is empty
+mpsc_node_t *mpsc_pop(mpsc_queue_t *q);
+bool mpsc_empty(mpsc_queue_t *q);
+
+#endif // MPSC_H
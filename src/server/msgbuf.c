@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "msgbuf.h"
+#include "bufpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+msgbuf_t *msgbuf_create(uint16_t opcode, uint16_t id, size_t payload_size) {
+	size_t size = PORTAL_HEADER_SIZE + payload_size;
+	msgbuf_t *buf = portal_pool_alloc(sizeof(msgbuf_t) + size);
+	if (buf == NULL) {
+		perror("Failed to allocate message buffer");
+		return NULL;
+	}
+
+	atomic_init(&buf->refs, 1);
+	buf->size = size;
+
+	packet_t packet = {0};
+	packet.header.opcode = opcode;
+	packet.header.id = id;
+	packet.data_size = payload_size;
+	portal_wire_header_t wire;
+	portal_encode_header(&packet, &wire);
+	memcpy(buf->frame, &wire, PORTAL_HEADER_SIZE);
+
+	return buf;
+}
+
+void msgbuf_ref(msgbuf_t *buf) {
+	atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+}
+
+void msgbuf_unref(void *ptr) {
+	msgbuf_t *buf = ptr;
+	if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+		// the last reference may go on another reactor, the pool sends the
+		// block back to the thread that built it
+		portal_pool_free(buf);
+	}
+}
@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include "socket_util.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+// a fully encoded frame shared by every connection it is sent to, it is
+// immutable once built and freed when the last reference is dropped
+typedef struct {
+	atomic_uint refs;
+	uint32_t size;
+	unsigned char frame[];
+} msgbuf_t;
+
+// allocates a frame with the header already encoded and one reference held,
+// the caller fills in the payload before sharing it
+msgbuf_t *msgbuf_create(uint16_t opcode, uint16_t id, size_t payload_size);
+
+static inline unsigned char *msgbuf_payload(msgbuf_t *buf) {
+	return buf->frame + PORTAL_HEADER_SIZE;
+}
+
+void msgbuf_ref(msgbuf_t *buf);
+// takes void so it can be handed straight to the output queue as a release
+void msgbuf_unref(void *buf);
+
+#endif // MSGBUF_H
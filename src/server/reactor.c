@@ -0,0 +1,654 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "bufpool.h"
+#include "reactor_uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NO_SLOT UINT32_MAX
+// epoll user data for the listening socket, never a valid connection id
+#define LISTEN_TOKEN ((uint64_t)NO_SLOT + 1)
+#define INBOX_TOKEN (LISTEN_TOKEN + 1)
+
+static int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return PORTAL_FAIL;
+	}
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		return PORTAL_FAIL;
+	}
+	return PORTAL_OK;
+}
+
+// adds another chunk of slots to the slab and threads them onto the free list
+static int grow_slab(reactor_t *r) {
+	connection_t **chunks =
+		realloc(r->chunks, sizeof(connection_t *) * (r->chunk_count + 1));
+	if (chunks == NULL) {
+		return PORTAL_FAIL;
+	}
+	r->chunks = chunks;
+
+	connection_t *chunk = calloc(REACTOR_CHUNK_SIZE, sizeof(connection_t));
+	if (chunk == NULL) {
+		return PORTAL_FAIL;
+	}
+	r->chunks[r->chunk_count++] = chunk;
+
+	uint32_t base = r->capacity;
+	for (uint32_t i = 0; i < REACTOR_CHUNK_SIZE; ++i) {
+		chunk[i].fd = -1;
+		chunk[i].id = base + i;
+		chunk[i].next_free =
+			(i + 1 < REACTOR_CHUNK_SIZE) ? base + i + 1 : r->free_head;
+	}
+	r->free_head = base;
+	r->capacity += REACTOR_CHUNK_SIZE;
+	return PORTAL_OK;
+}
+
+static connection_t *alloc_connection(reactor_t *r) {
+	if (r->free_head == NO_SLOT && grow_slab(r) != PORTAL_OK) {
+		return NULL;
+	}
+
+	connection_t *conn = reactor_get_connection(r, r->free_head);
+	r->free_head = conn->next_free;
+	conn->next_free = NO_SLOT;
+	r->conn_count++;
+	return conn;
+}
+
+static void free_connection(reactor_t *r, connection_t *conn) {
+	uint32_t id = conn->id;
+	uint32_t generation = conn->generation;
+	memset(conn, 0, sizeof(*conn));
+	conn->fd = -1;
+	conn->id = id;
+	// whoever gets the slot next is a different client
+	conn->generation = generation + 1;
+	conn->next_free = r->free_head;
+	r->free_head = id;
+	r->conn_count--;
+}
+
+connection_t *reactor_get_connection(reactor_t *r, uint32_t id) {
+	if (id >= r->capacity) {
+		return NULL;
+	}
+	connection_t *chunk = r->chunks[id >> REACTOR_CHUNK_SHIFT];
+	return &chunk[id & (REACTOR_CHUNK_SIZE - 1)];
+}
+
+connection_t *reactor_find_connection(reactor_t *r, uint32_t id,
+									  uint32_t generation) {
+	connection_t *conn = reactor_get_connection(r, id);
+	if (conn == NULL || !conn->open || conn->closing ||
+		conn->generation != generation) {
+		return NULL;
+	}
+	return conn;
+}
+
+static uint64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void count(atomic_uint_fast64_t *counter, uint64_t n) {
+	uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+	atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+// adds the connection to the list written out at the end of the tick,
+// false if the list could not grow
+static bool queue_dirty(reactor_t *r, connection_t *conn) {
+	if (conn->dirty) {
+		return true;
+	}
+
+	if (r->dirty_count == r->dirty_cap) {
+		uint32_t cap = r->dirty_cap ? r->dirty_cap * 2 : 64;
+		uint32_t *dirty = realloc(r->dirty, sizeof(uint32_t) * cap);
+		if (dirty == NULL) {
+			return false;
+		}
+		r->dirty = dirty;
+		r->dirty_cap = cap;
+	}
+
+	if (r->dirty_count == 0) {
+		r->flush_deadline_ms = now_ms() + r->flush_delay_ms;
+	}
+	r->dirty[r->dirty_count++] = conn->id;
+	conn->dirty = true;
+	return true;
+}
+
+// the connection is closed at the end of the tick rather than here, which
+// keeps callers that are iterating over connections safe
+static void fail_connection(reactor_t *r, connection_t *conn) {
+	conn->closing = true;
+	shutdown(conn->fd, SHUT_RDWR);
+	if (!queue_dirty(r, conn)) {
+		r->close_sweep = true;
+	}
+}
+
+// closes the failed connections that could not be put on the dirty list,
+// only ever needed after an allocation failure
+static void sweep_closing(reactor_t *r) {
+	r->close_sweep = false;
+	for (uint32_t id = 0; id < r->capacity; ++id) {
+		connection_t *conn = reactor_get_connection(r, id);
+		if (conn->open && conn->closing && !conn->dirty) {
+			reactor_close_connection(r, conn);
+		}
+	}
+}
+
+void reactor_close_connection(reactor_t *r, connection_t *conn) {
+	if (!conn->open) {
+		return;
+	}
+
+#ifdef PORTAL_IO_URING
+	// the ring still holds the socket and the payloads being sent, the
+	// last completion finishes the close
+	if (r->uring != NULL && (conn->recv_armed || conn->send != NULL)) {
+		if (!conn->closing) {
+			fail_connection(r, conn);
+		}
+		return;
+	}
+#endif
+
+	if (r->on_close != NULL) {
+		r->on_close(r, conn);
+	}
+
+	// closing the fd also drops it from the epoll interest list
+	close(conn->fd);
+	portal_decoder_free(&conn->decoder);
+	portal_outq_clear(&conn->outq);
+	free_connection(r, conn);
+}
+
+int reactor_init(reactor_t *r, uint32_t index, int listen_fd,
+				 packet_handler_t on_packet) {
+	memset(r, 0, sizeof(*r));
+	r->index = index;
+	r->listen_fd = listen_fd;
+	r->free_head = NO_SLOT;
+	r->on_packet = on_packet;
+	r->flush_delay_ms = REACTOR_DEFAULT_FLUSH_DELAY_MS;
+	r->flush_bytes = REACTOR_DEFAULT_FLUSH_BYTES;
+	r->out_high_bytes = REACTOR_DEFAULT_OUT_HIGH_BYTES;
+	r->out_low_bytes = REACTOR_DEFAULT_OUT_LOW_BYTES;
+	r->out_max_bytes = REACTOR_DEFAULT_OUT_MAX_BYTES;
+	r->slow_policy = REACTOR_SLOW_EVICT;
+
+	if (set_nonblocking(listen_fd) != PORTAL_OK) {
+		perror("Failed to make listening socket non-blocking");
+		return PORTAL_FAIL;
+	}
+
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epoll_fd < 0) {
+		perror("Failed to create epoll instance");
+		return PORTAL_FAIL;
+	}
+
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLET,
+							 .data.u64 = LISTEN_TOKEN};
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+		perror("Failed to register listening socket");
+		close(r->epoll_fd);
+		return PORTAL_FAIL;
+	}
+
+	mpsc_init(&r->inbox);
+	atomic_init(&r->inbox_signaled, false);
+	r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->event_fd < 0) {
+		perror("Failed to create reactor eventfd");
+		close(r->epoll_fd);
+		return PORTAL_FAIL;
+	}
+
+	ev = (struct epoll_event){.events = EPOLLIN | EPOLLET,
+							  .data.u64 = INBOX_TOKEN};
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->event_fd, &ev) < 0) {
+		perror("Failed to register reactor eventfd");
+		close(r->event_fd);
+		close(r->epoll_fd);
+		return PORTAL_FAIL;
+	}
+
+	return PORTAL_OK;
+}
+
+// edge triggered EPOLLOUT only fires when the socket becomes writable
+// again, so it can stay registered for the whole lifetime
+static int watch_connection(reactor_t *r, connection_t *conn, int op) {
+#ifdef PORTAL_IO_URING
+	if (r->uring != NULL) {
+		reactor_uring_watch(r, conn);
+		return 0;
+	}
+#endif
+
+	struct epoll_event ev = {.events = EPOLLOUT | EPOLLRDHUP | EPOLLET,
+							 .data.u64 = conn->id};
+	if (!conn->read_paused) {
+		ev.events |= EPOLLIN;
+	}
+	return epoll_ctl(r->epoll_fd, op, conn->fd, &ev);
+}
+
+connection_t *reactor_open_connection(reactor_t *r, int fd,
+									  const struct sockaddr_in *addr) {
+	connection_t *conn = alloc_connection(r);
+	if (conn == NULL) {
+		printf("Error: out of connection slots\n");
+		close(fd);
+		return NULL;
+	}
+	conn->fd = fd;
+	conn->addr = *addr;
+	conn->open = true;
+
+	// output is already coalesced per tick so nagle would only add delay
+	// to the last segment
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	if (watch_connection(r, conn, EPOLL_CTL_ADD) < 0) {
+		perror("Failed to register connection");
+		reactor_close_connection(r, conn);
+		return NULL;
+	}
+	return conn;
+}
+
+// edge triggered so keep accepting until the backlog is empty
+static void accept_connections(reactor_t *r) {
+	while (true) {
+		struct sockaddr_in client_address;
+		socklen_t client_address_size = sizeof(client_address);
+		int fd = accept4(r->listen_fd, (struct sockaddr *)&client_address,
+						 &client_address_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("Failed to accept connection");
+			}
+			return;
+		}
+		reactor_open_connection(r, fd, &client_address);
+	}
+}
+
+int reactor_dispatch_packets(reactor_t *r, connection_t *conn) {
+	packet_t packet;
+	int rc = PORTAL_OK;
+	while (rc == PORTAL_OK && conn->open && !conn->closing) {
+		rc = portal_decoder_next(&conn->decoder, &packet);
+		if (rc == PORTAL_OK) {
+			r->on_packet(r, conn, &packet);
+			portal_pool_free(packet.data);
+		}
+	}
+	return rc == PORTAL_FAIL ? PORTAL_FAIL : PORTAL_OK;
+}
+
+// drains the socket, handing every complete packet from each read to the
+// handler before reading again
+static void read_connection(reactor_t *r, connection_t *conn) {
+	while (conn->open && !conn->read_paused) {
+		int rc = portal_decoder_fill(&conn->decoder, conn->fd);
+		if (rc == PORTAL_AGAIN) {
+			// idle connections should not pin a receive buffer
+			portal_decoder_trim(&conn->decoder);
+			return;
+		}
+		if (rc == PORTAL_OK) {
+			rc = reactor_dispatch_packets(r, conn);
+		}
+		if (rc == PORTAL_FAIL) {
+			reactor_close_connection(r, conn);
+			return;
+		}
+	}
+}
+
+static void release_payload(portal_release_fn release, void *release_ctx) {
+	if (release != NULL) {
+		release(release_ctx);
+	}
+}
+
+static int send_queued(reactor_t *r, connection_t *conn) {
+#ifdef PORTAL_IO_URING
+	if (r->uring != NULL) {
+		// completes later, the connection counts as blocked until then
+		return reactor_uring_send(r, conn);
+	}
+#endif
+	return portal_outq_flush(&conn->outq, conn->fd);
+}
+
+// writes everything queued for the connection in as few syscalls as the
+// socket allows, a full socket waits for EPOLLOUT
+void reactor_flush_connection(reactor_t *r, connection_t *conn) {
+	conn->dirty = false;
+	if (conn->closing) {
+		return;
+	}
+	if (conn->outq.count > 0 && !conn->blocked) {
+		count(&r->counters.flushes, 1);
+		int rc = send_queued(r, conn);
+		if (rc == PORTAL_FAIL) {
+			fail_connection(r, conn);
+			return;
+		}
+		conn->blocked = rc == PORTAL_AGAIN;
+	}
+
+	if (conn->read_paused && conn->outq.bytes <= r->out_low_bytes) {
+		// re-arming reports EPOLLIN again if the client kept sending
+		conn->read_paused = false;
+		watch_connection(r, conn, EPOLL_CTL_MOD);
+	}
+}
+
+// the socket is full and has been for a while
+static bool output_stalled(reactor_t *r, connection_t *conn) {
+#ifdef PORTAL_IO_URING
+	if (r->uring != NULL) {
+		return reactor_uring_stalled(r, conn);
+	}
+#endif
+	return conn->blocked;
+}
+
+// keeps one client that stopped reading from growing without bound,
+// returns false if the connection was evicted
+static bool enforce_output_limits(reactor_t *r, connection_t *conn) {
+	if (!conn->read_paused && conn->outq.bytes > r->out_high_bytes) {
+		// stop taking requests from a client that is not reading replies
+		conn->read_paused = true;
+		count(&r->counters.read_pauses, 1);
+		watch_connection(r, conn, EPOLL_CTL_MOD);
+	}
+
+	// a queue the socket is still taking drains with this tick's flush,
+	// only a client that stopped reading is slow
+	if (conn->outq.bytes <= r->out_max_bytes || !output_stalled(r, conn)) {
+		return true;
+	}
+
+	if (r->slow_policy == REACTOR_SLOW_DROP_OLDEST) {
+		count(&r->counters.frames_dropped,
+			  portal_outq_drop_oldest(&conn->outq, r->out_high_bytes));
+		return true;
+	}
+
+	count(&r->counters.evictions, 1);
+	fail_connection(r, conn);
+	return false;
+}
+
+static void flush_dirty(reactor_t *r) {
+	for (uint32_t i = 0; i < r->dirty_count; ++i) {
+		connection_t *conn = reactor_get_connection(r, r->dirty[i]);
+		if (!conn->open || !conn->dirty) {
+			continue;
+		}
+		if (conn->closing) {
+			conn->dirty = false;
+			reactor_close_connection(r, conn);
+		} else {
+			reactor_flush_connection(r, conn);
+		}
+	}
+	r->dirty_count = 0;
+}
+
+// how long epoll may sleep before pending output is due
+static int flush_timeout(reactor_t *r) {
+	if (r->dirty_count == 0) {
+		return -1;
+	}
+	uint64_t now = now_ms();
+	return r->flush_deadline_ms > now ? (int)(r->flush_deadline_ms - now) : 0;
+}
+
+// remembers the connection so its queue is written out with the rest of
+// this tick's output instead of one syscall per frame
+static void mark_dirty(reactor_t *r, connection_t *conn) {
+	if (!conn->blocked && conn->outq.bytes >= r->flush_bytes) {
+		// enough queued to fill a few segments, no point waiting
+		reactor_flush_connection(r, conn);
+		return;
+	}
+	if (!conn->blocked && !queue_dirty(r, conn)) {
+		reactor_flush_connection(r, conn);
+	}
+}
+
+int reactor_send_packet(reactor_t *r, connection_t *conn,
+						const packet_t *packet, portal_release_fn release,
+						void *release_ctx) {
+	if (!conn->open || conn->closing) {
+		release_payload(release, release_ctx);
+		return PORTAL_FAIL;
+	}
+
+	if (portal_outq_push(&conn->outq, packet, 0, release, release_ctx) !=
+		PORTAL_OK) {
+		release_payload(release, release_ctx);
+		fail_connection(r, conn);
+		return PORTAL_FAIL;
+	}
+	count(&r->counters.frames_queued, 1);
+	mark_dirty(r, conn);
+	if (!enforce_output_limits(r, conn)) {
+		return PORTAL_FAIL;
+	}
+	return PORTAL_OK;
+}
+
+int reactor_send_raw(reactor_t *r, connection_t *conn, const void *frame,
+					 size_t size, portal_release_fn release,
+					 void *release_ctx) {
+	if (!conn->open || conn->closing) {
+		release_payload(release, release_ctx);
+		return PORTAL_FAIL;
+	}
+
+	if (portal_outq_push_raw(&conn->outq, frame, size, 0, release,
+							 release_ctx) != PORTAL_OK) {
+		release_payload(release, release_ctx);
+		fail_connection(r, conn);
+		return PORTAL_FAIL;
+	}
+	count(&r->counters.frames_queued, 1);
+	mark_dirty(r, conn);
+	if (!enforce_output_limits(r, conn)) {
+		return PORTAL_FAIL;
+	}
+	return PORTAL_OK;
+}
+
+void reactor_post(reactor_t *r, reactor_task_t *task) {
+	mpsc_push(&r->inbox, &task->node);
+
+	// only the first post after the reactor drained pays for the wakeup
+	if (!atomic_exchange(&r->inbox_signaled, true)) {
+		uint64_t one = 1;
+		ssize_t rc = write(r->event_fd, &one, sizeof(one));
+		(void)rc;
+	}
+}
+
+void reactor_drain_inbox(reactor_t *r) {
+	uint64_t count;
+	ssize_t rc = read(r->event_fd, &count, sizeof(count));
+	(void)rc;
+	// clear the flag before draining so a post racing with us re-signals
+	atomic_store(&r->inbox_signaled, false);
+
+	mpsc_node_t *node;
+	while ((node = mpsc_pop(&r->inbox)) != NULL) {
+		reactor_task_t *task = (reactor_task_t *)node;
+		task->run(r, task);
+	}
+}
+
+static void write_connection(reactor_t *r, connection_t *conn) {
+	conn->blocked = false;
+	reactor_flush_connection(r, conn);
+}
+
+int reactor_flush_due(reactor_t *r) {
+	if (r->close_sweep) {
+		sweep_closing(r);
+	}
+	// everything queued while handling the last batch of events goes out
+	// together once the latency budget is spent
+	if (r->dirty_count > 0 && flush_timeout(r) == 0) {
+		flush_dirty(r);
+	}
+	return flush_timeout(r);
+}
+
+#ifdef PORTAL_IO_URING
+// moves the connections an io_uring loop accepted over to epoll, its
+// sockets are blocking and were never registered
+static void adopt_connections(reactor_t *r) {
+	for (uint32_t id = 0; id < r->capacity; ++id) {
+		connection_t *conn = reactor_get_connection(r, id);
+		if (!conn->open) {
+			continue;
+		}
+		if (conn->closing || set_nonblocking(conn->fd) != PORTAL_OK ||
+			watch_connection(r, conn, EPOLL_CTL_ADD) < 0) {
+			reactor_close_connection(r, conn);
+		}
+	}
+	// whatever arrived while the ring was giving up
+	accept_connections(r);
+	reactor_drain_inbox(r);
+}
+#endif
+
+void reactor_run(reactor_t *r) {
+#ifdef PORTAL_IO_URING
+	if (r->backend == REACTOR_BACKEND_URING) {
+		if (reactor_uring_run(r) == PORTAL_OK) {
+			return;
+		}
+		printf("Error: io_uring unavailable, reactor %u falls back to "
+			   "epoll\n",
+			   r->index);
+		adopt_connections(r);
+	}
+#endif
+
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	r->running = true;
+
+	while (r->running) {
+		int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS,
+						   reactor_flush_due(r));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Failed to wait on epoll");
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.u64 == LISTEN_TOKEN) {
+				accept_connections(r);
+				continue;
+			}
+			if (events[i].data.u64 == INBOX_TOKEN) {
+				reactor_drain_inbox(r);
+				continue;
+			}
+
+			connection_t *conn =
+				reactor_get_connection(r, (uint32_t)events[i].data.u64);
+			if (conn == NULL || !conn->open) {
+				continue;
+			}
+
+			if (events[i].events & EPOLLOUT) {
+				write_connection(r, conn);
+			}
+			if (conn->open && (events[i].events & EPOLLIN)) {
+				read_connection(r, conn);
+			}
+			if (conn->open &&
+				(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
+				reactor_close_connection(r, conn);
+			}
+		}
+	}
+}
+
+void reactor_stats(reactor_t *r, reactor_stats_t *stats) {
+	reactor_counters_t *c = &r->counters;
+	stats->frames_queued = atomic_load(&c->frames_queued);
+	stats->flushes = atomic_load(&c->flushes);
+	stats->read_pauses = atomic_load(&c->read_pauses);
+	stats->frames_dropped = atomic_load(&c->frames_dropped);
+	stats->evictions = atomic_load(&c->evictions);
+}
+
+void reactor_destroy(reactor_t *r) {
+	for (uint32_t id = 0; id < r->capacity; ++id) {
+		reactor_close_connection(r, reactor_get_connection(r, id));
+	}
+	for (uint32_t i = 0; i < r->chunk_count; ++i) {
+		free(r->chunks[i]);
+	}
+	free(r->chunks);
+	free(r->dirty);
+	close(r->event_fd);
+	close(r->epoll_fd);
+	memset(r, 0, sizeof(*r));
+}
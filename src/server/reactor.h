@@ -0,0 +1,196 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "mpsc.h"
+#include "outq.h"
+#include "socket_util.h"
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// connections live in fixed size chunks so pointers stay stable as it grows
+#define REACTOR_CHUNK_SHIFT 10
+#define REACTOR_CHUNK_SIZE (1 << REACTOR_CHUNK_SHIFT)
+#define REACTOR_MAX_EVENTS 256
+// queued output waits at most this long for more frames to join it,
+// 0 flushes at the end of every loop iteration
+#define REACTOR_DEFAULT_FLUSH_DELAY_MS 0
+// a connection with this much queued is flushed right away
+#define REACTOR_DEFAULT_FLUSH_BYTES (64 * 1024)
+// reads from a client stop above the high watermark and resume once its
+// queue drains below the low one, past the max the slow policy kicks in
+#define REACTOR_DEFAULT_OUT_HIGH_BYTES (256 * 1024)
+#define REACTOR_DEFAULT_OUT_LOW_BYTES (64 * 1024)
+#define REACTOR_DEFAULT_OUT_MAX_BYTES (1024 * 1024)
+
+// epoll is always available, io_uring needs a build with PORTAL_IO_URING
+typedef enum {
+	REACTOR_BACKEND_EPOLL = 0,
+	REACTOR_BACKEND_URING,
+} reactor_backend_t;
+
+// what happens to a client that cannot keep up with its output
+typedef enum {
+	REACTOR_SLOW_EVICT = 0,
+	REACTOR_SLOW_DROP_OLDEST,
+} reactor_slow_policy_t;
+
+typedef struct {
+	int fd;
+	uint32_t id;
+	// bumped every time the slot is freed, so work that outlives a client
+	// can tell it apart from the next one given the same id
+	uint32_t generation;
+	uint32_t next_free;
+	bool open;
+	struct sockaddr_in addr;
+	portal_decoder_t decoder;
+	portal_outq_t outq;
+	// queued for the end of tick flush
+	bool dirty;
+	// the socket buffer is full, wait for EPOLLOUT before writing again
+	bool blocked;
+	// EPOLLIN is off until the output queue drains
+	bool read_paused;
+	// shut down and waiting for the loop to close it
+	bool closing;
+	// io_uring only, a multishot recv is armed and the send in flight
+	bool recv_armed;
+	struct uring_send *send;
+
+	// 0 until the client has registered or logged in
+	uint32_t user_id;
+
+	// rooms this connection has joined, kept short so leaving is cheap
+	uint32_t *rooms;
+	uint16_t room_count, room_cap;
+} connection_t;
+
+typedef struct reactor reactor_t;
+
+typedef void (*packet_handler_t)(reactor_t *r, connection_t *conn,
+								 packet_t *packet);
+typedef void (*close_handler_t)(reactor_t *r, connection_t *conn);
+
+typedef struct {
+	// frames handed to a connection's output queue
+	uint64_t frames_queued;
+	// writes of a connection's queue to its socket
+	uint64_t flushes;
+	// times a slow reader stopped being read from
+	uint64_t read_pauses;
+	// queued frames thrown away under the drop oldest policy
+	uint64_t frames_dropped;
+	// slow readers disconnected
+	uint64_t evictions;
+} reactor_stats_t;
+
+// counters are only written by the reactor thread, atomics just make
+// reading them from another thread well defined
+typedef struct {
+	atomic_uint_fast64_t frames_queued;
+	atomic_uint_fast64_t flushes;
+	atomic_uint_fast64_t read_pauses;
+	atomic_uint_fast64_t frames_dropped;
+	atomic_uint_fast64_t evictions;
+} reactor_counters_t;
+
+// work handed to a reactor from another thread, embed it in the payload
+typedef struct reactor_task {
+	mpsc_node_t node;
+	void (*run)(reactor_t *r, struct reactor_task *task);
+} reactor_task_t;
+
+struct reactor {
+	uint32_t index;
+	int epoll_fd;
+	int listen_fd;
+	bool running;
+	reactor_backend_t backend;
+	// set while the io_uring backend drives the loop
+	struct reactor_uring *uring;
+
+	// slab of connection slots indexed by connection id
+	connection_t **chunks;
+	uint32_t chunk_count;
+	uint32_t capacity;
+	uint32_t free_head;
+	uint32_t conn_count;
+
+	// connections with output waiting for the next flush
+	uint32_t *dirty;
+	uint32_t dirty_count, dirty_cap;
+	// a failing connection did not fit on the dirty list, the next tick
+	// looks through every slot for it
+	bool close_sweep;
+	uint64_t flush_deadline_ms;
+	uint32_t flush_delay_ms;
+	size_t flush_bytes;
+
+	// per connection output limits
+	size_t out_high_bytes;
+	size_t out_low_bytes;
+	size_t out_max_bytes;
+	reactor_slow_policy_t slow_policy;
+
+	reactor_counters_t counters;
+
+	// tasks posted by other threads, event_fd wakes epoll when it fills
+	mpsc_queue_t inbox;
+	int event_fd;
+	atomic_bool inbox_signaled;
+
+	packet_handler_t on_packet;
+	close_handler_t on_close;
+	void *ctx;
+};
+
+int reactor_init(reactor_t *r, uint32_t index, int listen_fd,
+				 packet_handler_t on_packet);
+void reactor_run(reactor_t *r);
+void reactor_destroy(reactor_t *r);
+
+connection_t *reactor_get_connection(reactor_t *r, uint32_t id);
+// the connection only if it is still open and still the same client
+connection_t *reactor_find_connection(reactor_t *r, uint32_t id,
+									  uint32_t generation);
+void reactor_close_connection(reactor_t *r, connection_t *conn);
+
+// sends without copying the payload, anything the socket cannot take right
+// away is queued by reference and release runs once it has all been written.
+// a failed write shuts the socket down and the loop closes it later, so this
+// is safe to call while walking a list of connections
+int reactor_send_packet(reactor_t *r, connection_t *conn,
+						const packet_t *packet, portal_release_fn release,
+						void *release_ctx);
+// same as reactor_send_packet for a frame that is already encoded
+int reactor_send_raw(reactor_t *r, connection_t *conn, const void *frame,
+					 size_t size, portal_release_fn release,
+					 void *release_ctx);
+
+// thread safe, the task runs on the reactor's own thread
+void reactor_post(reactor_t *r, reactor_task_t *task);
+
+// thread safe. a snapshot of the counters, each one is exact but they are
+// not read at the same instant
+void reactor_stats(reactor_t *r, reactor_stats_t *stats);
+
+#endif // REACTOR_H
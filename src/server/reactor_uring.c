@@ -0,0 +1,458 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifdef PORTAL_IO_URING
+
+#define _GNU_SOURCE
+#include "reactor_uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BUF_GROUP 0
+
+// user data is the operation in the top half and the connection id below
+enum {
+	OP_ACCEPT = 1,
+	OP_INBOX,
+	OP_RECV,
+	OP_SEND,
+	OP_CANCEL,
+};
+
+#define TOKEN(op, id) (((uint64_t)(op) << 32) | (uint32_t)(id))
+
+// a sendmsg in flight, the kernel reads the iovecs until it completes
+typedef struct uring_send {
+	portal_outq_batch_t batch;
+	struct msghdr msg;
+	// loop pass the send was submitted in
+	uint64_t pass;
+	struct uring_send *next_free;
+} uring_send_t;
+
+typedef struct reactor_uring {
+	struct io_uring ring;
+	struct io_uring_buf_ring *buf_ring;
+	unsigned char *buffers;
+	uring_send_t *free_sends;
+	uint64_t pass;
+	// a recv has completed, so the kernel does support multishot recv
+	bool recv_ok;
+	// the ring cannot go on and the epoll loop takes over
+	bool fallback;
+} reactor_uring_t;
+
+// errors that leave the listener or eventfd usable, the operation is just
+// armed again. anything else would spin on the same failure
+static bool transient(int res) {
+	return res == -EINTR || res == -EAGAIN || res == -ECONNABORTED ||
+		   res == -ENOBUFS || res == -ENOMEM || res == -EMFILE ||
+		   res == -ENFILE;
+}
+
+// a kernel without multishot operations or provided buffers only says so
+// once they are submitted
+static bool unsupported(int res) {
+	return res == -EINVAL || res == -EOPNOTSUPP;
+}
+
+static void fall_back(reactor_t *r, const char *what, int res) {
+	if (r->uring->fallback) {
+		return;
+	}
+	errno = -res;
+	perror(what);
+	r->uring->fallback = true;
+	r->running = false;
+}
+
+// submits what is queued so far when the ring is full
+static struct io_uring_sqe *get_sqe(reactor_uring_t *u) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+	while (sqe == NULL) {
+		io_uring_submit(&u->ring);
+		sqe = io_uring_get_sqe(&u->ring);
+	}
+	return sqe;
+}
+
+static void arm_accept(reactor_t *r) {
+	struct io_uring_sqe *sqe = get_sqe(r->uring);
+	io_uring_prep_multishot_accept(sqe, r->listen_fd, NULL, NULL,
+								   SOCK_CLOEXEC);
+	io_uring_sqe_set_data64(sqe, TOKEN(OP_ACCEPT, 0));
+}
+
+static void arm_inbox(reactor_t *r) {
+	struct io_uring_sqe *sqe = get_sqe(r->uring);
+	io_uring_prep_poll_multishot(sqe, r->event_fd, POLLIN);
+	io_uring_sqe_set_data64(sqe, TOKEN(OP_INBOX, 0));
+}
+
+static void arm_recv(reactor_t *r, connection_t *conn) {
+	// the kernel picks a buffer from the group as data arrives so idle
+	// connections hold no receive memory
+	struct io_uring_sqe *sqe = get_sqe(r->uring);
+	io_uring_prep_recv_multishot(sqe, conn->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	io_uring_sqe_set_data64(sqe, TOKEN(OP_RECV, conn->id));
+	conn->recv_armed = true;
+}
+
+static void recycle_buffer(reactor_uring_t *u, uint16_t bid) {
+	io_uring_buf_ring_add(u->buf_ring,
+						  u->buffers + (size_t)bid * REACTOR_URING_BUF_SIZE,
+						  REACTOR_URING_BUF_SIZE, bid,
+						  io_uring_buf_ring_mask(REACTOR_URING_BUF_COUNT), 0);
+	io_uring_buf_ring_advance(u->buf_ring, 1);
+}
+
+void reactor_uring_watch(reactor_t *r, connection_t *conn) {
+	if (!conn->read_paused && !conn->recv_armed) {
+		arm_recv(r, conn);
+	} else if (conn->read_paused && conn->recv_armed) {
+		struct io_uring_sqe *sqe = get_sqe(r->uring);
+		io_uring_prep_cancel64(sqe, TOKEN(OP_RECV, conn->id), 0);
+		io_uring_sqe_set_data64(sqe, TOKEN(OP_CANCEL, conn->id));
+	}
+}
+
+int reactor_uring_send(reactor_t *r, connection_t *conn) {
+	if (conn->send != NULL) {
+		return PORTAL_AGAIN;
+	}
+
+	reactor_uring_t *u = r->uring;
+	uring_send_t *send = u->free_sends;
+	if (send != NULL) {
+		u->free_sends = send->next_free;
+	} else {
+		send = malloc(sizeof(uring_send_t));
+		if (send == NULL) {
+			perror("Failed to allocate send");
+			return PORTAL_FAIL;
+		}
+	}
+
+	portal_outq_prepare(&conn->outq, &send->batch);
+	memset(&send->msg, 0, sizeof(send->msg));
+	send->msg.msg_iov = send->batch.iov;
+	send->msg.msg_iovlen = send->batch.iov_count;
+	// the batch points into these frames until the completion arrives
+	conn->outq.pinned = send->batch.frames;
+	conn->send = send;
+	send->pass = u->pass;
+
+	int flags = MSG_NOSIGNAL | (send->batch.more ? MSG_MORE : 0);
+	struct io_uring_sqe *sqe = get_sqe(u);
+	io_uring_prep_sendmsg(sqe, conn->fd, &send->msg, flags);
+	io_uring_sqe_set_data64(sqe, TOKEN(OP_SEND, conn->id));
+
+	// a large backlog goes out now instead of with the next wait, a send
+	// the socket takes right away completes within the same pass
+	if (conn->outq.bytes >= r->flush_bytes) {
+		io_uring_submit(&u->ring);
+	}
+	return PORTAL_AGAIN;
+}
+
+bool reactor_uring_stalled(reactor_t *r, connection_t *conn) {
+	// completions are only reaped between passes, so a send from this
+	// pass may simply not have been seen yet
+	return conn->send != NULL && conn->send->pass != r->uring->pass;
+}
+
+static void handle_accept(reactor_t *r, struct io_uring_cqe *cqe) {
+	if (cqe->res < 0 && !transient(cqe->res)) {
+		fall_back(r, "Failed to accept on io_uring", cqe->res);
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		arm_accept(r);
+	}
+	if (cqe->res < 0) {
+		if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+			errno = -cqe->res;
+			perror("Failed to accept connection");
+		}
+		return;
+	}
+
+	// multishot accept shares one address buffer between completions, so
+	// ask for the peer once the socket is ours
+	struct sockaddr_in addr = {0};
+	socklen_t addr_size = sizeof(addr);
+	getpeername(cqe->res, (struct sockaddr *)&addr, &addr_size);
+	reactor_open_connection(r, cqe->res, &addr);
+}
+
+static void handle_inbox(reactor_t *r, struct io_uring_cqe *cqe) {
+	if (cqe->res < 0 && !transient(cqe->res)) {
+		fall_back(r, "Failed to poll the inbox on io_uring", cqe->res);
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		arm_inbox(r);
+	}
+	reactor_drain_inbox(r);
+}
+
+static void handle_recv(reactor_t *r, connection_t *conn,
+						struct io_uring_cqe *cqe) {
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		conn->recv_armed = false;
+	}
+
+	int rc = PORTAL_OK;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && !conn->closing) {
+			rc = portal_decoder_feed(
+				&conn->decoder,
+				r->uring->buffers + (size_t)bid * REACTOR_URING_BUF_SIZE,
+				cqe->res);
+		}
+		// the bytes live in the decoder now, give the buffer straight back
+		recycle_buffer(r->uring, bid);
+	}
+	if (conn->closing) {
+		return;
+	}
+	if (cqe->res > 0) {
+		r->uring->recv_ok = true;
+	} else if (unsupported(cqe->res) && !r->uring->recv_ok) {
+		// the connection itself is fine, epoll picks it up
+		fall_back(r, "Failed to receive on io_uring", cqe->res);
+		return;
+	}
+
+	// ENOBUFS only means the group ran dry and the recv needs re-arming,
+	// ECANCELED is a pause
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS &&
+						  cqe->res != -ECANCELED)) {
+		if (cqe->res < 0 && cqe->res != -ECONNRESET) {
+			errno = -cqe->res;
+			perror("Failed to recieve packet");
+		}
+		reactor_close_connection(r, conn);
+		return;
+	}
+
+	if (rc == PORTAL_OK && cqe->res > 0) {
+		rc = reactor_dispatch_packets(r, conn);
+	}
+	if (rc != PORTAL_OK) {
+		reactor_close_connection(r, conn);
+		return;
+	}
+
+	if (conn->open && !conn->closing) {
+		if (conn->decoder.len == 0) {
+			portal_decoder_trim(&conn->decoder);
+		}
+		reactor_uring_watch(r, conn);
+	}
+}
+
+static void handle_send(reactor_t *r, connection_t *conn,
+						struct io_uring_cqe *cqe) {
+	reactor_uring_t *u = r->uring;
+	uring_send_t *send = conn->send;
+	conn->send = NULL;
+	conn->outq.pinned = 0;
+	conn->blocked = false;
+	send->next_free = u->free_sends;
+	u->free_sends = send;
+
+	if (cqe->res < 0) {
+		if (cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+			errno = -cqe->res;
+			perror("Failed to send packet");
+		}
+		reactor_close_connection(r, conn);
+		return;
+	}
+
+	portal_outq_consume(&conn->outq, cqe->res);
+	// sends whatever is left or was queued meanwhile, and resumes reading
+	// once the queue is short again
+	reactor_flush_connection(r, conn);
+}
+
+static void handle_cqe(reactor_t *r, struct io_uring_cqe *cqe) {
+	uint64_t token = io_uring_cqe_get_data64(cqe);
+	int op = token >> 32;
+	if (op == OP_ACCEPT) {
+		handle_accept(r, cqe);
+		return;
+	}
+	if (op == OP_INBOX) {
+		handle_inbox(r, cqe);
+		return;
+	}
+	if (op == OP_CANCEL) {
+		return;
+	}
+
+	// a slot is only freed once nothing is in flight for it, so the id
+	// always refers to the connection the operation was issued for
+	connection_t *conn = reactor_get_connection(r, (uint32_t)token);
+	if (op == OP_RECV) {
+		handle_recv(r, conn, cqe);
+	} else if (op == OP_SEND) {
+		handle_send(r, conn, cqe);
+	}
+
+	if (conn->open && conn->closing) {
+		reactor_close_connection(r, conn);
+	}
+}
+
+static int setup_buffers(reactor_uring_t *u) {
+	int rc;
+	u->buf_ring = io_uring_setup_buf_ring(&u->ring, REACTOR_URING_BUF_COUNT,
+										  BUF_GROUP, 0, &rc);
+	if (u->buf_ring == NULL) {
+		errno = -rc;
+		perror("Failed to register io_uring buffers");
+		return PORTAL_FAIL;
+	}
+
+	u->buffers =
+		malloc((size_t)REACTOR_URING_BUF_COUNT * REACTOR_URING_BUF_SIZE);
+	if (u->buffers == NULL) {
+		perror("Failed to allocate io_uring buffers");
+		io_uring_free_buf_ring(&u->ring, u->buf_ring, REACTOR_URING_BUF_COUNT,
+							   BUF_GROUP);
+		return PORTAL_FAIL;
+	}
+	for (uint16_t bid = 0; bid < REACTOR_URING_BUF_COUNT; ++bid) {
+		recycle_buffer(u, bid);
+	}
+	return PORTAL_OK;
+}
+
+static int setup_ring(reactor_uring_t *u) {
+	// only this thread submits, and completions can wait for its next
+	// trip into the kernel instead of interrupting the loop
+	int rc = io_uring_queue_init(
+		REACTOR_URING_ENTRIES, &u->ring,
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+	if (rc == -EINVAL) {
+		rc = io_uring_queue_init(REACTOR_URING_ENTRIES, &u->ring, 0);
+	}
+	if (rc < 0) {
+		errno = -rc;
+		perror("Failed to create io_uring");
+		return PORTAL_FAIL;
+	}
+
+	if (setup_buffers(u) != PORTAL_OK) {
+		io_uring_queue_exit(&u->ring);
+		return PORTAL_FAIL;
+	}
+	return PORTAL_OK;
+}
+
+static void teardown_ring(reactor_t *r, reactor_uring_t *u) {
+	io_uring_free_buf_ring(&u->ring, u->buf_ring, REACTOR_URING_BUF_COUNT,
+						   BUF_GROUP);
+	io_uring_queue_exit(&u->ring);
+	r->uring = NULL;
+
+	// the ring is gone so nothing is in flight anymore, let
+	// reactor_destroy close the connections the usual way
+	for (uint32_t id = 0; id < r->capacity; ++id) {
+		connection_t *conn = reactor_get_connection(r, id);
+		conn->recv_armed = false;
+		conn->outq.pinned = 0;
+		if (conn->send != NULL) {
+			conn->send->next_free = u->free_sends;
+			u->free_sends = conn->send;
+			conn->send = NULL;
+		}
+	}
+
+	while (u->free_sends != NULL) {
+		uring_send_t *next = u->free_sends->next_free;
+		free(u->free_sends);
+		u->free_sends = next;
+	}
+	free(u->buffers);
+}
+
+int reactor_uring_run(reactor_t *r) {
+	reactor_uring_t u = {0};
+	if (setup_ring(&u) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
+
+	// io_uring waits for readiness itself, on a non-blocking listener the
+	// accept would fail with EAGAIN instead
+	int flags = fcntl(r->listen_fd, F_GETFL, 0);
+	fcntl(r->listen_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+	r->uring = &u;
+	r->running = true;
+	arm_accept(r);
+	arm_inbox(r);
+
+	while (r->running) {
+		u.pass++;
+		int timeout = reactor_flush_due(r);
+		struct __kernel_timespec ts = {
+			.tv_sec = timeout / 1000,
+			.tv_nsec = (long long)(timeout % 1000) * 1000000,
+		};
+
+		// everything queued since the last pass is submitted with the wait
+		struct io_uring_cqe *cqe;
+		int rc = io_uring_submit_and_wait_timeout(
+			&u.ring, &cqe, 1, timeout < 0 ? NULL : &ts, NULL);
+		if (rc < 0 && rc != -ETIME && rc != -EINTR) {
+			errno = -rc;
+			perror("Failed to wait on io_uring");
+			break;
+		}
+
+		// completions posted while handling these are picked up in the same
+		// pass, bounded so due output is not starved under constant load
+		for (unsigned i = 0; i < REACTOR_URING_ENTRIES * 2 && !u.fallback &&
+							 io_uring_peek_cqe(&u.ring, &cqe) == 0;
+			 ++i) {
+			handle_cqe(r, cqe);
+			io_uring_cqe_seen(&u.ring, cqe);
+		}
+	}
+
+	teardown_ring(r, &u);
+	if (u.fallback) {
+		fcntl(r->listen_fd, F_SETFL, flags);
+		return PORTAL_FAIL;
+	}
+	return PORTAL_OK;
+}
+
+#endif // PORTAL_IO_URING
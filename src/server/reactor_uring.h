@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef REACTOR_URING_H
+#define REACTOR_URING_H
+
+#include "reactor.h"
+
+// reactor internals the io_uring backend drives the connections through
+
+// takes ownership of fd, closing it if no slot can be found
+connection_t *reactor_open_connection(reactor_t *r, int fd,
+									  const struct sockaddr_in *addr);
+// hands every complete packet in the decoder to the handler
+int reactor_dispatch_packets(reactor_t *r, connection_t *conn);
+void reactor_flush_connection(reactor_t *r, connection_t *conn);
+// writes out the dirty list once it is due, returns how many ms the loop
+// may sleep or -1 if nothing is pending
+int reactor_flush_due(reactor_t *r);
+void reactor_drain_inbox(reactor_t *r);
+
+#ifdef PORTAL_IO_URING
+
+// io_uring queue depth and the provided buffers multishot recv fills
+#define REACTOR_URING_ENTRIES 1024
+#define REACTOR_URING_BUF_COUNT 512
+#define REACTOR_URING_BUF_SIZE 4096
+
+// runs the loop on io_uring. PORTAL_FAIL if the ring cannot be set up or
+// the kernel turns out to lack an operation it needs, the connections it
+// accepted are then left for the epoll loop
+int reactor_uring_run(reactor_t *r);
+// arms or cancels the connection's recv to match read_paused
+void reactor_uring_watch(reactor_t *r, connection_t *conn);
+// submits the front of the output queue, PORTAL_AGAIN while it is in flight
+int reactor_uring_send(reactor_t *r, connection_t *conn);
+// true once a send has waited on a full socket for more than a pass
+bool reactor_uring_stalled(reactor_t *r, connection_t *conn);
+
+#endif // PORTAL_IO_URING
+
+#endif // REACTOR_URING_H
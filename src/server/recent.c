@@ -0,0 +1,270 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "recent.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECENT_INIT_BUCKETS 256
+
+typedef struct recent_room {
+	uint32_t id;
+	// the oldest message sits at head, the ring is per_room long
+	msgbuf_t **ring;
+	uint32_t head, count;
+	uint64_t first_seq;
+	// frames plus the ring itself, counted against the budget
+	size_t bytes;
+	struct recent_room *next;
+	// most recently used rooms are at the front
+	struct recent_room *lru_prev, *lru_next;
+} recent_room_t;
+
+// a backfill only holds the lock for as long as it takes to ref the
+// frames, the sending happens after it is released
+static pthread_mutex_t recent_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t recent_per_room;
+static size_t recent_budget;
+static size_t recent_bytes;
+static recent_room_t **recent_buckets;
+static uint32_t recent_bucket_count;
+static uint32_t recent_room_count;
+static recent_room_t *recent_lru_head, *recent_lru_tail;
+
+static uint32_t bucket_of(uint32_t room_id) {
+	// fibonacci hashing spreads sequential ids across buckets
+	return (room_id * 2654435769u) & (recent_bucket_count - 1);
+}
+
+int recent_init(uint32_t per_room, size_t budget_bytes) {
+	recent_per_room = per_room;
+	recent_budget = budget_bytes;
+	if (per_room == 0) {
+		return PORTAL_OK;
+	}
+	recent_buckets = calloc(RECENT_INIT_BUCKETS, sizeof(recent_room_t *));
+	if (recent_buckets == NULL) {
+		perror("Failed to allocate recent message cache");
+		return PORTAL_FAIL;
+	}
+	recent_bucket_count = RECENT_INIT_BUCKETS;
+	return PORTAL_OK;
+}
+
+static recent_room_t *find_room(uint32_t room_id) {
+	recent_room_t *room = recent_buckets[bucket_of(room_id)];
+	while (room != NULL && room->id != room_id) {
+		room = room->next;
+	}
+	return room;
+}
+
+static void lru_unlink(recent_room_t *room) {
+	if (room->lru_prev != NULL) {
+		room->lru_prev->lru_next = room->lru_next;
+	} else {
+		recent_lru_head = room->lru_next;
+	}
+	if (room->lru_next != NULL) {
+		room->lru_next->lru_prev = room->lru_prev;
+	} else {
+		recent_lru_tail = room->lru_prev;
+	}
+	room->lru_prev = room->lru_next = NULL;
+}
+
+static void lru_touch(recent_room_t *room) {
+	if (recent_lru_head == room) {
+		return;
+	}
+	if (room->lru_prev != NULL || recent_lru_tail == room) {
+		lru_unlink(room);
+	}
+	room->lru_next = recent_lru_head;
+	if (recent_lru_head != NULL) {
+		recent_lru_head->lru_prev = room;
+	}
+	recent_lru_head = room;
+	if (recent_lru_tail == NULL) {
+		recent_lru_tail = room;
+	}
+}
+
+static void grow_buckets() {
+	uint32_t bucket_count = recent_bucket_count * 2;
+	recent_room_t **buckets = calloc(bucket_count, sizeof(recent_room_t *));
+	if (buckets == NULL) {
+		// a longer chain is still correct, just slower
+		return;
+	}
+
+	recent_room_t **old = recent_buckets;
+	uint32_t old_count = recent_bucket_count;
+	recent_buckets = buckets;
+	recent_bucket_count = bucket_count;
+	for (uint32_t i = 0; i < old_count; ++i) {
+		recent_room_t *room = old[i];
+		while (room != NULL) {
+			recent_room_t *next = room->next;
+			uint32_t b = bucket_of(room->id);
+			room->next = recent_buckets[b];
+			recent_buckets[b] = room;
+			room = next;
+		}
+	}
+	free(old);
+}
+
+static recent_room_t *create_room(uint32_t room_id, uint64_t first_seq) {
+	recent_room_t *room = calloc(1, sizeof(recent_room_t));
+	if (room == NULL) {
+		return NULL;
+	}
+	room->ring = malloc(sizeof(msgbuf_t *) * recent_per_room);
+	if (room->ring == NULL) {
+		free(room);
+		return NULL;
+	}
+	room->id = room_id;
+	room->first_seq = first_seq;
+	room->bytes = sizeof(recent_room_t) + sizeof(msgbuf_t *) * recent_per_room;
+	recent_bytes += room->bytes;
+
+	if (recent_room_count >= recent_bucket_count) {
+		grow_buckets();
+	}
+	uint32_t b = bucket_of(room_id);
+	room->next = recent_buckets[b];
+	recent_buckets[b] = room;
+	recent_room_count++;
+	return room;
+}
+
+static void drop_oldest(recent_room_t *room) {
+	msgbuf_t *buf = room->ring[room->head];
+	room->head = (room->head + 1) % recent_per_room;
+	room->count--;
+	room->first_seq++;
+	room->bytes -= buf->size;
+	recent_bytes -= buf->size;
+	msgbuf_unref(buf);
+}
+
+static void evict_room(recent_room_t *room) {
+	while (room->count > 0) {
+		drop_oldest(room);
+	}
+	recent_room_t **link = &recent_buckets[bucket_of(room->id)];
+	while (*link != room) {
+		link = &(*link)->next;
+	}
+	*link = room->next;
+	recent_room_count--;
+	lru_unlink(room);
+	recent_bytes -= room->bytes;
+	free(room->ring);
+	free(room);
+}
+
+void recent_push(uint32_t room_id, uint64_t seq, msgbuf_t *buf) {
+	if (recent_per_room == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&recent_lock);
+	recent_room_t *room = find_room(room_id);
+	// a gap means messages were missed, the ring would no longer be a run
+	if (room != NULL && room->first_seq + room->count != seq) {
+		evict_room(room);
+		room = NULL;
+	}
+	if (room == NULL && (room = create_room(room_id, seq)) == NULL) {
+		pthread_mutex_unlock(&recent_lock);
+		return;
+	}
+
+	if (room->count == recent_per_room) {
+		drop_oldest(room);
+	}
+	msgbuf_ref(buf);
+	room->ring[(room->head + room->count) % recent_per_room] = buf;
+	room->count++;
+	room->bytes += buf->size;
+	recent_bytes += buf->size;
+	lru_touch(room);
+
+	// cold rooms go first, a single room over budget sheds its own oldest
+	while (recent_bytes > recent_budget && recent_lru_tail != room) {
+		evict_room(recent_lru_tail);
+	}
+	while (recent_bytes > recent_budget && room->count > 1) {
+		drop_oldest(room);
+	}
+	pthread_mutex_unlock(&recent_lock);
+}
+
+bool recent_fetch(uint32_t room_id, uint64_t first_seq, uint32_t count,
+				  uint32_t max, size_t max_bytes, recent_range_t *out) {
+	out->count = 0;
+	out->size = 0;
+	if (recent_per_room == 0) {
+		return false;
+	}
+	uint32_t want = count < max ? count : max;
+
+	pthread_mutex_lock(&recent_lock);
+	recent_room_t *room = find_room(room_id);
+	if (room == NULL) {
+		pthread_mutex_unlock(&recent_lock);
+		return false;
+	}
+
+	// anything older than the ring has to come from disk, unless the ring
+	// goes back to the very first message of the room
+	uint64_t end = room->first_seq + room->count;
+	uint64_t seq = first_seq;
+	if (seq == UINT64_MAX) {
+		seq = room->count > want ? end - want : room->first_seq;
+		if (end - seq < want && room->first_seq != 0) {
+			pthread_mutex_unlock(&recent_lock);
+			return false;
+		}
+	} else if (seq < room->first_seq) {
+		pthread_mutex_unlock(&recent_lock);
+		return false;
+	}
+
+	out->first_seq = seq;
+	while (out->count < want && seq < end) {
+		msgbuf_t *buf =
+			room->ring[(room->head + (seq - room->first_seq)) %
+					   recent_per_room];
+		// the first frame always fits so a fetch makes progress
+		if (out->count > 0 && out->size + buf->size > max_bytes) {
+			break;
+		}
+		msgbuf_ref(buf);
+		out->bufs[out->count++] = buf;
+		out->size += buf->size;
+		seq++;
+	}
+	lru_touch(room);
+	pthread_mutex_unlock(&recent_lock);
+	return true;
+}
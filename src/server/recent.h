@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef RECENT_H
+#define RECENT_H
+
+#include "msgbuf.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECENT_DEFAULT_PER_ROOM 256
+#define RECENT_DEFAULT_BUDGET_BYTES (64 * 1024 * 1024)
+
+// the newest messages of each active room kept as shared frames, so a
+// backfill is answered on the reactor without touching the history store.
+// once the budget is used up the least recently used rooms are dropped
+
+// a run of cached messages, bufs is provided by the caller and holds a
+// reference on each of the count frames
+typedef struct {
+	uint64_t first_seq;
+	uint32_t count;
+	size_t size;
+	msgbuf_t **bufs;
+} recent_range_t;
+
+// call before anything is pushed, a per_room of 0 turns the cache off
+int recent_init(uint32_t per_room, size_t budget_bytes);
+
+// thread safe. records buf as message seq of the room, taking a reference.
+// the history store calls it once the message is written to disk
+void recent_push(uint32_t room, uint64_t seq, msgbuf_t *buf);
+
+// thread safe. true when the cache holds the whole range, which is then in
+// out. a first_seq of all ones asks for the newest count messages. at most
+// max frames are returned and past the first, no more than max_bytes
+bool recent_fetch(uint32_t room, uint64_t first_seq, uint32_t count,
+				  uint32_t max, size_t max_bytes, recent_range_t *out);
+
+#endif // RECENT_H
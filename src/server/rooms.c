@@ -0,0 +1,364 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "rooms.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRESENCE_STRIPES 64
+#define PRESENCE_INIT_BUCKETS 16
+
+// the reactors a room has members on, shared by every reactor
+typedef struct room_presence {
+	uint32_t id;
+	uint64_t reactors[ROOMS_REACTOR_WORDS];
+	struct room_presence *next;
+} room_presence_t;
+
+// rooms are spread over stripes so senders in different rooms rarely
+// meet on a lock, each stripe is its own small hash table
+typedef struct {
+	pthread_mutex_t lock;
+	room_presence_t **buckets;
+	uint32_t bucket_count;
+	uint32_t room_count;
+} presence_stripe_t;
+
+static pthread_once_t presence_once = PTHREAD_ONCE_INIT;
+static presence_stripe_t presence[PRESENCE_STRIPES];
+
+static uint32_t hash_room(uint32_t room_id) {
+	// fibonacci hashing spreads sequential ids across buckets
+	return room_id * 2654435769u;
+}
+
+static uint32_t bucket_of(room_table_t *t, uint32_t room_id) {
+	return hash_room(room_id) & (t->bucket_count - 1);
+}
+
+static void presence_init() {
+	for (uint32_t i = 0; i < PRESENCE_STRIPES; ++i) {
+		pthread_mutex_init(&presence[i].lock, NULL);
+	}
+}
+
+// the top bits pick the stripe and the bottom ones the bucket within it
+static presence_stripe_t *stripe_of(uint32_t room_id) {
+	return &presence[hash_room(room_id) >> 26];
+}
+
+static room_presence_t **presence_link(presence_stripe_t *stripe,
+									   uint32_t room_id) {
+	room_presence_t **link =
+		&stripe->buckets[hash_room(room_id) & (stripe->bucket_count - 1)];
+	while (*link != NULL && (*link)->id != room_id) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+static void presence_grow(presence_stripe_t *stripe) {
+	uint32_t bucket_count =
+		stripe->bucket_count ? stripe->bucket_count * 2 : PRESENCE_INIT_BUCKETS;
+	room_presence_t **buckets = calloc(bucket_count, sizeof(room_presence_t *));
+	if (buckets == NULL) {
+		// a longer chain is still correct, just slower
+		return;
+	}
+
+	room_presence_t **old = stripe->buckets;
+	uint32_t old_count = stripe->bucket_count;
+	stripe->buckets = buckets;
+	stripe->bucket_count = bucket_count;
+	for (uint32_t i = 0; i < old_count; ++i) {
+		room_presence_t *room = old[i];
+		while (room != NULL) {
+			room_presence_t *next = room->next;
+			uint32_t b = hash_room(room->id) & (bucket_count - 1);
+			room->next = buckets[b];
+			buckets[b] = room;
+			room = next;
+		}
+	}
+	free(old);
+}
+
+static int presence_set(uint32_t room_id, uint32_t reactor_index) {
+	presence_stripe_t *stripe = stripe_of(room_id);
+	pthread_mutex_lock(&stripe->lock);
+	if (stripe->room_count >= stripe->bucket_count) {
+		presence_grow(stripe);
+	}
+	if (stripe->bucket_count == 0) {
+		pthread_mutex_unlock(&stripe->lock);
+		return PORTAL_FAIL;
+	}
+	room_presence_t **link = presence_link(stripe, room_id);
+	if (*link == NULL) {
+		*link = calloc(1, sizeof(room_presence_t));
+		if (*link == NULL) {
+			pthread_mutex_unlock(&stripe->lock);
+			return PORTAL_FAIL;
+		}
+		(*link)->id = room_id;
+		stripe->room_count++;
+	}
+	(*link)->reactors[reactor_index / 64] |= 1ull << (reactor_index % 64);
+	pthread_mutex_unlock(&stripe->lock);
+	return PORTAL_OK;
+}
+
+static void presence_clear(uint32_t room_id, uint32_t reactor_index) {
+	presence_stripe_t *stripe = stripe_of(room_id);
+	pthread_mutex_lock(&stripe->lock);
+	room_presence_t **link =
+		stripe->bucket_count ? presence_link(stripe, room_id) : NULL;
+	if (link != NULL && *link != NULL) {
+		room_presence_t *room = *link;
+		room->reactors[reactor_index / 64] &= ~(1ull << (reactor_index % 64));
+		uint64_t any = 0;
+		for (uint32_t i = 0; i < ROOMS_REACTOR_WORDS; ++i) {
+			any |= room->reactors[i];
+		}
+		if (any == 0) {
+			*link = room->next;
+			stripe->room_count--;
+			free(room);
+		}
+	}
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+void rooms_reactors(uint32_t room_id,
+					uint64_t reactors[ROOMS_REACTOR_WORDS]) {
+	memset(reactors, 0, sizeof(uint64_t) * ROOMS_REACTOR_WORDS);
+	presence_stripe_t *stripe = stripe_of(room_id);
+	pthread_mutex_lock(&stripe->lock);
+	if (stripe->bucket_count > 0) {
+		room_presence_t *room = *presence_link(stripe, room_id);
+		if (room != NULL) {
+			memcpy(reactors, room->reactors,
+				   sizeof(uint64_t) * ROOMS_REACTOR_WORDS);
+		}
+	}
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+int rooms_init(room_table_t *t, uint32_t reactor_index) {
+	pthread_once(&presence_once, presence_init);
+	memset(t, 0, sizeof(*t));
+	t->reactor_index = reactor_index;
+	t->buckets = calloc(ROOMS_INIT_BUCKETS, sizeof(room_t *));
+	if (t->buckets == NULL) {
+		perror("Failed to allocate room table");
+		return PORTAL_FAIL;
+	}
+	t->bucket_count = ROOMS_INIT_BUCKETS;
+	return PORTAL_OK;
+}
+
+void rooms_destroy(room_table_t *t) {
+	for (uint32_t i = 0; i < t->bucket_count; ++i) {
+		room_t *room = t->buckets[i];
+		while (room != NULL) {
+			room_t *next = room->next;
+			presence_clear(room->id, t->reactor_index);
+			free(room->members);
+			free(room);
+			room = next;
+		}
+	}
+	free(t->buckets);
+	memset(t, 0, sizeof(*t));
+}
+
+static void grow_buckets(room_table_t *t) {
+	uint32_t bucket_count = t->bucket_count * 2;
+	room_t **buckets = calloc(bucket_count, sizeof(room_t *));
+	if (buckets == NULL) {
+		// a longer chain is still correct, just slower
+		return;
+	}
+
+	room_t **old = t->buckets;
+	uint32_t old_count = t->bucket_count;
+	t->buckets = buckets;
+	t->bucket_count = bucket_count;
+	for (uint32_t i = 0; i < old_count; ++i) {
+		room_t *room = old[i];
+		while (room != NULL) {
+			room_t *next = room->next;
+			uint32_t b = bucket_of(t, room->id);
+			room->next = t->buckets[b];
+			t->buckets[b] = room;
+			room = next;
+		}
+	}
+	free(old);
+}
+
+room_t *rooms_find(room_table_t *t, uint32_t room_id) {
+	room_t *room = t->buckets[bucket_of(t, room_id)];
+	while (room != NULL && room->id != room_id) {
+		room = room->next;
+	}
+	return room;
+}
+
+static room_t *get_or_create(room_table_t *t, uint32_t room_id) {
+	room_t *room = rooms_find(t, room_id);
+	if (room != NULL) {
+		return room;
+	}
+
+	room = calloc(1, sizeof(room_t));
+	if (room == NULL) {
+		perror("Failed to allocate room");
+		return NULL;
+	}
+	room->id = room_id;
+	// other reactors skip this one for the room until the bit is set
+	if (presence_set(room_id, t->reactor_index) != PORTAL_OK) {
+		perror("Failed to allocate room presence");
+		free(room);
+		return NULL;
+	}
+
+	if (t->room_count >= t->bucket_count) {
+		grow_buckets(t);
+	}
+	uint32_t b = bucket_of(t, room_id);
+	room->next = t->buckets[b];
+	t->buckets[b] = room;
+	t->room_count++;
+	return room;
+}
+
+static void remove_room(room_table_t *t, room_t *room) {
+	room_t **link = &t->buckets[bucket_of(t, room->id)];
+	while (*link != room) {
+		link = &(*link)->next;
+	}
+	*link = room->next;
+	t->room_count--;
+	presence_clear(room->id, t->reactor_index);
+	free(room->members);
+	free(room);
+}
+
+bool rooms_is_member(const connection_t *conn, uint32_t room_id) {
+	for (uint16_t i = 0; i < conn->room_count; ++i) {
+		if (conn->rooms[i] == room_id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int rooms_join(room_table_t *t, connection_t *conn, uint32_t room_id) {
+	if (rooms_is_member(conn, room_id)) {
+		return PORTAL_OK;
+	}
+	if (conn->room_count >= ROOMS_MAX_PER_CONNECTION) {
+		return PORTAL_FAIL;
+	}
+
+	if (conn->room_count == conn->room_cap) {
+		uint16_t cap = conn->room_cap ? conn->room_cap * 2 : 4;
+		uint32_t *rooms = realloc(conn->rooms, sizeof(uint32_t) * cap);
+		if (rooms == NULL) {
+			return PORTAL_FAIL;
+		}
+		conn->rooms = rooms;
+		conn->room_cap = cap;
+	}
+
+	room_t *room = get_or_create(t, room_id);
+	if (room == NULL) {
+		return PORTAL_FAIL;
+	}
+	if (room->member_count == room->member_cap) {
+		uint32_t cap = room->member_cap ? room->member_cap * 2 : 8;
+		uint32_t *members = realloc(room->members, sizeof(uint32_t) * cap);
+		if (members == NULL) {
+			if (room->member_count == 0) {
+				remove_room(t, room);
+			}
+			return PORTAL_FAIL;
+		}
+		room->members = members;
+		room->member_cap = cap;
+	}
+
+	room->members[room->member_count++] = conn->id;
+	conn->rooms[conn->room_count++] = room_id;
+	return PORTAL_OK;
+}
+
+void rooms_leave(room_table_t *t, connection_t *conn, uint32_t room_id) {
+	for (uint16_t i = 0; i < conn->room_count; ++i) {
+		if (conn->rooms[i] == room_id) {
+			conn->rooms[i] = conn->rooms[--conn->room_count];
+			break;
+		}
+	}
+
+	room_t *room = rooms_find(t, room_id);
+	if (room == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < room->member_count; ++i) {
+		if (room->members[i] == conn->id) {
+			// order does not matter so swap the last member in
+			room->members[i] = room->members[--room->member_count];
+			break;
+		}
+	}
+	if (room->member_count == 0) {
+		remove_room(t, room);
+	}
+}
+
+void rooms_leave_all(room_table_t *t, connection_t *conn) {
+	while (conn->room_count > 0) {
+		rooms_leave(t, conn, conn->rooms[conn->room_count - 1]);
+	}
+	free(conn->rooms);
+	conn->rooms = NULL;
+	conn->room_cap = 0;
+}
+
+uint32_t rooms_broadcast(room_table_t *t, reactor_t *r, uint32_t room_id,
+						 msgbuf_t *buf) {
+	room_t *room = rooms_find(t, room_id);
+	if (room == NULL) {
+		return 0;
+	}
+
+	uint32_t delivered = 0;
+	for (uint32_t i = 0; i < room->member_count; ++i) {
+		connection_t *conn = reactor_get_connection(r, room->members[i]);
+		msgbuf_ref(buf);
+		if (reactor_send_raw(r, conn, buf->frame, buf->size, msgbuf_unref,
+							 buf) == PORTAL_OK) {
+			delivered++;
+		}
+	}
+	return delivered;
+}
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include "msgbuf.h"
+#include "reactor.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ROOMS_INIT_BUCKETS 256
+#define ROOMS_MAX_PER_CONNECTION 64
+#define ROOMS_MAX_REACTORS 256
+#define ROOMS_REACTOR_WORDS (ROOMS_MAX_REACTORS / 64)
+
+typedef struct room {
+	uint32_t id;
+	// connection ids on the owning reactor
+	uint32_t *members;
+	uint32_t member_count, member_cap;
+	struct room *next;
+} room_t;
+
+// room membership for the connections of a single reactor, only ever
+// touched from that reactor's thread so it needs no locking
+typedef struct {
+	room_t **buckets;
+	uint32_t bucket_count;
+	uint32_t room_count;
+	uint32_t reactor_index;
+} room_table_t;
+
+int rooms_init(room_table_t *t, uint32_t reactor_index);
+void rooms_destroy(room_table_t *t);
+
+room_t *rooms_find(room_table_t *t, uint32_t room_id);
+bool rooms_is_member(const connection_t *conn, uint32_t room_id);
+
+int rooms_join(room_table_t *t, connection_t *conn, uint32_t room_id);
+void rooms_leave(room_table_t *t, connection_t *conn, uint32_t room_id);
+// called when a connection closes
+void rooms_leave_all(room_table_t *t, connection_t *conn);
+
+// queues the shared frame on every local member, one reference each,
+// and returns how many members it was handed to
+uint32_t rooms_broadcast(room_table_t *t, reactor_t *r, uint32_t room_id,
+						 msgbuf_t *buf);
+
+// thread safe. one bit per reactor index that has members in the room, so
+// a message is only handed to the reactors that will deliver it. a reactor
+// sets its bit when its first member joins and clears it after the last
+// one leaves
+void rooms_reactors(uint32_t room_id, uint64_t reactors[ROOMS_REACTOR_WORDS]);
+
+#endif // ROOMS_H
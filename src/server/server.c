@@ -15,99 +15,668 @@ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
 IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
+#define _GNU_SOURCE
+#include "auth_pool.h"
+#include "bufpool.h"
 #include "crypto.h"
+#include "history.h"
+#include "login.h"
+#include "reactor.h"
+#include "recent.h"
+#include "rooms.h"
+#include "session.h"
 #include "socket_util.h"
+#include "user_cache.h"
 #include "users_db.h"
 #include <arpa/inet.h>
+#include <endian.h>
+#include <inttypes.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sqlite3.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#define SERVER_PORT 8675
+#define MAX_REACTORS ROOMS_MAX_REACTORS
+
+typedef struct {
+	pthread_t thread;
+	uint32_t index;
+	long cpu_count;
+	int listen_fd;
+	reactor_t reactor;
+	room_table_t rooms;
+} server_worker_t;
+
+// a room message travelling to another reactor's members
 typedef struct {
-	int fd;
-	struct sockaddr_in addr;
-	int err;
-	bool success;
-} accepted_socket_t;
+	reactor_task_t task;
+	uint32_t room;
+	msgbuf_t *buf;
+} fanout_task_t;
 
-static accepted_socket_t accept_connection(int fd) {
-	struct sockaddr_in client_address;
-	unsigned int client_address_size = sizeof(client_address);
-	int client_socket_fd =
-		accept(fd, (struct sockaddr *)&client_address, &client_address_size);
+// a history fetch and the client it answers
+typedef struct {
+	history_fetch_t fetch;
+	uint32_t conn_id, conn_generation;
+} history_request_t;
 
-	accepted_socket_t socket = {0};
-	socket.addr = client_address;
-	socket.fd = client_socket_fd;
-	socket.success = client_socket_fd > 0;
+static server_worker_t *workers;
+static long worker_count;
+// blocked in every thread so only the stats thread takes it
+static sigset_t stats_signals;
+
+static server_worker_t *worker_of(reactor_t *r) { return r->ctx; }
+
+static bool read_room_id(packet_t *packet, uint32_t *room) {
+	if (packet->data_size != sizeof(uint32_t)) {
+		return false;
+	}
+	uint32_t network_room;
+	memcpy(&network_room, packet->data, sizeof(network_room));
+	*room = ntohl(network_room);
+	return true;
+}
 
-	if (!socket.success) {
-		socket.err = client_socket_fd;
+static void handle_join(reactor_t *r, connection_t *conn, packet_t *packet) {
+	uint32_t room;
+	if (!read_room_id(packet, &room)) {
+		return;
+	}
+	if (rooms_join(&worker_of(r)->rooms, conn, room) != PORTAL_OK) {
+		printf("Error: connection %u could not join room %u\n", conn->id,
+			   room);
 	}
+}
 
-	return socket;
+static void handle_leave(reactor_t *r, connection_t *conn, packet_t *packet) {
+	uint32_t room;
+	if (read_room_id(packet, &room)) {
+		rooms_leave(&worker_of(r)->rooms, conn, room);
+	}
 }
 
-static void *connection_thread_main(void *arg) {
-	int fd = *(int *)arg;
-	char buffer[1024];
-	while (true) {
-		packet_t recv_packet;
-		int rc = portal_recv_packet(fd, &recv_packet);
+static void run_fanout(reactor_t *r, reactor_task_t *task) {
+	fanout_task_t *fanout = (fanout_task_t *)task;
+	rooms_broadcast(&worker_of(r)->rooms, r, fanout->room, fanout->buf);
+	msgbuf_unref(fanout->buf);
+	portal_pool_free(fanout);
+}
 
-		if (rc == PORTAL_FAIL) {
-			break;
+static void handle_msg(reactor_t *r, connection_t *conn, packet_t *packet) {
+	if (packet->data_size < sizeof(portal_msg_prefix_t)) {
+		return;
+	}
+
+	portal_msg_prefix_t prefix;
+	memcpy(&prefix, packet->data, sizeof(prefix));
+	uint32_t room = ntohl(prefix.room);
+	if (!rooms_is_member(conn, room)) {
+		return;
+	}
+
+	// encode the outgoing frame once, every member shares this buffer
+	msgbuf_t *buf = msgbuf_create(PORTAL_OP_MSG, 0, packet->data_size);
+	if (buf == NULL) {
+		return;
+	}
+	// the account, not the connection, so the label survives reconnects
+	prefix.sender = htonl(conn->user_id);
+	memcpy(msgbuf_payload(buf), &prefix, sizeof(prefix));
+	memcpy(msgbuf_payload(buf) + sizeof(prefix),
+		   (unsigned char *)packet->data + sizeof(prefix),
+		   packet->data_size - sizeof(prefix));
+
+#ifdef DEBUG
+	portal_handle_msg(packet);
+#endif
+
+	history_append(room, buf);
+
+	// members on other reactors get the same buffer through their inbox,
+	// reactors without any in the room are not woken for it
+	uint64_t reactors[ROOMS_REACTOR_WORDS];
+	rooms_reactors(room, reactors);
+	for (long i = 0; i < worker_count; ++i) {
+		if (i == r->index || !(reactors[i / 64] & (1ull << (i % 64)))) {
+			continue;
+		}
+		fanout_task_t *fanout = portal_pool_alloc(sizeof(fanout_task_t));
+		if (fanout == NULL) {
+			continue;
+		}
+		fanout->task.run = run_fanout;
+		fanout->room = room;
+		fanout->buf = buf;
+		msgbuf_ref(buf);
+		reactor_post(&workers[i].reactor, &fanout->task);
+	}
+
+	rooms_broadcast(&worker_of(r)->rooms, r, room, buf);
+	msgbuf_unref(buf);
+}
+
+static bool send_history_reply(reactor_t *r, connection_t *conn,
+							   uint32_t room, uint64_t first_seq,
+							   uint32_t count) {
+	msgbuf_t *reply =
+		msgbuf_create(PORTAL_OP_HISTORY, 0, sizeof(portal_history_reply_t));
+	if (reply == NULL) {
+		return false;
+	}
+	portal_history_reply_t body = {
+		.room = htonl(room),
+		.first_seq = htobe64(first_seq),
+		.count = htonl(count),
+	};
+	memcpy(msgbuf_payload(reply), &body, sizeof(body));
+	return reactor_send_raw(r, conn, reply->frame, reply->size, msgbuf_unref,
+							reply) == PORTAL_OK;
+}
+
+// the frames go out straight from the segment mappings, the output queue
+// drops each piece's reference once the socket has taken it
+static void send_history(reactor_t *r, history_fetch_t *fetch) {
+	history_request_t *req = (history_request_t *)fetch;
+	// the client may be gone, or have left the room, by the time it is done
+	connection_t *conn =
+		reactor_find_connection(r, req->conn_id, req->conn_generation);
+	if (fetch->result == PORTAL_OK && conn != NULL &&
+		rooms_is_member(conn, fetch->room) &&
+		send_history_reply(r, conn, fetch->room, fetch->found_seq,
+						   fetch->found)) {
+		for (uint32_t i = 0; i < fetch->piece_count; ++i) {
+			history_piece_t *piece = &fetch->pieces[i];
+			reactor_send_raw(r, conn, piece->data, piece->size,
+							 history_map_unref, piece->map);
 		}
+		fetch->piece_count = 0;
+	}
+	history_fetch_release(fetch);
+	portal_pool_free(req);
+}
 
-		// TODO: make this a switch statement for all packet types
-		if (strcmp(recv_packet.header.type, "MSG") == 0) {
-			portal_handle_msg(&recv_packet);
+// active rooms answer from the recent message cache without leaving the
+// reactor, the same shared frames the members were sent live
+static bool send_recent(reactor_t *r, connection_t *conn, uint32_t room,
+						uint64_t first_seq, uint32_t count) {
+	msgbuf_t *bufs[HISTORY_MAX_FETCH];
+	recent_range_t range = {.bufs = bufs};
+	if (!recent_fetch(room, first_seq, count, HISTORY_MAX_FETCH,
+					  r->out_high_bytes, &range)) {
+		return false;
+	}
+
+	bool sent =
+		send_history_reply(r, conn, room, range.first_seq, range.count);
+	for (uint32_t i = 0; i < range.count; ++i) {
+		if (sent) {
+			reactor_send_raw(r, conn, bufs[i]->frame, bufs[i]->size,
+							 msgbuf_unref, bufs[i]);
+		} else {
+			msgbuf_unref(bufs[i]);
 		}
+	}
+	return true;
+}
+
+static void handle_history(reactor_t *r, connection_t *conn,
+						   packet_t *packet) {
+	portal_history_request_t request;
+	if (packet->data_size != sizeof(request)) {
+		return;
+	}
+	memcpy(&request, packet->data, sizeof(request));
+	uint32_t room = ntohl(request.room);
+	if (!rooms_is_member(conn, room)) {
+		return;
+	}
+	uint64_t first_seq = be64toh(request.first_seq);
+	uint32_t count = ntohl(request.count);
+	if (send_recent(r, conn, room, first_seq, count)) {
+		return;
+	}
+
+	history_request_t *req = portal_pool_alloc(sizeof(history_request_t));
+	if (req == NULL) {
+		return;
+	}
+	memset(req, 0, sizeof(*req));
+	req->conn_id = conn->id;
+	req->conn_generation = conn->generation;
+	history_fetch_t *fetch = &req->fetch;
+	fetch->room = room;
+	fetch->first_seq = first_seq;
+	fetch->count = count;
+	// a reply never pushes the client past the point its reads pause at
+	fetch->max_bytes = r->out_high_bytes;
+	history_fetch(r, fetch, send_history);
+}
+
+static void handle_close(reactor_t *r, connection_t *conn) {
+	rooms_leave_all(&worker_of(r)->rooms, conn);
+}
+
+static const packet_handler_t packet_handlers[PORTAL_OP_COUNT] = {
+	[PORTAL_OP_MSG] = handle_msg,
+	[PORTAL_OP_JOIN] = handle_join,
+	[PORTAL_OP_LEAVE] = handle_leave,
+	[PORTAL_OP_HISTORY] = handle_history,
+	[PORTAL_OP_REGISTER] = login_handle_register,
+	[PORTAL_OP_LOGIN] = login_handle_login,
+	[PORTAL_OP_RESUME] = login_handle_resume,
+	[PORTAL_OP_LOGOUT] = login_handle_logout,
+};
+
+static void handle_packet(reactor_t *r, connection_t *conn, packet_t *packet) {
+	uint16_t opcode = packet->header.opcode;
+	if (opcode >= PORTAL_OP_COUNT || packet_handlers[opcode] == NULL) {
+		printf("Error: unknown opcode %u from connection %u\n", opcode,
+			   conn->id);
+		return;
+	}
+	packet_handlers[opcode](r, conn, packet);
+}
+
+// every idle client holds an fd so lift the soft limit as far as allowed
+static void raise_fd_limit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+		limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+// each reactor binds its own listener and the kernel spreads new
+// connections across them, so no accept lock is shared between threads
+static int create_listen_socket() {
+	int fd = createTCPIPv4Socket();
+	if (fd < 0) {
+		perror("Failed to create server socket");
+		return -1;
+	}
+
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+		perror("Failed to set SO_REUSEPORT");
+		close(fd);
+		return -1;
+	}
 
-		free(recv_packet.data);
+	struct sockaddr_in server_address = createIPv4Address("", SERVER_PORT);
+	if (bind(fd, (struct sockaddr *)&server_address, sizeof(server_address)) !=
+		0) {
+		perror("Failed to bind server socket");
+		close(fd);
+		return -1;
 	}
 
-	close(fd);
+	if (listen(fd, SOMAXCONN) != 0) {
+		perror("Failed to listen on server socket");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void *reactor_thread_main(void *arg) {
+	server_worker_t *worker = arg;
 
+	// keep each reactor on its own core so its connection table stays warm
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(worker->index % worker->cpu_count, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	reactor_run(&worker->reactor);
+	reactor_destroy(&worker->reactor);
+	rooms_destroy(&worker->rooms);
+	close(worker->listen_fd);
 	return NULL;
 }
 
-static void open_server_connections(int fd) {
-	while (true) {
-		accepted_socket_t client_socket = accept_connection(fd);
-		pthread_t id;
-		pthread_create(&id, NULL, connection_thread_main, &client_socket.fd);
+static void print_stats() {
+	for (long i = 0; i < worker_count; ++i) {
+		reactor_stats_t stats;
+		reactor_stats(&workers[i].reactor, &stats);
+		printf("reactor %ld: %" PRIu64 " frames queued, %" PRIu64
+			   " flushes, %" PRIu64 " read pauses, %" PRIu64
+			   " frames dropped, %" PRIu64 " evictions\n",
+			   i, stats.frames_queued, stats.flushes, stats.read_pauses,
+			   stats.frames_dropped, stats.evictions);
+	}
+
+	portal_pool_stats_t pool;
+	portal_pool_stats(&pool);
+	printf("buffer pools: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+		   " oversized, %" PRIu64 " remote frees, %" PRIu64 " trimmed\n",
+		   pool.hits, pool.misses, pool.oversized, pool.remote_frees,
+		   pool.trimmed);
+
+	uint64_t hits, misses;
+	user_cache_stats(&hits, &misses);
+	printf("user cache: %" PRIu64 " hits, %" PRIu64 " misses\n", hits,
+		   misses);
+	fflush(stdout);
+}
+
+// prints the counters each time the server is sent SIGUSR1
+static void *stats_thread_main(void *arg) {
+	(void)arg;
+	int sig;
+	while (sigwait(&stats_signals, &sig) == 0) {
+		print_stats();
 	}
+	return NULL;
 }
 
-int main() {
-	// create and bind server socket
-	int server_socket_fd = createTCPIPv4Socket();
-	struct sockaddr_in server_address = createIPv4Address("", 8675);
-	int bind_result = bind(server_socket_fd, (struct sockaddr *)&server_address,
-						   sizeof(server_address));
+static void print_usage(const char *name) {
+	printf("Usage: %s [-t reactor_threads] [-l flush_latency_ms] "
+		   "[-w output_limit_kib] [-d] [-u] [-b write_batch_rows] "
+		   "[-g group_commit_us] [-H history_dir] [-O history_open_rooms] "
+		   "[-r recent_per_room] [-m recent_budget_mib] [-a auth_workers] "
+		   "[-q auth_queue] [-s session_hours] [-T hash_passes] "
+		   "[-M hash_memory_mib] [-P hash_lanes] [-C calibrate_ms] "
+		   "[-U user_cache_entries]\n",
+		   name);
+	printf("  -w  queued output per client before it is treated as slow\n");
+	printf("  -d  drop the oldest queued frames of slow clients instead of "
+		   "disconnecting them\n");
+	printf("  -u  drive the reactors with io_uring instead of epoll\n");
+	printf("  -b  database writes committed together, 1 commits each alone\n");
+	printf("  -g  how long a write waits for others to share its commit\n");
+	printf("  -H  where room message history is kept\n");
+	printf("  -O  rooms whose history files stay open, each holds two fds "
+		   "and an 8 MiB mapping\n");
+	printf("  -r  newest messages of each room kept in memory, 0 for none\n");
+	printf("  -m  memory all rooms' recent messages may use together\n");
+	printf("  -a  passwords hashed at once, each one takes a full argon2 "
+		   "memory block\n");
+	printf("  -q  logins waiting for a hashing slot before new ones are "
+		   "refused\n");
+	printf("  -s  how long a session token lets a client back in without "
+		   "its password\n");
+	printf("  -T, -M, -P  argon2 cost of new password hashes, older hashes "
+		   "are redone at their next login\n");
+	printf("  -C  time hashes at startup and pick the costliest passes and "
+		   "memory that hash within this many ms\n");
+	printf("  -U  users kept in memory for lookups by id or name, 0 for "
+		   "none\n");
+	printf("Send SIGUSR1 to print the server's counters\n");
+}
+
+int main(int argc, char **argv) {
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_count < 1) {
+		cpu_count = 1;
+	}
+	long thread_count = cpu_count;
+	long flush_delay_ms = REACTOR_DEFAULT_FLUSH_DELAY_MS;
+	long out_max_kib = REACTOR_DEFAULT_OUT_MAX_BYTES / 1024;
+	reactor_slow_policy_t slow_policy = REACTOR_SLOW_EVICT;
+	reactor_backend_t backend = REACTOR_BACKEND_EPOLL;
+	long batch_max = DB_POOL_DEFAULT_BATCH_MAX;
+	long batch_window_us = DB_POOL_DEFAULT_BATCH_WINDOW_US;
+	const char *history_dir = HISTORY_DEFAULT_DIR;
+	long history_open_rooms = HISTORY_DEFAULT_OPEN_ROOMS;
+	long recent_per_room = RECENT_DEFAULT_PER_ROOM;
+	long recent_budget_mib = RECENT_DEFAULT_BUDGET_BYTES / (1024 * 1024);
+	long auth_workers = AUTH_POOL_DEFAULT_WORKERS;
+	long auth_queue = AUTH_POOL_DEFAULT_QUEUE;
+	long session_hours = SESSION_DEFAULT_TTL_S / 3600;
+	crypto_profile_t hash_profile = *crypto_profile();
+	long calibrate_ms = 0;
+	long user_cache_entries = USER_CACHE_DEFAULT_ENTRIES;
+
+	int opt;
+	while ((opt = getopt(argc, argv,
+						 "t:l:w:dub:g:H:O:r:m:a:q:s:T:M:P:C:U:h")) != -1) {
+		switch (opt) {
+		case 't':
+			thread_count = strtol(optarg, NULL, 10);
+			if (thread_count < 1 || thread_count > MAX_REACTORS) {
+				printf("Error: reactor threads must be between 1 and %d\n",
+					   MAX_REACTORS);
+				return 1;
+			}
+			break;
+		case 'l':
+			flush_delay_ms = strtol(optarg, NULL, 10);
+			if (flush_delay_ms < 0 || flush_delay_ms > 1000) {
+				printf("Error: flush latency must be between 0 and 1000 ms\n");
+				return 1;
+			}
+			break;
+		case 'w':
+			out_max_kib = strtol(optarg, NULL, 10);
+			if (out_max_kib < 64 || out_max_kib > 1024 * 1024) {
+				printf("Error: output limit must be between 64 and %d KiB\n",
+					   1024 * 1024);
+				return 1;
+			}
+			break;
+		case 'd':
+			slow_policy = REACTOR_SLOW_DROP_OLDEST;
+			break;
+		case 'u':
+#ifdef PORTAL_IO_URING
+			backend = REACTOR_BACKEND_URING;
+			break;
+#else
+			printf("Error: built without io_uring support\n");
+			return 1;
+#endif
+		case 'b':
+			batch_max = strtol(optarg, NULL, 10);
+			if (batch_max < 1 || batch_max > 65536) {
+				printf("Error: write batch must be between 1 and 65536 rows\n");
+				return 1;
+			}
+			break;
+		case 'g':
+			batch_window_us = strtol(optarg, NULL, 10);
+			if (batch_window_us < 0 || batch_window_us > 1000000) {
+				printf("Error: group commit window must be between 0 and "
+					   "1000000 us\n");
+				return 1;
+			}
+			break;
+		case 'H':
+			history_dir = optarg;
+			break;
+		case 'O':
+			history_open_rooms = strtol(optarg, NULL, 10);
+			if (history_open_rooms < 1 || history_open_rooms > 65536) {
+				printf("Error: open history rooms must be between 1 and "
+					   "65536\n");
+				return 1;
+			}
+			break;
+		case 'r':
+			recent_per_room = strtol(optarg, NULL, 10);
+			if (recent_per_room < 0 || recent_per_room > 65536) {
+				printf("Error: recent messages per room must be between 0 and "
+					   "65536\n");
+				return 1;
+			}
+			break;
+		case 'm':
+			recent_budget_mib = strtol(optarg, NULL, 10);
+			if (recent_budget_mib < 1 || recent_budget_mib > 1024 * 1024) {
+				printf("Error: recent message budget must be between 1 and "
+					   "%d MiB\n",
+					   1024 * 1024);
+				return 1;
+			}
+			break;
+		case 'a':
+			auth_workers = strtol(optarg, NULL, 10);
+			if (auth_workers < 1 || auth_workers > 256) {
+				printf("Error: auth workers must be between 1 and 256\n");
+				return 1;
+			}
+			break;
+		case 'q':
+			auth_queue = strtol(optarg, NULL, 10);
+			if (auth_queue < 1 || auth_queue > 65536) {
+				printf("Error: auth queue must be between 1 and 65536\n");
+				return 1;
+			}
+			break;
+		case 's':
+			session_hours = strtol(optarg, NULL, 10);
+			if (session_hours < 1 || session_hours > 24 * 365) {
+				printf("Error: session lifetime must be between 1 and %d "
+					   "hours\n",
+					   24 * 365);
+				return 1;
+			}
+			break;
+		case 'T': {
+			long passes = strtol(optarg, NULL, 10);
+			if (passes < 1 || passes > CRYPTO_MAX_T_COST) {
+				printf("Error: hash passes must be between 1 and %d\n",
+					   CRYPTO_MAX_T_COST);
+				return 1;
+			}
+			hash_profile.t_cost = passes;
+			break;
+		}
+		case 'M': {
+			long memory_mib = strtol(optarg, NULL, 10);
+			if (memory_mib < CRYPTO_MIN_M_COST_KIB / 1024 ||
+				memory_mib > 4096) {
+				printf("Error: hash memory must be between %d and 4096 MiB\n",
+					   CRYPTO_MIN_M_COST_KIB / 1024);
+				return 1;
+			}
+			hash_profile.m_cost_kib = memory_mib * 1024;
+			break;
+		}
+		case 'P': {
+			long lanes = strtol(optarg, NULL, 10);
+			if (lanes < 1 || lanes > 64) {
+				printf("Error: hash lanes must be between 1 and 64\n");
+				return 1;
+			}
+			hash_profile.parallelism = lanes;
+			break;
+		}
+		case 'C':
+			calibrate_ms = strtol(optarg, NULL, 10);
+			if (calibrate_ms < 1 || calibrate_ms > 10000) {
+				printf("Error: calibration target must be between 1 and "
+					   "10000 ms\n");
+				return 1;
+			}
+			break;
+		case 'U':
+			user_cache_entries = strtol(optarg, NULL, 10);
+			if (user_cache_entries < 0 || user_cache_entries > 1 << 24) {
+				printf("Error: user cache entries must be between 0 and %d\n",
+					   1 << 24);
+				return 1;
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	// block before any thread starts so they all inherit the mask
+	sigemptyset(&stats_signals);
+	sigaddset(&stats_signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+
+	// calibrating runs before anything else so nothing competes with it
+	if (calibrate_ms > 0 &&
+		crypto_calibrate(calibrate_ms, &hash_profile) != PORTAL_OK) {
+		return 1;
+	}
+	crypto_set_profile(&hash_profile);
+	printf("Hashing passwords with t=%u m=%u KiB p=%u\n", hash_profile.t_cost,
+		   hash_profile.m_cost_kib, hash_profile.parallelism);
+
+	raise_fd_limit();
+
+	workers = calloc(thread_count, sizeof(server_worker_t));
+	if (workers == NULL) {
+		perror("Failed to allocate reactors");
+		return 1;
+	}
+	worker_count = thread_count;
+
+	for (long i = 0; i < thread_count; ++i) {
+		workers[i].index = i;
+		workers[i].cpu_count = cpu_count;
+		workers[i].listen_fd = create_listen_socket();
+		if (workers[i].listen_fd < 0) {
+			return 1;
+		}
+		if (reactor_init(&workers[i].reactor, i, workers[i].listen_fd,
+						 handle_packet) != PORTAL_OK ||
+			rooms_init(&workers[i].rooms, i) != PORTAL_OK) {
+			return 1;
+		}
+		workers[i].reactor.on_close = handle_close;
+		workers[i].reactor.flush_delay_ms = flush_delay_ms;
+		// reads pause at a quarter of the limit and resume at a sixteenth
+		workers[i].reactor.out_max_bytes = out_max_kib * 1024;
+		workers[i].reactor.out_high_bytes = out_max_kib * 1024 / 4;
+		workers[i].reactor.out_low_bytes = out_max_kib * 1024 / 16;
+		workers[i].reactor.slow_policy = slow_policy;
+		workers[i].reactor.backend = backend;
+		workers[i].reactor.ctx = &workers[i];
+	}
+	printf("Server listening on 0.0.0.0:%d with %ld %s reactor threads\n",
+		   SERVER_PORT, thread_count,
+		   backend == REACTOR_BACKEND_URING ? "io_uring" : "epoll");
 
-	char ip_str[INET_ADDRSTRLEN];
-	if (inet_ntop(AF_INET, (void *)&(server_address.sin_addr), ip_str,
-				  sizeof(ip_str)) == NULL) {
-		printf("Error in inet_ntop");
+	db_pool_set_batching(batch_max, batch_window_us);
+	if (user_cache_init(user_cache_entries) != PORTAL_OK ||
+		db_pool_start("users.db", DB_POOL_DEFAULT_READERS, users_db_setup) !=
+			SQLITE_OK) {
+		return 1;
+	}
+	if (recent_init(recent_per_room, recent_budget_mib * 1024 * 1024) !=
+			PORTAL_OK ||
+		history_start(history_dir, history_open_rooms) != PORTAL_OK ||
+		auth_pool_start(auth_workers, auth_queue, AUTH_RATE_DEFAULT_BURST,
+						AUTH_RATE_DEFAULT_PER_MIN) != PORTAL_OK ||
+		session_start(SESSION_DEFAULT_KEY_PATH, session_hours * 3600) !=
+			PORTAL_OK) {
 		return 1;
 	}
 
-	if (bind_result == 0) {
-		printf("Server socket bound successfully at: %s:8675\n", ip_str);
+	pthread_t stats_thread;
+	if (pthread_create(&stats_thread, NULL, stats_thread_main, NULL) != 0) {
+		perror("Failed to start stats thread");
+		return 1;
 	}
-	int listen_result = listen(server_socket_fd, 10);
+	pthread_detach(stats_thread);
 
-	open_database_thread();
-	open_server_connections(server_socket_fd);
+	// the main thread drives the first reactor itself
+	for (long i = 1; i < thread_count; ++i) {
+		pthread_create(&workers[i].thread, NULL, reactor_thread_main,
+					   &workers[i]);
+	}
+	reactor_thread_main(&workers[0]);
 
-	shutdown(server_socket_fd, SHUT_RDWR);
+	for (long i = 1; i < thread_count; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	free(workers);
 	return 0;
 }
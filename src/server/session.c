@@ -0,0 +1,232 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "session.h"
+#include "sha256.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+// a revoked token id and when it would have expired anyway, id 0 marks an
+// empty slot
+typedef struct {
+	uint64_t token_id;
+	uint64_t expires;
+} session_revoked_t;
+
+static unsigned char session_key[SESSION_KEY_SIZE];
+static uint32_t session_ttl_s;
+
+// open addressed, every resume reads it and only logouts write
+static pthread_rwlock_t session_lock = PTHREAD_RWLOCK_INITIALIZER;
+static session_revoked_t *session_revoked;
+static uint32_t session_revoked_slots;
+static uint32_t session_revoked_count;
+
+#define SESSION_SIGNED_SIZE offsetof(portal_session_token_t, mac)
+
+static int fill_random(void *buf, size_t len) {
+	unsigned char *bytes = buf;
+	while (len > 0) {
+		ssize_t n = getrandom(bytes, len, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return PORTAL_FAIL;
+		}
+		bytes += n;
+		len -= n;
+	}
+	return PORTAL_OK;
+}
+
+static int load_key(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		ssize_t n = read(fd, session_key, sizeof(session_key));
+		close(fd);
+		if (n != sizeof(session_key)) {
+			printf("Error: session key %s is damaged\n", path);
+			return PORTAL_FAIL;
+		}
+		return PORTAL_OK;
+	}
+	if (errno != ENOENT) {
+		perror("Failed to open session key");
+		return PORTAL_FAIL;
+	}
+
+	if (fill_random(session_key, sizeof(session_key)) != PORTAL_OK) {
+		perror("Failed to generate session key");
+		return PORTAL_FAIL;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 ||
+		write(fd, session_key, sizeof(session_key)) != sizeof(session_key)) {
+		perror("Failed to save session key");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return PORTAL_FAIL;
+	}
+	close(fd);
+	return PORTAL_OK;
+}
+
+int session_start(const char *key_path, uint32_t ttl_s) {
+	session_ttl_s = ttl_s;
+	session_revoked =
+		calloc(SESSION_REVOKED_INIT_SLOTS, sizeof(session_revoked_t));
+	if (session_revoked == NULL) {
+		perror("Failed to allocate session revocations");
+		return PORTAL_FAIL;
+	}
+	session_revoked_slots = SESSION_REVOKED_INIT_SLOTS;
+	return load_key(key_path);
+}
+
+static uint64_t now_s() { return (uint64_t)time(NULL); }
+
+static void sign(const portal_session_token_t *token,
+				 uint8_t mac[PORTAL_SESSION_MAC_SIZE]) {
+	hmac_sha256(session_key, sizeof(session_key), token, SESSION_SIGNED_SIZE,
+				mac);
+}
+
+int session_issue(uint32_t user_id, portal_session_token_t *token) {
+	uint64_t token_id;
+	do {
+		if (fill_random(&token_id, sizeof(token_id)) != PORTAL_OK) {
+			return PORTAL_FAIL;
+		}
+	} while (token_id == 0);
+
+	token->user_id = htonl(user_id);
+	token->expires = htobe64(now_s() + session_ttl_s);
+	token->token_id = token_id;
+	sign(token, token->mac);
+	return PORTAL_OK;
+}
+
+static uint32_t slot_of(uint64_t token_id, uint32_t slots) {
+	// token ids are random already, so the low bits spread fine
+	return token_id & (slots - 1);
+}
+
+static bool is_revoked(uint64_t token_id) {
+	uint32_t i = slot_of(token_id, session_revoked_slots);
+	while (session_revoked[i].token_id != 0) {
+		if (session_revoked[i].token_id == token_id) {
+			return true;
+		}
+		i = (i + 1) & (session_revoked_slots - 1);
+	}
+	return false;
+}
+
+int session_verify(const portal_session_token_t *token, uint32_t *user_id) {
+	uint8_t mac[PORTAL_SESSION_MAC_SIZE];
+	sign(token, mac);
+	// compare every byte so timing says nothing about where it differs
+	uint8_t diff = 0;
+	for (size_t i = 0; i < sizeof(mac); ++i) {
+		diff |= mac[i] ^ token->mac[i];
+	}
+	if (diff != 0 || be64toh(token->expires) <= now_s()) {
+		return PORTAL_FAIL;
+	}
+
+	pthread_rwlock_rdlock(&session_lock);
+	bool revoked = is_revoked(token->token_id);
+	pthread_rwlock_unlock(&session_lock);
+	if (revoked) {
+		return PORTAL_FAIL;
+	}
+	*user_id = ntohl(token->user_id);
+	return PORTAL_OK;
+}
+
+static void insert(session_revoked_t *table, uint32_t slots,
+				   session_revoked_t entry) {
+	uint32_t i = slot_of(entry.token_id, slots);
+	while (table[i].token_id != 0 && table[i].token_id != entry.token_id) {
+		i = (i + 1) & (slots - 1);
+	}
+	table[i] = entry;
+}
+
+// drops revocations of tokens that have expired since, growing the table
+// if it is still half full after that
+static void rebuild(uint64_t now) {
+	uint32_t live = 0;
+	for (uint32_t i = 0; i < session_revoked_slots; ++i) {
+		if (session_revoked[i].token_id != 0 &&
+			session_revoked[i].expires > now) {
+			live++;
+		}
+	}
+	uint32_t slots = session_revoked_slots;
+	while (live * 2 >= slots / 2) {
+		slots *= 2;
+	}
+	session_revoked_t *table = calloc(slots, sizeof(session_revoked_t));
+	if (table == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < session_revoked_slots; ++i) {
+		if (session_revoked[i].token_id != 0 &&
+			session_revoked[i].expires > now) {
+			insert(table, slots, session_revoked[i]);
+		}
+	}
+	free(session_revoked);
+	session_revoked = table;
+	session_revoked_slots = slots;
+	session_revoked_count = live;
+}
+
+void session_revoke(const portal_session_token_t *token) {
+	uint32_t user_id;
+	if (session_verify(token, &user_id) != PORTAL_OK) {
+		return;
+	}
+
+	uint64_t now = now_s();
+	pthread_rwlock_wrlock(&session_lock);
+	if ((session_revoked_count + 1) * 2 > session_revoked_slots) {
+		rebuild(now);
+	}
+	// a table that could not grow still has a free slot until it is full
+	if (session_revoked_count + 1 < session_revoked_slots) {
+		insert(session_revoked, session_revoked_slots,
+			   (session_revoked_t){.token_id = token->token_id,
+								   .expires = be64toh(token->expires)});
+		session_revoked_count++;
+	}
+	pthread_rwlock_unlock(&session_lock);
+}
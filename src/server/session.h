@@ -0,0 +1,44 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "socket_util.h"
+#include <stdint.h>
+
+// the signing key lives on disk so tokens outlast a restart
+#define SESSION_DEFAULT_KEY_PATH "session.key"
+#define SESSION_KEY_SIZE 32
+#define SESSION_DEFAULT_TTL_S (7 * 24 * 60 * 60)
+#define SESSION_REVOKED_INIT_SLOTS 1024
+
+// loads the signing key, creating it on first start
+int session_start(const char *key_path, uint32_t ttl_s);
+
+// signs a fresh token for the user, thread safe
+int session_issue(uint32_t user_id, portal_session_token_t *token);
+
+// thread safe and cheap enough for the reactor, a single hmac and a lookup.
+// PORTAL_OK and the user id when the token is genuine, unexpired and has
+// not been revoked
+int session_verify(const portal_session_token_t *token, uint32_t *user_id);
+
+// thread safe. only genuine tokens are remembered, each until it expires
+void session_revoke(const portal_session_token_t *token);
+
+#endif // SESSION_H
@@ -0,0 +1,236 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#define _GNU_SOURCE
+#include "user_cache.h"
+#include "socket_util.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ENTRY UINT32_MAX
+
+// entries live in one array and are chained into both indexes by position
+typedef struct {
+	user_t user;
+	uint32_t name_hash;
+	uint32_t id_next, name_next;
+	// set by lookups under the read lock, cleared by the clock hand
+	atomic_bool referenced;
+} user_cache_entry_t;
+
+// lookups share the lock, only puts and invalidations take it exclusively
+static pthread_rwlock_t user_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static user_cache_entry_t *user_cache_entries;
+static uint32_t user_cache_capacity;
+static uint32_t *user_cache_by_id, *user_cache_by_name;
+static uint32_t user_cache_bucket_count;
+static uint32_t user_cache_free;
+static uint32_t user_cache_hand;
+static atomic_uint_fast64_t user_cache_epoch_now;
+static atomic_uint_fast64_t user_cache_hits, user_cache_misses;
+
+static uint32_t id_bucket(uint32_t id) {
+	// fibonacci hashing spreads sequential ids across buckets
+	return (id * 2654435769u) & (user_cache_bucket_count - 1);
+}
+
+static uint32_t hash_name(const unsigned char *name) {
+	// fnv-1a
+	uint32_t hash = 2166136261u;
+	for (; *name != 0; ++name) {
+		hash = (hash ^ *name) * 16777619u;
+	}
+	return hash;
+}
+
+int user_cache_init(uint32_t entries) {
+	user_cache_capacity = entries;
+	if (entries == 0) {
+		return PORTAL_OK;
+	}
+	user_cache_bucket_count = 1;
+	while (user_cache_bucket_count < entries) {
+		user_cache_bucket_count <<= 1;
+	}
+	user_cache_entries = calloc(entries, sizeof(user_cache_entry_t));
+	user_cache_by_id = malloc(user_cache_bucket_count * sizeof(uint32_t));
+	user_cache_by_name = malloc(user_cache_bucket_count * sizeof(uint32_t));
+	if (user_cache_entries == NULL || user_cache_by_id == NULL ||
+		user_cache_by_name == NULL) {
+		perror("Failed to allocate user cache");
+		return PORTAL_FAIL;
+	}
+	for (uint32_t i = 0; i < user_cache_bucket_count; ++i) {
+		user_cache_by_id[i] = NO_ENTRY;
+		user_cache_by_name[i] = NO_ENTRY;
+	}
+	// unused entries are chained through id_next
+	for (uint32_t i = 0; i < entries; ++i) {
+		user_cache_entries[i].id_next = i + 1 < entries ? i + 1 : NO_ENTRY;
+		atomic_init(&user_cache_entries[i].referenced, false);
+	}
+	user_cache_free = 0;
+	return PORTAL_OK;
+}
+
+static uint32_t lookup_id(uint32_t id) {
+	uint32_t i = user_cache_by_id[id_bucket(id)];
+	while (i != NO_ENTRY && user_cache_entries[i].user.id != id) {
+		i = user_cache_entries[i].id_next;
+	}
+	return i;
+}
+
+static uint32_t lookup_name(const unsigned char *username, uint32_t hash) {
+	uint32_t i = user_cache_by_name[hash & (user_cache_bucket_count - 1)];
+	while (i != NO_ENTRY &&
+		   (user_cache_entries[i].name_hash != hash ||
+			strcmp((const char *)user_cache_entries[i].user.username,
+				   (const char *)username) != 0)) {
+		i = user_cache_entries[i].name_next;
+	}
+	return i;
+}
+
+// copies a hit out while the read lock keeps it from being replaced
+static bool take_hit(uint32_t i, user_t *out) {
+	if (i == NO_ENTRY) {
+		atomic_fetch_add_explicit(&user_cache_misses, 1,
+								  memory_order_relaxed);
+		return false;
+	}
+	atomic_store_explicit(&user_cache_entries[i].referenced, true,
+						  memory_order_relaxed);
+	*out = user_cache_entries[i].user;
+	atomic_fetch_add_explicit(&user_cache_hits, 1, memory_order_relaxed);
+	return true;
+}
+
+bool user_cache_get(uint32_t id, user_t *out) {
+	if (user_cache_capacity == 0) {
+		return false;
+	}
+	pthread_rwlock_rdlock(&user_cache_lock);
+	bool hit = take_hit(lookup_id(id), out);
+	pthread_rwlock_unlock(&user_cache_lock);
+	return hit;
+}
+
+bool user_cache_find(const unsigned char *username, user_t *out) {
+	if (user_cache_capacity == 0) {
+		return false;
+	}
+	uint32_t hash = hash_name(username);
+	pthread_rwlock_rdlock(&user_cache_lock);
+	bool hit = take_hit(lookup_name(username, hash), out);
+	pthread_rwlock_unlock(&user_cache_lock);
+	return hit;
+}
+
+uint64_t user_cache_epoch() {
+	return atomic_load_explicit(&user_cache_epoch_now, memory_order_acquire);
+}
+
+static void unlink_chain(uint32_t *head, uint32_t i, bool by_id) {
+	uint32_t *link = head;
+	while (*link != i) {
+		user_cache_entry_t *entry = &user_cache_entries[*link];
+		link = by_id ? &entry->id_next : &entry->name_next;
+	}
+	*link = by_id ? user_cache_entries[i].id_next
+				  : user_cache_entries[i].name_next;
+}
+
+static void remove_entry(uint32_t i) {
+	user_cache_entry_t *entry = &user_cache_entries[i];
+	unlink_chain(&user_cache_by_id[id_bucket(entry->user.id)], i, true);
+	unlink_chain(
+		&user_cache_by_name[entry->name_hash & (user_cache_bucket_count - 1)],
+		i, false);
+	explicit_bzero(&entry->user, sizeof(entry->user));
+	entry->id_next = user_cache_free;
+	user_cache_free = i;
+}
+
+// a free entry, or the first one the clock hand finds unreferenced since
+// its last pass
+static uint32_t claim_entry() {
+	if (user_cache_free != NO_ENTRY) {
+		uint32_t i = user_cache_free;
+		user_cache_free = user_cache_entries[i].id_next;
+		return i;
+	}
+	while (true) {
+		uint32_t i = user_cache_hand;
+		user_cache_hand = (user_cache_hand + 1) % user_cache_capacity;
+		if (!atomic_exchange_explicit(&user_cache_entries[i].referenced, false,
+									  memory_order_relaxed)) {
+			remove_entry(i);
+			user_cache_free = user_cache_entries[i].id_next;
+			return i;
+		}
+	}
+}
+
+void user_cache_put(const user_t *user, uint64_t epoch) {
+	if (user_cache_capacity == 0) {
+		return;
+	}
+	uint32_t hash = hash_name(user->username);
+	pthread_rwlock_wrlock(&user_cache_lock);
+	// the row may already be stale if a write got in after the read began
+	if (epoch != atomic_load_explicit(&user_cache_epoch_now,
+									  memory_order_relaxed) ||
+		lookup_id(user->id) != NO_ENTRY) {
+		pthread_rwlock_unlock(&user_cache_lock);
+		return;
+	}
+	uint32_t i = claim_entry();
+	user_cache_entry_t *entry = &user_cache_entries[i];
+	entry->user = *user;
+	entry->name_hash = hash;
+	atomic_store_explicit(&entry->referenced, false, memory_order_relaxed);
+	uint32_t *id_head = &user_cache_by_id[id_bucket(user->id)];
+	entry->id_next = *id_head;
+	*id_head = i;
+	uint32_t *name_head =
+		&user_cache_by_name[hash & (user_cache_bucket_count - 1)];
+	entry->name_next = *name_head;
+	*name_head = i;
+	pthread_rwlock_unlock(&user_cache_lock);
+}
+
+void user_cache_invalidate(uint32_t id) {
+	if (user_cache_capacity == 0) {
+		return;
+	}
+	pthread_rwlock_wrlock(&user_cache_lock);
+	atomic_fetch_add_explicit(&user_cache_epoch_now, 1, memory_order_release);
+	uint32_t i = lookup_id(id);
+	if (i != NO_ENTRY) {
+		remove_entry(i);
+	}
+	pthread_rwlock_unlock(&user_cache_lock);
+}
+
+void user_cache_stats(uint64_t *hits, uint64_t *misses) {
+	*hits = atomic_load_explicit(&user_cache_hits, memory_order_relaxed);
+	*misses = atomic_load_explicit(&user_cache_misses, memory_order_relaxed);
+}
@@ -0,0 +1,50 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include "users_db.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define USER_CACHE_DEFAULT_ENTRIES 16384
+
+// user rows indexed by id and by username, so resolving a user on the hot
+// path is a hash lookup instead of a database round trip. filled lazily by
+// the reads that miss, full entries are evicted by a clock sweep
+
+// call before the database pool starts, 0 entries turns the cache off
+int user_cache_init(uint32_t entries);
+
+// thread safe. copy the cached user into out, true on a hit
+bool user_cache_get(uint32_t id, user_t *out);
+bool user_cache_find(const unsigned char *username, user_t *out);
+
+// thread safe. a read takes the epoch before it queries and hands it to
+// put, which drops the row if a write invalidated anything in between
+uint64_t user_cache_epoch();
+void user_cache_put(const user_t *user, uint64_t epoch);
+
+// thread safe. forgets the user, call it both before a write to the row
+// and after it commits so no read in flight can cache the old one
+void user_cache_invalidate(uint32_t id);
+
+// thread safe. lookups answered from memory and ones that were not
+void user_cache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif // USER_CACHE_H
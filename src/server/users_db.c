@@ -16,11 +16,13 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
 #include "users_db.h"
-#include <pthread.h>
+#include "user_cache.h"
+#include <stddef.h>
 #include <sqlite3.h>
 #include <stdio.h>
+#include <string.h>
 
-static int create_user_table(sqlite3 *db) {
+int users_db_setup(sqlite3 *db) {
 	const char *sql = "CREATE TABLE IF NOT EXISTS users ("
 					  "id INTEGER PRIMARY KEY AUTOINCREMENT,"
 					  "email TEXT NOT NULL UNIQUE,"
@@ -38,77 +40,109 @@ static int create_user_table(sqlite3 *db) {
 	return SQLITE_OK;
 }
 
-static int create_user(sqlite3 *db, user_t *usr) {
-	sqlite3_stmt *stmt;
-	const char *sql =
-		"INSERT INTO users (email, username, password) VALUES (?, ?, ?);";
+// slots in each connection's statement cache
+enum {
+	STMT_CREATE_USER,
+	STMT_READ_USER,
+	STMT_UPDATE_USER,
+	STMT_DELETE_USER,
+	STMT_FIND_USER,
+};
 
-	int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		printf("Error preparing add user statement: %s\n", sqlite3_errmsg(db));
-		return rc;
+static int create_user(db_conn_t *conn, user_t *usr) {
+	sqlite3_stmt *stmt = db_statement(
+		conn, STMT_CREATE_USER,
+		"INSERT INTO users (email, username, password) VALUES (?, ?, ?);");
+	if (stmt == NULL) {
+		return SQLITE_ERROR;
 	}
 
 	sqlite3_bind_text(stmt, 1, (const char *)usr->email, -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt, 2, (const char *)usr->username, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 3, (const char *)usr->username, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, (const char *)usr->psswd_hash, -1,
+					  SQLITE_STATIC);
 
-	rc = sqlite3_step(stmt);
+	int rc = sqlite3_step(stmt);
 	if (rc != SQLITE_DONE) {
 		printf("Error execution of add user statement failed: %s\n",
-			   sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
-		return rc;
+			   sqlite3_errmsg(conn->db));
+	} else {
+		usr->id = sqlite3_last_insert_rowid(conn->db);
 	}
 
-	usr->id = sqlite3_last_insert_rowid(db);
+	db_release(stmt);
+	return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
 
-	sqlite3_finalize(stmt);
-	return SQLITE_OK;
+// copies the row a user query stepped onto, column text dies with the
+// statement
+static void copy_user_row(sqlite3_stmt *stmt, user_t *usr) {
+	usr->id = sqlite3_column_int(stmt, 0);
+	snprintf((char *)usr->email, sizeof(usr->email), "%s",
+			 sqlite3_column_text(stmt, 1));
+	snprintf((char *)usr->username, sizeof(usr->username), "%s",
+			 sqlite3_column_text(stmt, 2));
+	snprintf((char *)usr->psswd_hash, sizeof(usr->psswd_hash), "%s",
+			 sqlite3_column_text(stmt, 3));
 }
 
 // the user_t should be empty to recieve data
-static int read_user(sqlite3 *db, user_t *usr, const int id) {
-	sqlite3_stmt *stmt;
-	const char *sql =
-		"SELECT id, email, username, password FROM users WHERE id = ?;";
-
-	int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		printf("Error preparing read user statement: %s\n", sqlite3_errmsg(db));
-		return rc;
+static int read_user(db_conn_t *conn, user_t *usr, const int id) {
+	sqlite3_stmt *stmt = db_statement(
+		conn, STMT_READ_USER,
+		"SELECT id, email, username, password FROM users WHERE id = ?;");
+	if (stmt == NULL) {
+		return SQLITE_ERROR;
 	}
 
 	// sets id for query based on function parameter
 	sqlite3_bind_int(stmt, 1, id);
 
-	rc = sqlite3_step(stmt);
+	int rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
-		usr->id = sqlite3_column_int(stmt, 0);
-		usr->email = sqlite3_column_text(stmt, 1);
-		usr->username = sqlite3_column_text(stmt, 2);
+		copy_user_row(stmt, usr);
 	} else if (rc == SQLITE_DONE) {
 		printf("No user found with id: %d\n", id);
 	} else {
 		printf("Error execution of read user statement failed: %s\n",
-			   sqlite3_errmsg(db));
+			   sqlite3_errmsg(conn->db));
 	}
 
-	sqlite3_finalize(stmt);
+	db_release(stmt);
 	return rc;
 }
 
-// the usr coming in should have the data to be updated
-static int update_user(sqlite3 *db, user_t *usr) {
-	sqlite3_stmt *stmt;
-	const char *sql =
-		"UPDATE users SET email = ?, username = ?, password = ? WHERE id = ?;";
+// fills in the rest of usr from its username
+static int find_user(db_conn_t *conn, user_t *usr) {
+	sqlite3_stmt *stmt = db_statement(
+		conn, STMT_FIND_USER,
+		"SELECT id, email, username, password FROM users WHERE username = ?;");
+	if (stmt == NULL) {
+		return SQLITE_ERROR;
+	}
 
-	int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		printf("Error preparing update user statement: %s\n",
-			   sqlite3_errmsg(db));
-		return rc;
+	sqlite3_bind_text(stmt, 1, (const char *)usr->username, -1,
+					  SQLITE_TRANSIENT);
+
+	int rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) {
+		copy_user_row(stmt, usr);
+	} else if (rc != SQLITE_DONE) {
+		printf("Error execution of find user statement failed: %s\n",
+			   sqlite3_errmsg(conn->db));
+	}
+
+	db_release(stmt);
+	return rc;
+}
+
+// the usr coming in should have the data to be updated
+static int update_user(db_conn_t *conn, user_t *usr) {
+	sqlite3_stmt *stmt = db_statement(
+		conn, STMT_UPDATE_USER,
+		"UPDATE users SET email = ?, username = ?, password = ? WHERE id = ?;");
+	if (stmt == NULL) {
+		return SQLITE_ERROR;
 	}
 
 	sqlite3_bind_text(stmt, 1, (const char *)usr->email, -1, SQLITE_STATIC);
@@ -117,55 +151,117 @@ static int update_user(sqlite3 *db, user_t *usr) {
 					  SQLITE_STATIC);
 	sqlite3_bind_int(stmt, 4, usr->id);
 
-	rc = sqlite3_step(stmt);
+	int rc = sqlite3_step(stmt);
 	if (rc != SQLITE_DONE) {
 		printf("Error execution of update user statement failed: %s\n",
-			   sqlite3_errmsg(db));
+			   sqlite3_errmsg(conn->db));
 	}
 
-	sqlite3_finalize(stmt);
+	db_release(stmt);
 	return rc;
 }
 
-static int delete_user(sqlite3 *db, const int id) {
-	sqlite3_stmt *stmt;
-	const char *sql = "DELETE FROM users WHERE id = ?;";
-
-	int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		printf("Error preparing delete user statement: %s\n",
-			   sqlite3_errmsg(db));
-		return rc;
+static int delete_user(db_conn_t *conn, const int id) {
+	sqlite3_stmt *stmt = db_statement(conn, STMT_DELETE_USER,
+									  "DELETE FROM users WHERE id = ?;");
+	if (stmt == NULL) {
+		return SQLITE_ERROR;
 	}
 
 	sqlite3_bind_int(stmt, 1, id);
 
-	rc = sqlite3_step(stmt);
+	int rc = sqlite3_step(stmt);
 	if (rc != SQLITE_DONE) {
 		printf("Error execution of delete user statement failed: %s\n",
-			   sqlite3_errmsg(db));
+			   sqlite3_errmsg(conn->db));
 	}
 
-	sqlite3_finalize(stmt);
+	db_release(stmt);
 	return rc;
 }
 
-static void *database_thread_main(void *arg) {
-	sqlite3 *users_db;
-	int exit = 0;
-	exit = sqlite3_open("users.db", &users_db);
+static int run_user_job(db_conn_t *conn, db_job_t *job) {
+	user_job_t *user_job = (user_job_t *)job;
+	user_t *usr = &user_job->user;
+	int rc = SQLITE_MISUSE;
+	switch (user_job->op) {
+	case USER_OP_CREATE:
+		rc = create_user(conn, usr);
+		break;
+	case USER_OP_READ:
+	case USER_OP_FIND: {
+		uint64_t epoch = user_cache_epoch();
+		rc = user_job->op == USER_OP_READ ? read_user(conn, usr, usr->id)
+										  : find_user(conn, usr);
+		if (rc == SQLITE_ROW) {
+			user_cache_put(usr, epoch);
+			rc = SQLITE_OK;
+		} else if (rc == SQLITE_DONE) {
+			rc = SQLITE_NOTFOUND;
+		}
+		return rc;
+	}
+	case USER_OP_UPDATE:
+		user_cache_invalidate(usr->id);
+		rc = update_user(conn, usr);
+		break;
+	case USER_OP_DELETE:
+		user_cache_invalidate(usr->id);
+		rc = delete_user(conn, usr->id);
+		break;
+	}
+	return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
 
-	if (exit) {
-		printf("Error opening DB: %s\n", sqlite3_errmsg(users_db));
-		return NULL;
-	} else {
-		printf("DB opened successfully.\n");
+static uint32_t hash_username(const unsigned char *name) {
+	// fnv-1a
+	uint32_t hash = 2166136261u;
+	for (; *name != 0; ++name) {
+		hash = (hash ^ *name) * 16777619u;
 	}
-	sqlite3_close(users_db);
-	return (0);
+	return hash;
+}
+
+static void complete_cached(reactor_t *r, reactor_task_t *task) {
+	db_job_t *job = (db_job_t *)((char *)task - offsetof(db_job_t, task));
+	job->done(r, job);
+}
+
+// a read that began between the write and its commit may have cached the
+// old row, so the user is dropped again once the write is durable
+static void write_committed(reactor_t *r, db_job_t *job) {
+	user_job_t *user_job = (user_job_t *)job;
+	user_cache_invalidate(user_job->user.id);
+	user_job->then(r, job);
 }
 
-void open_database_thread() {
-	pthread_t id;
-	pthread_create(&id, NULL, database_thread_main, NULL);
+void users_db_submit(reactor_t *r, user_job_t *job, user_op_t op,
+					 db_done_fn done) {
+	job->op = op;
+	job->job.reactor = r;
+	job->job.exec = run_user_job;
+	job->job.done = done;
+
+	bool cached = false;
+	if (op == USER_OP_READ) {
+		cached = user_cache_get(job->user.id, &job->user);
+	} else if (op == USER_OP_FIND) {
+		cached = user_cache_find(job->user.username, &job->user);
+	}
+	if (cached) {
+		job->job.result = SQLITE_OK;
+		job->job.task.run = complete_cached;
+		reactor_post(r, &job->job.task);
+		return;
+	}
+	if (op == USER_OP_UPDATE || op == USER_OP_DELETE) {
+		job->then = done;
+		job->job.done = write_committed;
+	}
+	// reads run on the reader connections, keeping a user on one reader
+	// keeps their reads in order
+	job->job.read_only = op == USER_OP_READ || op == USER_OP_FIND;
+	job->job.key = op == USER_OP_FIND ? hash_username(job->user.username)
+									  : job->user.id;
+	db_pool_submit(&job->job);
 }
@@ -18,16 +18,49 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #ifndef USERS_DB_H
 #define USERS_DB_H
 
+#include "db_pool.h"
+#include <sqlite3.h>
 #include <stdint.h>
 
+#define USER_EMAIL_MAX 256
+#define USER_NAME_MAX 64
+
 typedef struct {
     uint32_t id;
-    const unsigned char* email;
-    const unsigned char* username;
+    unsigned char email[USER_EMAIL_MAX];
+    unsigned char username[USER_NAME_MAX];
     unsigned char psswd_hash[128];
     unsigned char psswd_salt[16] ;
 } user_t;
 
-void open_database_thread();
+typedef enum {
+    USER_OP_CREATE,
+    USER_OP_READ,
+    USER_OP_UPDATE,
+    USER_OP_DELETE,
+    // a read that looks the user up by username instead of id
+    USER_OP_FIND,
+} user_op_t;
+
+// a user_t making a round trip through the database workers
+typedef struct {
+    db_job_t job;
+    user_op_t op;
+    user_t user;
+    // whatever the submitter needs back in done, e.g. a connection id
+    void *ctx;
+    // the submitter's done while a write waits to drop the cached user
+    db_done_fn then;
+} user_job_t;
+
+// creates the users table, handed to db_pool_start
+int users_db_setup(sqlite3 *db);
+
+// runs op against job->user on a database worker and hands the job back to
+// done on r. job.result is SQLITE_OK on success and SQLITE_NOTFOUND when no
+// user has the id, or the username for USER_OP_FIND. reads the user cache
+// can answer skip the database and complete on r's next turn
+void users_db_submit(reactor_t *r, user_job_t *job, user_op_t op,
+                     db_done_fn done);
 
 #endif // USERS_DB_H
@@ -0,0 +1,269 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "bufpool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OVERSIZED_CLASS UINT32_MAX
+
+static const size_t class_sizes[PORTAL_POOL_CLASS_COUNT] = {
+	64, 256, 1024, 4096, PORTAL_POOL_MAX_SIZE,
+};
+
+typedef struct pool pool_t;
+
+// sits in front of every block, kept at 16 bytes so payloads stay aligned
+typedef struct {
+	pool_t *owner;
+	uint32_t cls;
+	uint32_t reserved;
+} block_header_t;
+
+_Static_assert(sizeof(block_header_t) == 16,
+			   "block header must keep payloads 16 byte aligned");
+
+// free blocks link through their payload
+typedef struct free_block {
+	struct free_block *next;
+} free_block_t;
+
+typedef struct {
+	// only touched by the owning thread
+	free_block_t *local;
+	uint32_t local_count;
+	uint32_t local_max;
+	// other threads push freed blocks here, the owner takes the whole
+	// stack at once so there is no ABA to worry about
+	_Alignas(64) _Atomic(free_block_t *) remote;
+} pool_class_t;
+
+// counters are only written by the owner, atomics just make reading them
+// from another thread well defined
+typedef struct {
+	atomic_uint_fast64_t hits;
+	atomic_uint_fast64_t misses;
+	atomic_uint_fast64_t oversized;
+	atomic_uint_fast64_t remote_frees;
+	atomic_uint_fast64_t trimmed;
+} pool_counters_t;
+
+// blocks a pool handed out can come back to it after its thread exits, so
+// a pool is never freed. an exiting thread leaves it, cached blocks and
+// all, for the next thread that needs one
+struct pool {
+	pool_class_t classes[PORTAL_POOL_CLASS_COUNT];
+	pool_counters_t counters;
+	atomic_bool in_use;
+	pool_t *next;
+};
+
+static _Thread_local pool_t *thread_pool;
+// every pool ever created, new threads look here for one to take over
+static _Atomic(pool_t *) all_pools;
+// runs release_pool when a thread that has a pool exits
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void count(atomic_uint_fast64_t *counter, uint64_t n) {
+	uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+	atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+static uint32_t class_of(size_t size) {
+	for (uint32_t cls = 0; cls < PORTAL_POOL_CLASS_COUNT; ++cls) {
+		if (size <= class_sizes[cls]) {
+			return cls;
+		}
+	}
+	return OVERSIZED_CLASS;
+}
+
+// the release orders the owner's last writes to its free lists before
+// the next owner's acquire
+static void release_pool(void *arg) {
+	pool_t *pool = arg;
+	thread_pool = NULL;
+	atomic_store_explicit(&pool->in_use, false, memory_order_release);
+}
+
+static void create_pool_key() { pthread_key_create(&pool_key, release_pool); }
+
+// a pool an exited thread left behind, NULL if every pool has an owner
+static pool_t *adopt_pool() {
+	for (pool_t *pool = atomic_load(&all_pools); pool != NULL;
+		 pool = pool->next) {
+		bool expected = false;
+		if (!atomic_load_explicit(&pool->in_use, memory_order_relaxed) &&
+			atomic_compare_exchange_strong_explicit(&pool->in_use, &expected,
+													true, memory_order_acquire,
+													memory_order_relaxed)) {
+			return pool;
+		}
+	}
+	return NULL;
+}
+
+static pool_t *new_pool() {
+	pool_t *pool = aligned_alloc(64, sizeof(pool_t));
+	if (pool == NULL) {
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+	for (uint32_t cls = 0; cls < PORTAL_POOL_CLASS_COUNT; ++cls) {
+		uint32_t max = PORTAL_POOL_CACHE_BYTES / class_sizes[cls];
+		pool->classes[cls].local_max = max > 4 ? max : 4;
+	}
+	atomic_init(&pool->in_use, true);
+
+	pool->next = atomic_load(&all_pools);
+	while (!atomic_compare_exchange_weak(&all_pools, &pool->next, pool)) {
+	}
+	return pool;
+}
+
+static pool_t *get_pool() {
+	if (thread_pool != NULL) {
+		return thread_pool;
+	}
+
+	pthread_once(&pool_key_once, create_pool_key);
+	pool_t *pool = adopt_pool();
+	if (pool == NULL) {
+		pool = new_pool();
+		if (pool == NULL) {
+			return NULL;
+		}
+	}
+	if (pthread_setspecific(pool_key, pool) != 0) {
+		// without the key the pool would never be handed back
+		release_pool(pool);
+		return NULL;
+	}
+	thread_pool = pool;
+	return pool;
+}
+
+static free_block_t *to_free_block(block_header_t *header) {
+	return (free_block_t *)(header + 1);
+}
+
+static block_header_t *to_header(void *ptr) {
+	return (block_header_t *)ptr - 1;
+}
+
+void *portal_pool_alloc(size_t size) {
+	pool_t *pool = get_pool();
+	uint32_t cls = class_of(size);
+	if (pool == NULL || cls == OVERSIZED_CLASS) {
+		block_header_t *header = malloc(sizeof(block_header_t) + size);
+		if (header == NULL) {
+			return NULL;
+		}
+		header->owner = NULL;
+		header->cls = OVERSIZED_CLASS;
+		if (pool != NULL) {
+			count(&pool->counters.oversized, 1);
+		}
+		return header + 1;
+	}
+
+	pool_class_t *c = &pool->classes[cls];
+	if (c->local == NULL) {
+		// take back everything other threads have freed in one go
+		free_block_t *adopted = atomic_exchange_explicit(
+			&c->remote, NULL, memory_order_acquire);
+		uint32_t adopted_count = 0;
+		for (free_block_t *b = adopted; b != NULL; b = b->next) {
+			adopted_count++;
+		}
+		c->local = adopted;
+		c->local_count = adopted_count;
+		count(&pool->counters.remote_frees, adopted_count);
+	}
+
+	if (c->local != NULL) {
+		free_block_t *block = c->local;
+		c->local = block->next;
+		c->local_count--;
+		count(&pool->counters.hits, 1);
+		return block;
+	}
+
+	block_header_t *header = malloc(sizeof(block_header_t) + class_sizes[cls]);
+	if (header == NULL) {
+		return NULL;
+	}
+	header->owner = pool;
+	header->cls = cls;
+	count(&pool->counters.misses, 1);
+	return header + 1;
+}
+
+void portal_pool_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	block_header_t *header = to_header(ptr);
+	pool_t *owner = header->owner;
+	if (owner == NULL) {
+		free(header);
+		return;
+	}
+
+	pool_class_t *c = &owner->classes[header->cls];
+	free_block_t *block = to_free_block(header);
+	if (owner != thread_pool) {
+		block->next = atomic_load_explicit(&c->remote, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(
+			&c->remote, &block->next, block, memory_order_release,
+			memory_order_relaxed)) {
+		}
+		return;
+	}
+
+	if (c->local_count >= c->local_max) {
+		// a burst is over, do not keep its peak around forever
+		count(&owner->counters.trimmed, 1);
+		free(header);
+		return;
+	}
+	block->next = c->local;
+	c->local = block;
+	c->local_count++;
+}
+
+size_t portal_pool_block_size(size_t size) {
+	uint32_t cls = class_of(size);
+	return cls == OVERSIZED_CLASS ? size : class_sizes[cls];
+}
+
+void portal_pool_stats(portal_pool_stats_t *stats) {
+	memset(stats, 0, sizeof(*stats));
+	for (pool_t *pool = atomic_load(&all_pools); pool != NULL;
+		 pool = pool->next) {
+		stats->hits += atomic_load(&pool->counters.hits);
+		stats->misses += atomic_load(&pool->counters.misses);
+		stats->oversized += atomic_load(&pool->counters.oversized);
+		stats->remote_frees += atomic_load(&pool->counters.remote_frees);
+		stats->trimmed += atomic_load(&pool->counters.trimmed);
+	}
+}
@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// packet buffers come from per-thread pools of fixed size classes, so the
+// steady state of decoding and fanning out messages never hits malloc.
+// anything larger than the biggest class goes straight to malloc
+#define PORTAL_POOL_CLASS_COUNT 5
+#define PORTAL_POOL_MAX_SIZE (64 * 1024)
+// free blocks a thread keeps per class before handing them back to malloc
+#define PORTAL_POOL_CACHE_BYTES (1024 * 1024)
+
+typedef struct {
+    // requests served from a free list
+    uint64_t hits;
+    // requests that had to allocate a new block
+    uint64_t misses;
+    // requests larger than any class
+    uint64_t oversized;
+    // blocks freed by another thread and taken back by their owner
+    uint64_t remote_frees;
+    // free blocks beyond the cache limit given back to malloc
+    uint64_t trimmed;
+} portal_pool_stats_t;
+
+// allocates from the calling thread's pool, the block may be freed on any
+// thread and finds its way back to the pool it came from
+void *portal_pool_alloc(size_t size);
+void portal_pool_free(void *ptr);
+
+// bytes a request of this size really gets, callers that can use the
+// slack such as growable buffers should ask for this much
+size_t portal_pool_block_size(size_t size);
+
+// sums the counters of every pool, including ones whose thread has exited
+void portal_pool_stats(portal_pool_stats_t *stats);
+
+#endif // BUFPOOL_H
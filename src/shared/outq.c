@@ -0,0 +1,257 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "outq.h"
+#include "bufpool.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// appends the unsent part of a frame as up to two iovecs
+static int frame_iov(struct iovec *iov, const void *header, size_t header_size,
+					 const void *data, size_t data_size, size_t sent) {
+	int count = 0;
+	if (sent < header_size) {
+		iov[count].iov_base = (unsigned char *)header + sent;
+		iov[count].iov_len = header_size - sent;
+		count++;
+		sent = 0;
+	} else {
+		sent -= header_size;
+	}
+
+	if (data_size > sent) {
+		iov[count].iov_base = (unsigned char *)data + sent;
+		iov[count].iov_len = data_size - sent;
+		count++;
+	}
+	return count;
+}
+
+static ssize_t write_iov(int fd, struct iovec *iov, int iov_count,
+						 int flags) {
+	struct msghdr msg = {0};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_count;
+
+	ssize_t written;
+	do {
+		// a dead peer should fail the write, not kill the process
+		written = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+	} while (written < 0 && errno == EINTR);
+
+	if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return written;
+}
+
+ssize_t portal_write_frame(int fd, const packet_t *packet, size_t sent) {
+	portal_wire_header_t header;
+	portal_encode_header(packet, &header);
+
+	struct iovec iov[2];
+	int iov_count = frame_iov(iov, &header, PORTAL_HEADER_SIZE, packet->data,
+							  packet->data_size, sent);
+	return write_iov(fd, iov, iov_count, 0);
+}
+
+ssize_t portal_write_raw(int fd, const void *frame, size_t size, size_t sent) {
+	struct iovec iov = {.iov_base = (unsigned char *)frame + sent,
+						.iov_len = size - sent};
+	return write_iov(fd, &iov, 1, 0);
+}
+
+static portal_outq_entry_t *entry_at(portal_outq_t *q, uint32_t i) {
+	return &q->entries[(q->head + i) & (q->cap - 1)];
+}
+
+static size_t entry_left(const portal_outq_entry_t *entry) {
+	return entry->header_size + entry->data_size - entry->sent;
+}
+
+static void release_entry(portal_outq_entry_t *entry) {
+	if (entry->release != NULL) {
+		entry->release(entry->release_ctx);
+	}
+}
+
+void portal_outq_init(portal_outq_t *q) { memset(q, 0, sizeof(*q)); }
+
+void portal_outq_clear(portal_outq_t *q) {
+	for (uint32_t i = 0; i < q->count; ++i) {
+		release_entry(entry_at(q, i));
+	}
+	portal_pool_free(q->entries);
+	portal_outq_init(q);
+}
+
+// hands out the next free slot, doubling the ring when it is full
+static portal_outq_entry_t *reserve_entry(portal_outq_t *q) {
+	if (q->count == q->cap) {
+		uint32_t cap = q->cap ? q->cap * 2 : PORTAL_OUTQ_INIT_CAP;
+		portal_outq_entry_t *entries =
+			portal_pool_alloc(sizeof(portal_outq_entry_t) * cap);
+		if (entries == NULL) {
+			perror("Failed to allocate output queue");
+			return NULL;
+		}
+		for (uint32_t i = 0; i < q->count; ++i) {
+			entries[i] = *entry_at(q, i);
+		}
+		portal_pool_free(q->entries);
+		q->entries = entries;
+		q->cap = cap;
+		q->head = 0;
+	}
+
+	q->count++;
+	return entry_at(q, q->count - 1);
+}
+
+int portal_outq_push(portal_outq_t *q, const packet_t *packet, size_t sent,
+					 portal_release_fn release, void *release_ctx) {
+	portal_outq_entry_t *entry = reserve_entry(q);
+	if (entry == NULL) {
+		return PORTAL_FAIL;
+	}
+
+	portal_encode_header(packet, &entry->header);
+	entry->header_size = PORTAL_HEADER_SIZE;
+	entry->data = packet->data;
+	entry->data_size = packet->data_size;
+	entry->sent = sent;
+	entry->release = release;
+	entry->release_ctx = release_ctx;
+	q->bytes += entry_left(entry);
+	return PORTAL_OK;
+}
+
+int portal_outq_push_raw(portal_outq_t *q, const void *frame, size_t size,
+						 size_t sent, portal_release_fn release,
+						 void *release_ctx) {
+	portal_outq_entry_t *entry = reserve_entry(q);
+	if (entry == NULL) {
+		return PORTAL_FAIL;
+	}
+
+	entry->header_size = 0;
+	entry->data = frame;
+	entry->data_size = size;
+	entry->sent = sent;
+	entry->release = release;
+	entry->release_ctx = release_ctx;
+	q->bytes += entry_left(entry);
+	return PORTAL_OK;
+}
+
+uint32_t portal_outq_drop_oldest(portal_outq_t *q, size_t max_bytes) {
+	if (q->count == 0) {
+		return 0;
+	}
+
+	// frames still referenced by a send in flight cannot go either
+	uint32_t keep = q->pinned;
+	if (keep == 0 && entry_at(q, 0)->sent > 0) {
+		keep = 1;
+	}
+	if (keep >= q->count) {
+		return 0;
+	}
+
+	uint32_t dropped = 0;
+	while (q->bytes > max_bytes && keep + dropped < q->count) {
+		portal_outq_entry_t *entry = entry_at(q, keep + dropped);
+		q->bytes -= entry_left(entry);
+		release_entry(entry);
+		dropped++;
+	}
+	if (dropped == 0) {
+		return 0;
+	}
+
+	// slide the kept frames forward over the dropped ones
+	for (uint32_t i = keep; i-- > 0;) {
+		*entry_at(q, i + dropped) = *entry_at(q, i);
+	}
+	q->head = (q->head + dropped) & (q->cap - 1);
+	q->count -= dropped;
+	return dropped;
+}
+
+void portal_outq_prepare(const portal_outq_t *q, portal_outq_batch_t *batch) {
+	batch->iov_count = 0;
+	uint32_t i = 0;
+	for (; i < q->count && batch->iov_count + 2 <= PORTAL_OUTQ_MAX_IOV; ++i) {
+		const portal_outq_entry_t *entry =
+			&q->entries[(q->head + i) & (q->cap - 1)];
+		batch->headers[i] = entry->header;
+		batch->iov_count += frame_iov(
+			batch->iov + batch->iov_count, &batch->headers[i],
+			entry->header_size, entry->data, entry->data_size, entry->sent);
+	}
+	batch->frames = i;
+	batch->more = i < q->count;
+}
+
+void portal_outq_consume(portal_outq_t *q, size_t written) {
+	q->bytes -= written;
+
+	// retire every frame the kernel fully accepted
+	while (written > 0) {
+		portal_outq_entry_t *entry = entry_at(q, 0);
+		size_t left = entry_left(entry);
+		if (written < left) {
+			entry->sent += written;
+			break;
+		}
+
+		written -= left;
+		release_entry(entry);
+		q->head = (q->head + 1) & (q->cap - 1);
+		q->count--;
+	}
+
+	if (q->count == 0) {
+		// a drained queue gives its ring back so idle sockets stay small
+		portal_pool_free(q->entries);
+		portal_outq_init(q);
+	}
+}
+
+int portal_outq_flush(portal_outq_t *q, int fd) {
+	while (q->count > 0) {
+		portal_outq_batch_t batch;
+		portal_outq_prepare(q, &batch);
+
+		// tell the stack more is coming so batches share full segments
+		int flags = batch.more ? MSG_MORE : 0;
+		ssize_t written = write_iov(fd, batch.iov, batch.iov_count, flags);
+		if (written < 0) {
+			perror("Failed to send packet");
+			return PORTAL_FAIL;
+		}
+		if (written == 0) {
+			return PORTAL_AGAIN;
+		}
+		portal_outq_consume(q, written);
+	}
+	return PORTAL_OK;
+}
@@ -0,0 +1,100 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include "socket_util.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// most frames handed to the kernel in one sendmsg, two iovecs per frame
+#define PORTAL_OUTQ_MAX_IOV 64
+
+#define PORTAL_OUTQ_INIT_CAP 8
+
+// called once the kernel has taken every byte of a queued payload
+typedef void (*portal_release_fn)(void *ctx);
+
+typedef struct {
+    portal_wire_header_t header;
+    // 0 when data already holds a fully encoded frame
+    uint8_t header_size;
+    const void *data;
+    size_t data_size;
+    // bytes of header and payload already written
+    size_t sent;
+    portal_release_fn release;
+    void *release_ctx;
+} portal_outq_entry_t;
+
+// pending output for one socket kept as a ring of entries so queueing a
+// frame is a struct copy, payloads are referenced and never copied
+typedef struct {
+    portal_outq_entry_t *entries;
+    uint32_t cap, head, count;
+    size_t bytes;
+    // frames at the front an asynchronous send still points into
+    uint32_t pinned;
+} portal_outq_t;
+
+// the front of a queue laid out for a single sendmsg, headers are copied
+// so the batch stays valid while more frames are queued behind it
+typedef struct {
+    struct iovec iov[PORTAL_OUTQ_MAX_IOV];
+    // every frame takes at least one iovec
+    portal_wire_header_t headers[PORTAL_OUTQ_MAX_IOV];
+    int iov_count;
+    uint32_t frames;
+    // more frames are queued behind this batch
+    bool more;
+} portal_outq_batch_t;
+
+void portal_outq_init(portal_outq_t *q);
+// drops every pending frame, releasing their payloads
+void portal_outq_clear(portal_outq_t *q);
+
+// queues a frame whose first sent bytes have already been written
+int portal_outq_push(portal_outq_t *q, const packet_t *packet, size_t sent,
+                     portal_release_fn release, void *release_ctx);
+// same as portal_outq_push for a frame that was encoded up front
+int portal_outq_push_raw(portal_outq_t *q, const void *frame, size_t size,
+                         size_t sent, portal_release_fn release,
+                         void *release_ctx);
+
+// drops whole unsent frames from the front until at most max_bytes are
+// queued, a partly written or pinned frame is kept so the stream stays
+// framed. returns how many frames were dropped
+uint32_t portal_outq_drop_oldest(portal_outq_t *q, size_t max_bytes);
+
+// fills batch with as many queued frames as fit
+void portal_outq_prepare(const portal_outq_t *q, portal_outq_batch_t *batch);
+// retires written bytes from the front, releasing every completed frame
+void portal_outq_consume(portal_outq_t *q, size_t written);
+
+// writes as much as the socket takes, PORTAL_AGAIN if data is left over
+int portal_outq_flush(portal_outq_t *q, int fd);
+
+// writes header and payload straight from the packet with one syscall,
+// returns the number of bytes written or -1 on a hard error
+ssize_t portal_write_frame(int fd, const packet_t *packet, size_t sent);
+// writes an already encoded frame, same return values as above
+ssize_t portal_write_raw(int fd, const void *frame, size_t size, size_t sent);
+
+#endif // OUTQ_H
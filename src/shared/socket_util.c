@@ -16,12 +16,18 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
 #include "socket_util.h"
+#include "bufpool.h"
+#include "outq.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 int createTCPIPv4Socket() { return socket(AF_INET, SOCK_STREAM, 0); }
 
@@ -37,105 +43,243 @@ struct sockaddr_in createIPv4Address(char *ip, unsigned int port) {
 	return address;
 }
 
-static void serialize_packet(packet_t *packet, unsigned char **buffer,
-							 size_t *buffer_size) {
-	*buffer_size = sizeof(packet_header_t) + sizeof(size_t) + packet->data_size;
+void portal_encode_header(const packet_t *packet,
+						  portal_wire_header_t *wire) {
+	wire->magic = htons(PORTAL_MAGIC);
+	wire->version = PORTAL_VERSION;
+	wire->flags = packet->header.flags;
+	wire->opcode = htons(packet->header.opcode);
+	wire->id = htons(packet->header.id);
+	wire->length = htonl((uint32_t)packet->data_size);
+}
 
-	*buffer = malloc(*buffer_size);
-	if (*buffer == NULL) {
-		perror("Failed to allocate buffer");
-		return;
+// validates the fixed size header and fills in the packet's header fields
+static int deserialize_header(const unsigned char *buffer, packet_t *packet) {
+	portal_wire_header_t wire;
+	memcpy(&wire, buffer, PORTAL_HEADER_SIZE);
+
+	if (ntohs(wire.magic) != PORTAL_MAGIC) {
+		printf("Error: bad packet magic\n");
+		return PORTAL_FAIL;
+	}
+	if (wire.version != PORTAL_VERSION) {
+		printf("Error: unsupported protocol version %u\n", wire.version);
+		return PORTAL_FAIL;
 	}
 
-	// pointer for tracking position in buffer
-	unsigned char *ptr = *buffer;
+	packet->header.version = wire.version;
+	packet->header.flags = wire.flags;
+	packet->header.opcode = ntohs(wire.opcode);
+	packet->header.id = ntohs(wire.id);
+	packet->data_size = ntohl(wire.length);
+	return PORTAL_OK;
+}
 
-	// serialize header
-	int network_id = htonl(packet->header.id);
-	memcpy(ptr, &network_id, sizeof(int));
-	ptr += sizeof(int);
+// copies len bytes starting offset bytes past the ring head, handling wrap
+static void ring_copy_out(portal_decoder_t *d, size_t offset, void *dst,
+						  size_t len) {
+	size_t start = (d->head + offset) % d->cap;
+	size_t first = d->cap - start;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(dst, d->buf + start, first);
+	memcpy((unsigned char *)dst + first, d->buf, len - first);
+}
+
+// moves the buffered bytes into a larger linear buffer
+static int ring_grow(portal_decoder_t *d, size_t cap) {
+	// the ring can use the whole pool block
+	cap = portal_pool_block_size(cap);
+	unsigned char *buf = portal_pool_alloc(cap);
+	if (buf == NULL) {
+		perror("Failed to allocate decoder buffer");
+		return PORTAL_FAIL;
+	}
+	if (d->len > 0) {
+		ring_copy_out(d, 0, buf, d->len);
+	}
+	portal_pool_free(d->buf);
+	d->buf = buf;
+	d->cap = cap;
+	d->head = 0;
+	return PORTAL_OK;
+}
 
-	memcpy(ptr, packet->header.type, sizeof(packet->header.type));
-	ptr += sizeof(packet->header.type);
+void portal_decoder_init(portal_decoder_t *d) { memset(d, 0, sizeof(*d)); }
 
-	// serialize data size
-	size_t network_data_size = htonl(packet->data_size);
-	memcpy(ptr, &network_data_size, sizeof(size_t));
-	ptr += sizeof(size_t);
+void portal_decoder_free(portal_decoder_t *d) {
+	portal_pool_free(d->buf);
+	memset(d, 0, sizeof(*d));
+}
 
-	// serialize data if exists
-	if (packet->data_size > 0 && packet->data != NULL) {
-		memcpy(ptr, packet->data, packet->data_size);
+void portal_decoder_trim(portal_decoder_t *d) {
+	if (d->len == 0) {
+		portal_decoder_free(d);
 	}
 }
 
-static void deserialize_packet(unsigned char *buffer, packet_t *packet) {
-	unsigned char *ptr = buffer;
+int portal_decoder_fill(portal_decoder_t *d, int fd) {
+	if (d->buf == NULL && ring_grow(d, PORTAL_DECODER_INIT_SIZE) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
 
-	// deserialize header
-	int network_id;
-	memcpy(&network_id, ptr, sizeof(int));
-	packet->header.id = ntohl(network_id);
-	ptr += sizeof(int);
+	// a full ring holds complete frames nobody has taken yet, and a read of
+	// 0 bytes would look like the peer closing
+	size_t space = d->cap - d->len;
+	if (space == 0) {
+		return PORTAL_AGAIN;
+	}
 
-	memcpy(packet->header.type, ptr, sizeof(packet->header.type));
-	ptr += sizeof(packet->header.type);
+	// the free space is at most two runs, so read into both in one call
+	size_t tail = (d->head + d->len) % d->cap;
+	struct iovec iov[2];
+	int iov_count = 1;
+	iov[0].iov_base = d->buf + tail;
+	iov[0].iov_len = d->cap - tail < space ? d->cap - tail : space;
+	if (iov[0].iov_len < space) {
+		iov[1].iov_base = d->buf;
+		iov[1].iov_len = space - iov[0].iov_len;
+		iov_count = 2;
+	}
 
-	// deserialize data_size
-	size_t network_data_size;
-	memcpy(&network_data_size, ptr, sizeof(size_t));
-	packet->data_size = ntohl(network_data_size);
-	ptr += sizeof(size_t);
+	ssize_t recv_bytes;
+	do {
+		recv_bytes = readv(fd, iov, iov_count);
+	} while (recv_bytes < 0 && errno == EINTR);
 
-	// deserialize the actual data
-	if (packet->data_size > 0) {
-		packet->data = malloc(packet->data_size);
-		if (packet->data == NULL) {
-			perror("Failed to allocate memory for data");
-			return;
+	if (recv_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		// non-blocking socket has nothing left to read
+		return PORTAL_AGAIN;
+	}
+	if (recv_bytes == 0 || (recv_bytes < 0 && errno == ECONNRESET)) {
+		// peer closed the connection
+		return PORTAL_FAIL;
+	}
+	if (recv_bytes < 0) {
+		perror("Failed to recieve packet");
+		return PORTAL_FAIL;
+	}
+
+	d->len += recv_bytes;
+	return PORTAL_OK;
+}
+
+int portal_decoder_feed(portal_decoder_t *d, const void *data, size_t len) {
+	if (d->cap - d->len < len) {
+		size_t cap = d->cap ? d->cap : PORTAL_DECODER_INIT_SIZE;
+		while (cap - d->len < len) {
+			cap *= 2;
+		}
+		if (ring_grow(d, cap) != PORTAL_OK) {
+			return PORTAL_FAIL;
 		}
-		memcpy(packet->data, ptr, packet->data_size);
-	} else {
-		packet->data = NULL;
 	}
+
+	size_t tail = (d->head + d->len) % d->cap;
+	size_t first = d->cap - tail < len ? d->cap - tail : len;
+	memcpy(d->buf + tail, data, first);
+	memcpy(d->buf, (const unsigned char *)data + first, len - first);
+	d->len += len;
+	return PORTAL_OK;
 }
 
-int portal_send_packet(int fd, packet_t *packet) {
-	unsigned char *buffer;
-	size_t buffer_size;
+int portal_decoder_next(portal_decoder_t *d, packet_t *packet) {
+	if (d->len < PORTAL_HEADER_SIZE) {
+		return PORTAL_AGAIN;
+	}
 
-	serialize_packet(packet, &buffer, &buffer_size);
-	ssize_t sent_bytes = send(fd, buffer, buffer_size, 0);
+	unsigned char header[PORTAL_HEADER_SIZE];
+	ring_copy_out(d, 0, header, sizeof(header));
+	if (deserialize_header(header, packet) != PORTAL_OK) {
+		return PORTAL_FAIL;
+	}
 
-	if (sent_bytes == 0) {
-		perror("Failed to send packet");
-		free(buffer);
+	size_t data_size = packet->data_size;
+	if (data_size > PORTAL_MAX_PACKET_SIZE) {
+		printf("Error: packet of %zu bytes exceeds the limit\n", data_size);
 		return PORTAL_FAIL;
 	}
 
-	free(buffer);
+	size_t frame_size = PORTAL_HEADER_SIZE + data_size;
+	if (d->len < frame_size) {
+		// make sure the rest of the frame will fit once it arrives
+		if (frame_size > d->cap) {
+			return ring_grow(d, frame_size) == PORTAL_OK ? PORTAL_AGAIN
+														 : PORTAL_FAIL;
+		}
+		return PORTAL_AGAIN;
+	}
+
+	packet->data = NULL;
+	if (data_size > 0) {
+		packet->data = portal_pool_alloc(data_size);
+		if (packet->data == NULL) {
+			perror("Failed to allocate memory for data");
+			return PORTAL_FAIL;
+		}
+		ring_copy_out(d, PORTAL_HEADER_SIZE, packet->data, data_size);
+	}
+
+	d->head = (d->head + frame_size) % d->cap;
+	d->len -= frame_size;
+	if (d->len == 0) {
+		d->head = 0;
+	}
 	return PORTAL_OK;
 }
 
-int portal_recv_packet(int fd, packet_t *packet) {
-	// max buffer size is 1024
-	unsigned char buffer[1024];
+int portal_send_packet(int fd, packet_t *packet) {
+	size_t frame_size = PORTAL_HEADER_SIZE + packet->data_size;
+	size_t sent = 0;
 
-	ssize_t recv_bytes = recv(fd, buffer, sizeof(buffer), 0);
-	if (recv_bytes <= 0) {
-		perror("Failed to recieve packet");
-		return PORTAL_FAIL;
+	// header and payload go out as separate iovecs, nothing is copied
+	while (sent < frame_size) {
+		ssize_t written = portal_write_frame(fd, packet, sent);
+		if (written < 0) {
+			perror("Failed to send packet");
+			return PORTAL_FAIL;
+		}
+		if (written == 0) {
+			// socket buffer is full, wait until it drains
+			struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		sent += written;
 	}
 
-	deserialize_packet(buffer, packet);
 	return PORTAL_OK;
 }
 
+int portal_recv_packet(portal_decoder_t *d, int fd, packet_t *packet) {
+	while (true) {
+		int rc = portal_decoder_next(d, packet);
+		if (rc != PORTAL_AGAIN) {
+			return rc;
+		}
+
+		rc = portal_decoder_fill(d, fd);
+		if (rc != PORTAL_OK) {
+			return rc;
+		}
+	}
+}
+
 void portal_handle_msg(packet_t *packet) {
-	char buffer[packet->data_size];
-	strncpy(buffer, (char *)packet->data, packet->data_size);
+	if (packet->data_size < sizeof(portal_msg_prefix_t)) {
+		return;
+	}
+
+	portal_msg_prefix_t prefix;
+	memcpy(&prefix, packet->data, sizeof(prefix));
+	size_t text_size = packet->data_size - sizeof(prefix);
+
+	char buffer[text_size + 1];
+	memcpy(buffer, (char *)packet->data + sizeof(prefix), text_size);
 	// add null terminator
-	buffer[packet->data_size] = 0;
+	buffer[text_size] = 0;
 
-	printf("Client Message: %s\n", buffer);
+	printf("Message in room %u from %u: %s\n", ntohl(prefix.room),
+		   ntohl(prefix.sender), buffer);
 }
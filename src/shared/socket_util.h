@@ -18,14 +18,36 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #ifndef SOCKET_UTIL_H
 #define SOCKET_UTIL_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 #define PORTAL_OK 0
 #define PORTAL_FAIL 1
+#define PORTAL_AGAIN 2
+
+// "PT" marks the start of every frame
+#define PORTAL_MAGIC 0x5054
+#define PORTAL_VERSION 1
+
+// opcodes index straight into the server's handler table
+typedef enum {
+    PORTAL_OP_NONE = 0,
+    PORTAL_OP_MSG,
+    PORTAL_OP_JOIN,
+    PORTAL_OP_LEAVE,
+    PORTAL_OP_HISTORY,
+    PORTAL_OP_REGISTER,
+    PORTAL_OP_LOGIN,
+    PORTAL_OP_RESUME,
+    PORTAL_OP_LOGOUT,
+    PORTAL_OP_COUNT
+} portal_opcode_t;
 
 typedef struct {
-    int id;
-    char type[4];
+    uint16_t opcode;
+    uint16_t id;
+    uint8_t version;
+    uint8_t flags;
 } packet_header_t;
 
 typedef struct {
@@ -34,11 +56,111 @@ typedef struct {
     void *data;
 } packet_t;
 
+// frame header as laid out on the wire, every field big endian
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t opcode;
+    uint16_t id;
+    uint32_t length;
+} portal_wire_header_t;
+
+#define PORTAL_HEADER_SIZE sizeof(portal_wire_header_t)
+_Static_assert(sizeof(portal_wire_header_t) == 12,
+               "wire header must stay 12 bytes");
+
+// start of every PORTAL_OP_MSG payload, the utf-8 text follows it. the
+// server fills in sender before fanning the message out to the room, it
+// is the author's user id or 0 for a client that has not logged in
+typedef struct __attribute__((packed)) {
+    uint32_t room;
+    uint32_t sender;
+} portal_msg_prefix_t;
+
+// PORTAL_OP_JOIN and PORTAL_OP_LEAVE carry a single big endian room id
+
+// PORTAL_OP_HISTORY from a client asks for count messages of a room it has
+// joined starting at first_seq, all ones asks for the newest ones. like
+// the header, every field is big endian
+typedef struct __attribute__((packed)) {
+    uint32_t room;
+    uint64_t first_seq;
+    uint32_t count;
+} portal_history_request_t;
+
+// the server answers with a PORTAL_OP_HISTORY frame carrying this, then
+// the count PORTAL_OP_MSG frames numbered first_seq onwards
+typedef struct __attribute__((packed)) {
+    uint32_t room;
+    uint64_t first_seq;
+    uint32_t count;
+} portal_history_reply_t;
+
+// handed out by the server after a password check and opaque to clients.
+// the mac covers the fields before it as they are laid out here, every
+// one big endian
+#define PORTAL_SESSION_MAC_SIZE 32
+typedef struct __attribute__((packed)) {
+    uint32_t user_id;
+    // unix time in seconds
+    uint64_t expires;
+    uint64_t token_id;
+    uint8_t mac[PORTAL_SESSION_MAC_SIZE];
+} portal_session_token_t;
+
+// PORTAL_OP_REGISTER carries "email\0username\0password\0" and
+// PORTAL_OP_LOGIN "username\0password\0". PORTAL_OP_RESUME carries a
+// session token in place of a password and PORTAL_OP_LOGOUT the token to
+// revoke. the server answers all but logout with the same opcode and this
+typedef enum {
+    PORTAL_AUTH_OK = 0,
+    PORTAL_AUTH_DENIED,
+    // the server is hashing as many passwords as it can, try again later
+    PORTAL_AUTH_BUSY,
+    // too many attempts from this address
+    PORTAL_AUTH_LIMITED,
+    PORTAL_AUTH_INVALID,
+    PORTAL_AUTH_ERROR,
+} portal_auth_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t status;
+    uint32_t user_id;
+    // zeroed unless status is PORTAL_AUTH_OK
+    portal_session_token_t token;
+} portal_auth_reply_t;
+
+#define PORTAL_MAX_PACKET_SIZE (64 * 1024)
+#define PORTAL_DECODER_INIT_SIZE 4096
+
+// per-connection ring of received bytes that frames are parsed out of
+typedef struct {
+    unsigned char *buf;
+    size_t cap, head, len;
+} portal_decoder_t;
+
 int createTCPIPv4Socket();
 struct sockaddr_in createIPv4Address(char *ip, unsigned int port);
 
+void portal_encode_header(const packet_t *packet,
+                          portal_wire_header_t *wire);
 int portal_send_packet(int fd, packet_t *packet);
-int portal_recv_packet(int fd, packet_t *packet);
+int portal_recv_packet(portal_decoder_t *d, int fd, packet_t *packet);
+
+void portal_decoder_init(portal_decoder_t *d);
+void portal_decoder_free(portal_decoder_t *d);
+// releases the buffer once every buffered frame has been consumed
+void portal_decoder_trim(portal_decoder_t *d);
+// reads whatever the socket has into the ring in a single call.
+// PORTAL_AGAIN if the socket is drained or the ring is full of frames that
+// have not been taken out with portal_decoder_next yet
+int portal_decoder_fill(portal_decoder_t *d, int fd);
+// appends bytes that were received some other way, growing the ring to fit
+int portal_decoder_feed(portal_decoder_t *d, const void *data, size_t len);
+// pops the next complete packet, PORTAL_AGAIN if more bytes are needed.
+// the payload comes from the buffer pool, release it with portal_pool_free
+int portal_decoder_next(portal_decoder_t *d, packet_t *packet);
 
 // -- packet type handlers --
 void portal_handle_msg(packet_t *packet);